@@ -0,0 +1,353 @@
+// Benchmark driver for the virtual filesystem. It builds synthetic trees
+// of a given shape and size directly in memory, times the core tree
+// operations on them and prints the results as JSON.
+//
+// Usage: ./bench.out [--shape wide|deep|balanced] [--nodes N] [--out file]
+// Without --shape or --nodes every shape is run at 10^3 to 10^6 nodes.
+
+#define FILESYSTEM_NO_MAIN
+#include "main.c"
+
+// Folders per chain in the deep shape, and fan-out of the balanced shape
+#define DEEP_CHAIN_LENGTH 100
+#define BALANCED_FAN_OUT 10
+
+// The text format indents every line by depth, so deep trees above this
+// size are only round-tripped through the binary format
+#define DEEP_TEXT_LIMIT 100000
+
+// Nodes sampled for the lookup benchmarks, and how often the hottest
+// HOT_PATHS of them are resolved again
+#define LOOKUP_SAMPLES 100000
+#define HOT_PATHS 256
+#define HOT_PATH_ROUNDS 100
+
+// Substring queries answered from the trigram index
+#define LOCATE_QUERIES 1000
+
+typedef struct benchResult {
+    const char* shape;
+    size_t nodes;
+    const char* operation;
+    size_t operations;
+    double seconds;
+} benchResult;
+
+typedef struct benchRun {
+    benchResult* results;
+    size_t count;
+    size_t capacity;
+} benchRun;
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static void record(benchRun* run, const char* shape, size_t nodes, const char* operation, size_t operations, double seconds) {
+    if (run->count == run->capacity) {
+        run->capacity = run->capacity ? run->capacity * 2 : 64;
+        run->results = realloc(run->results, run->capacity * sizeof(benchResult));
+    }
+    benchResult result = {shape, nodes, operation, operations, seconds};
+    run->results[run->count++] = result;
+    fprintf(stderr, "%-9s %9zu %-16s %10.4fs %14.0f ops/s\n", shape, nodes, operation, seconds,
+            seconds > 0 ? operations / seconds : 0.0);
+}
+
+// stdout is pointed at /dev/null while commands that print are timed
+static int silenceStdout() {
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    int devNull = open("/dev/null", O_WRONLY);
+    dup2(devNull, STDOUT_FILENO);
+    close(devNull);
+    return saved;
+}
+
+static void restoreStdout(int saved) {
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+}
+
+static node* addNode(node* parent, enum nodeType type, size_t number) {
+    char name[32];
+    snprintf(name, sizeof(name), type == Folder ? "d%zu" : "f%zu.txt", number);
+    node* item = createNode(name, type);
+    appendChild(parent, item);
+    return item;
+}
+
+// Builds a tree of 'nodes' nodes (root included) under 'root'
+static void buildTree(node* root, const char* shape, size_t nodes) {
+    size_t created = 1;
+    if (strcmp(shape, "wide") == 0) {
+        // One folder holding everything else
+        node* folder = addNode(root, Folder, created++);
+        while (created < nodes) addNode(folder, File, created++);
+    } else if (strcmp(shape, "deep") == 0) {
+        // Chains of nested folders, each ending in a file
+        while (created < nodes) {
+            node* folder = root;
+            for (size_t depth = 0; depth < DEEP_CHAIN_LENGTH && created + 1 < nodes; depth++) {
+                folder = addNode(folder, Folder, created++);
+            }
+            addNode(folder, File, created++);
+        }
+    } else {
+        // Breadth-first: every folder gets BALANCED_FAN_OUT children, half
+        // of them folders, until the node budget runs out
+        size_t capacity = nodes;
+        nodeId* queue = malloc(capacity * sizeof(nodeId));
+        size_t head = 0, tail = 0;
+        queue[tail++] = idOf(root);
+        while (created < nodes && head < tail) {
+            node* folder = nodeAt(queue[head++]);
+            for (int i = 0; i < BALANCED_FAN_OUT && created < nodes; i++) {
+                if (i % 2 == 0) {
+                    queue[tail++] = idOf(addNode(folder, Folder, created++));
+                } else {
+                    addNode(folder, File, created++);
+                }
+            }
+        }
+        free(queue);
+    }
+}
+
+// Picks up to LOOKUP_SAMPLES nodes spread evenly over the tree
+static size_t sampleNodes(node* root, nodeId* samples) {
+    size_t total = activePool->liveNodes;
+    size_t stride = (total + LOOKUP_SAMPLES - 1) / LOOKUP_SAMPLES;
+    size_t count = 0, index = 0;
+    for (node* item = nextPreorder(root, root); item && count < LOOKUP_SAMPLES; item = nextPreorder(item, root)) {
+        if (index++ % stride == 0) samples[count++] = idOf(item);
+    }
+    return count;
+}
+
+static void absolutePath(node* item, char* path, size_t size) {
+    char* end = path + size - 1;
+    *end = '\0';
+    for (; parentOf(item); item = parentOf(item)) {
+        size_t length = strlen(nameOf(item));
+        end -= length;
+        memcpy(end, nameOf(item), length);
+        *--end = '/';
+    }
+    memmove(path, end, strlen(end) + 1);
+}
+
+static void sortAll(node* root, const char* criterion) {
+    for (node* item = root; item; item = nextPreorder(item, root)) {
+        if (item->type == Folder) sortDirectory(item, criterion);
+    }
+}
+
+static void runShape(benchRun* run, const char* shape, size_t nodes) {
+    activePool = poolCreate();
+    node* root = createNode("/", Folder);
+
+    double start = now();
+    buildTree(root, shape, nodes);
+    record(run, shape, nodes, "insert", nodes - 1, now() - start);
+
+    // Lookups by name within the parent, then by absolute path
+    nodeId* samples = malloc(LOOKUP_SAMPLES * sizeof(nodeId));
+    size_t sampleCount = sampleNodes(root, samples);
+    start = now();
+    size_t found = 0;
+    for (size_t i = 0; i < sampleCount; i++) {
+        node* item = nodeAt(samples[i]);
+        found += getNodeTypeless(parentOf(item), nameOf(item)) == item;
+    }
+    record(run, shape, nodes, "lookup", sampleCount, now() - start);
+
+    // Paths of deep nodes can be long, so bound the buffer by the chain
+    size_t pathSize = (DEEP_CHAIN_LENGTH + 2) * 24;
+    char* path = malloc(pathSize);
+    double elapsed = 0;
+    for (size_t i = 0; i < sampleCount; i++) {
+        absolutePath(nodeAt(samples[i]), path, pathSize);
+        start = now();
+        found += parsePath(root, path, root) != NULL;
+        elapsed += now() - start;
+    }
+    record(run, shape, nodes, "parsePath", sampleCount, elapsed);
+
+    // The same few hundred paths over and over, as a busy shell would
+    size_t hotPaths = sampleCount < HOT_PATHS ? sampleCount : HOT_PATHS;
+    size_t repeats = 0;
+    elapsed = 0;
+    for (size_t round = 0; round < HOT_PATH_ROUNDS; round++) {
+        for (size_t i = 0; i < hotPaths; i++) {
+            absolutePath(nodeAt(samples[i * (sampleCount / hotPaths)]), path, pathSize);
+            start = now();
+            parsePath(root, path, root);
+            elapsed += now() - start;
+            repeats++;
+        }
+    }
+    record(run, shape, nodes, "parsePathRepeat", repeats, elapsed);
+    free(path);
+    free(samples);
+    if (found != 2 * sampleCount) fprintf(stderr, "warning: %zu of %zu lookups failed\n", 2 * sampleCount - found, 2 * sampleCount);
+
+    int saved = silenceStdout();
+    start = now();
+    lsrecursive(root, ListPlain);
+    elapsed = now() - start;
+    restoreStdout(saved);
+    record(run, shape, nodes, "lsrecursive", nodes, elapsed);
+
+    // Every file whose number ends in 7, on all cores
+    char* tests[] = {"-name", "*7.txt", "-type", "f"};
+    saved = silenceStdout();
+    start = now();
+    findNodes(root, root, "/", tests, 4);
+    elapsed = now() - start;
+    restoreStdout(saved);
+    record(run, shape, nodes, "find", nodes, elapsed);
+
+    // Build the trigram index on all cores, then look up file numbers
+    start = now();
+    trigramBuildIndex();
+    record(run, shape, nodes, "locateIndex", nodes, now() - start);
+    char query[32];
+    saved = silenceStdout();
+    start = now();
+    for (size_t i = 0; i < LOCATE_QUERIES; i++) {
+        snprintf(query, sizeof(query), "f%zu.", i * 7919 % nodes);
+        locate(root, query);
+    }
+    elapsed = now() - start;
+    restoreStdout(saved);
+    record(run, shape, nodes, "locate", LOCATE_QUERIES, elapsed);
+    trigramReset(); // The loads below use pools of their own
+
+    // Save and load round trips in both formats
+    char textFile[] = "/tmp/bench_tree_XXXXXX";
+    char binaryFile[] = "/tmp/bench_snap_XXXXXX";
+    close(mkstemp(textFile));
+    close(mkstemp(binaryFile));
+    int textRoundTrip = strcmp(shape, "deep") != 0 || nodes <= DEEP_TEXT_LIMIT;
+    if (textRoundTrip) {
+        start = now();
+        saveDirectory(root, textFile);
+        record(run, shape, nodes, "save", nodes, now() - start);
+    }
+    start = now();
+    saveSnapshot(root, binaryFile);
+    record(run, shape, nodes, "saveBinary", nodes, now() - start);
+
+    treePool* benchPool = activePool;
+    if (textRoundTrip) {
+        activePool = poolCreate();
+        start = now();
+        node* loaded = loadDirectory(textFile);
+        record(run, shape, nodes, "load", nodes, now() - start);
+        if (!loaded) fprintf(stderr, "warning: text load failed\n");
+        poolDestroy(activePool);
+    }
+
+    activePool = poolCreate();
+    start = now();
+    node* loaded = loadDirectory(binaryFile);
+    record(run, shape, nodes, "loadBinary", nodes, now() - start);
+    if (!loaded) fprintf(stderr, "warning: binary load failed\n");
+    poolDestroy(activePool);
+    activePool = benchPool;
+    unlink(textFile);
+    unlink(binaryFile);
+
+    start = now();
+    sortAll(root, "name");
+    record(run, shape, nodes, "sortByName", nodes, now() - start);
+    start = now();
+    sortAll(root, "date");
+    record(run, shape, nodes, "sortByDate", nodes, now() - start);
+
+    // Merge two folders with disjoint children, each half the size
+    node* source = addNode(root, Folder, nodes + 1);
+    node* destination = addNode(root, Folder, nodes + 2);
+    for (size_t i = 0; i < nodes / 2; i++) {
+        addNode(source, File, 2 * i);
+        addNode(destination, File, 2 * i + 1);
+    }
+    start = now();
+    mergeDirectories(destination, source, MergeSkip, NULL);
+    record(run, shape, nodes, "merge", nodes / 2, now() - start);
+
+    // Teardown node by node (as rm does), then the whole pool at once
+    node* merged = destination;
+    start = now();
+    removeNode(merged);
+    freeNode(merged);
+    record(run, shape, nodes, "rm", nodes / 2 * 2, now() - start);
+
+    start = now();
+    poolDestroy(activePool);
+    record(run, shape, nodes, "teardown", nodes, now() - start);
+    activePool = NULL;
+}
+
+static void writeJson(benchRun* run, FILE* out) {
+    fprintf(out, "{\n  \"timestamp\": %ld,\n  \"results\": [\n", (long)time(NULL));
+    for (size_t i = 0; i < run->count; i++) {
+        benchResult* result = &run->results[i];
+        fprintf(out, "    {\"shape\": \"%s\", \"nodes\": %zu, \"operation\": \"%s\", \"operations\": %zu, "
+                     "\"seconds\": %.6f, \"opsPerSecond\": %.0f}%s\n",
+                result->shape, result->nodes, result->operation, result->operations, result->seconds,
+                result->seconds > 0 ? result->operations / result->seconds : 0.0, i + 1 < run->count ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+}
+
+int main(int argc, char** argv) {
+    const char* shapes[] = {"wide", "deep", "balanced"};
+    size_t sizes[] = {1000, 10000, 100000, 1000000};
+    const char* onlyShape = NULL;
+    size_t onlyNodes = 0;
+    const char* outFile = NULL;
+
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--shape") == 0) {
+            onlyShape = argv[i + 1];
+        } else if (strcmp(argv[i], "--nodes") == 0) {
+            onlyNodes = strtoull(argv[i + 1], NULL, 10);
+        } else if (strcmp(argv[i], "--out") == 0) {
+            outFile = argv[i + 1];
+        }
+    }
+    if (onlyShape && strcmp(onlyShape, "wide") != 0 && strcmp(onlyShape, "deep") != 0 && strcmp(onlyShape, "balanced") != 0) {
+        fprintf(stderr, "Error: Unknown shape '%s'.\n", onlyShape);
+        return 1;
+    }
+    if (onlyNodes != 0 && onlyNodes < 3) {
+        fprintf(stderr, "Error: A tree needs at least 3 nodes.\n");
+        return 1;
+    }
+
+    quietMode = 1;
+    benchRun run = {NULL, 0, 0};
+    for (size_t s = 0; s < sizeof(shapes) / sizeof(shapes[0]); s++) {
+        if (onlyShape && strcmp(onlyShape, shapes[s]) != 0) continue;
+        for (size_t n = 0; n < sizeof(sizes) / sizeof(sizes[0]); n++) {
+            size_t nodes = onlyNodes ? onlyNodes : sizes[n];
+            runShape(&run, shapes[s], nodes);
+            if (onlyNodes) break;
+        }
+    }
+
+    FILE* out = outFile ? fopen(outFile, "w") : stdout;
+    if (!out) {
+        fprintf(stderr, "Error: Could not open '%s'.\n", outFile);
+        return 1;
+    }
+    writeJson(&run, out);
+    if (out != stdout) fclose(out);
+    free(run.results);
+    return 0;
+}
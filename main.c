@@ -1,16 +1,107 @@
+#define _GNU_SOURCE // syscall() for io_uring, O_PATH
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <inttypes.h>
 #include <sys/stat.h>
+#include <sys/sendfile.h>
 #include <sys/time.h>
 #include <time.h>
 #include <zlib.h> // For compression and decompression
 #include <termios.h> // For real time color updates
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <sched.h>
+#include <sys/inotify.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <regex.h>
 
 #define MAX_PATH_LENGTH 2048
 
+// Resolved paths remembered by the path cache (a power of two)
+#define PATH_CACHE_SLOTS 4096
+
+// Longest chain of symlinks followed before giving up, as the kernel does
+#define SYMLINK_MAX_HOPS 40
+
+// Child index tuning: initial slot count (power of two), maximum load in
+// percent before growing, and how many old slots are migrated per operation
+#define CHILD_INDEX_INITIAL_CAPACITY 8
+#define CHILD_INDEX_MAX_LOAD 75
+#define CHILD_INDEX_DRAIN_STEP 16
+
+// Skip list levels above the child list of a sorted folder; enough for
+// 4^16 children before searches slow down
+#define ORDER_MAX_LEVELS 16
+
+// Tree pool tuning: slab size (also its alignment), arena chunk size, side
+// table page size, and the range of power-of-two block sizes served from
+// free lists (16 bytes to 64 KiB)
+#define SLAB_BYTES (64 * 1024)
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define RECORDS_PER_PAGE 1024
+#define POOL_MIN_BLOCK 16
+#define POOL_SIZE_CLASSES 13
+
+// File content is kept in extents of this size, the largest pool block
+#define EXTENT_SIZE (64 * 1024)
+
+// Names shorter than this are stored inside the node itself
+#define NODE_INLINE_NAME 16
+
+// Output buffer size for snapshot writers
+#define SINK_BUFFER_SIZE (256 * 1024)
+
+// stdio buffer size for scripts and output in batch mode
+#define BATCH_BUFFER_SIZE (1024 * 1024)
+
+// Formatted listing dates kept, one per distinct minute
+#define DATE_CACHE_SLOTS 256
+
+// Command lookup slots (a power of two) and latency histogram layout
+#define COMMAND_SLOTS 128
+#define LATENCY_SUB_BITS 4
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS ((64 - LATENCY_SUB_BITS) * LATENCY_SUB_BUCKETS)
+
+// Real filesystem mirroring: changes waiting for the writer before
+// commands block, coalescing index slots (a power of two, at least twice
+// the limit), and io_uring submission queue size
+#define MIRROR_QUEUE_LIMIT 4096
+#define MIRROR_INDEX_SLOTS 8192
+#define MIRROR_RING_ENTRIES 256
+
+// Real directory descriptors the writer keeps open
+#define MIRROR_FD_LIMIT 256
+
 enum nodeType {File, Folder, Symlink};
 
+// Changes the background writer applies to the real filesystem
+enum mirrorKind {MirrorMkdir, MirrorWrite, MirrorRemoveDir, MirrorRemoveFile, MirrorPatch};
+
+// Order a folder keeps its children in after sortBy
+enum sortMode {SortNone, SortByName, SortByDate};
+
+// How merge settles a name both folders hold: ask each time, keep the
+// existing entry, keep both under a new name, or replace it always, when
+// older, or when smaller
+enum mergePolicy {MergeAsk, MergeSkip, MergeRename, MergeOverwrite, MergeNewer, MergeLarger};
+
+// How ls and lsrecursive print: colored on a terminal, plain, or JSON
+enum listFormat {ListDefault, ListPlain, ListJson};
+
+// Changes the journal can undo; a marker is a snapshot
+enum journalKind {JournalMarker, JournalLinked, JournalUnlinked, JournalDiscarded, JournalRenamed, JournalDated,
+                  JournalResized, JournalContent, JournalPatched, JournalOrdered, JournalRetargeted, JournalMirrored};
+
 // Define Google colors using ANSI escape codes
 const char* YELLOW = "\033[38;5;226m"; // Google Yellow
 const char* CYAN = "\033[36m";         // Cyan for folders
@@ -18,20 +109,203 @@ const char* BLUE = "\033[38;5;33m";    // Google Blue for symlinks
 const char* GREEN = "\033[38;5;46m"; // Google Green
 const char* RESET = "\033[0m";       // Reset to default
 
+// Nodes refer to each other by 32-bit index into the tree's node table.
+// Index 0 is never handed out and stands for "no node".
+typedef uint32_t nodeId;
+#define NO_NODE 0
+
+// Node flags
+#define NODE_LONG_NAME 0x01 // name holds a pointer to an arena string
+#define NODE_STUB 0x02      // mounted folder whose children have not been read yet
+#define NODE_TOWER 0x04     // child of a sorted folder with a skip list tower
+#define NODE_MERGE_KEEP 0x08 // stays in the source folder of a merge under way
+#define NODE_DETACHED 0x10   // left a folder the journal can put it back in
+#define NODE_FREED 0x20      // back on the pool's free list
+
+// Open-addressing hash table over a folder's children, keyed by name
+typedef struct indexTable {
+    nodeId* slots;
+    size_t capacity;
+    size_t live;
+    size_t tombstones;
+} indexTable;
+
+// Per-folder child index. While growing, entries of the previous table are
+// moved into the current one a few slots at a time (see indexDrainStep).
+typedef struct childIndex {
+    indexTable current;
+    indexTable draining;
+    size_t drainCursor;
+} childIndex;
+
+// 48 bytes. Everything that only some node types need lives in the side
+// tables below, reached through 'payload'.
 typedef struct node {
-    enum nodeType type;
-    char* name;
-    int numberOfItems;
-    size_t size;
+    nodeId parent;
+    nodeId previous;
+    nodeId next;
+    unsigned int hash; // Hash of name, kept in sync by setNodeName
+    uint32_t payload;  // Row in the folder, file or symlink table
+    uint8_t type;
+    uint8_t flags;
     time_t date;
-    char* content;
-    struct node* previous;
-    struct node* parent;
-    struct node* next;
-    struct node* child;
-    char* symlinkTarget; // For symbolic links
+    char name[NODE_INLINE_NAME];
 } node;
 
+// Running counts for everything below a folder
+typedef struct subtreeTotals {
+    uint64_t files;
+    uint64_t folders;
+    uint64_t symlinks;
+    uint64_t bytes;
+} subtreeTotals;
+
+// Tower of a sorted folder's child on the levels above the child list
+typedef struct orderTower {
+    nodeId item;
+    uint32_t height;
+    struct orderTower* next[]; // next[i] is the following tower on level i + 1
+} orderTower;
+
+typedef struct childOrder {
+    enum sortMode mode;
+    unsigned int levels; // Levels with at least one tower
+    orderTower* head[ORDER_MAX_LEVELS];
+} childOrder;
+
+typedef struct folderRecord {
+    nodeId child;
+    nodeId lastChild; // Tail of the child list for O(1) appends
+    int numberOfItems;
+    childIndex* index; // Allocated on first child
+    subtreeTotals totals; // Updated along the parent chain on every change
+    struct dirHandle* handle; // Real directory, once something was mirrored into it
+    struct watchRoot* watcher; // Watch on the real directory, if any
+    int watch;
+    childOrder* order; // Kept sort order, NULL for insertion order
+} folderRecord;
+
+// File content split into EXTENT_SIZE blocks, so a write only touches the
+// extents it overlaps. A missing extent is a hole that reads as zeros, and
+// the last one grows by pool size class instead of taking a whole extent.
+typedef struct extentMap {
+    char** extents;
+    size_t count;
+    size_t capacity;
+    size_t tailCapacity; // Bytes allocated for the last extent
+} extentMap;
+
+typedef struct fileRecord {
+    extentMap* content; // NULL when the content only exists on disk
+    size_t size;
+} fileRecord;
+
+typedef struct symlinkRecord {
+    char* target;
+    nodeId resolved;     // Node the target named when last looked up, if any
+    uint32_t generation; // Tree generation of a lookup that found it; 0 for none
+} symlinkRecord;
+
+// A node table page. Slabs are aligned to their size, so a node's index
+// can be recovered from its address.
+typedef struct nodeSlab {
+    size_t number;
+    node nodes[];
+} nodeSlab;
+
+#define NODES_PER_SLAB ((SLAB_BYTES - sizeof(nodeSlab)) / sizeof(node))
+
+// Paged table of fixed-size records; row 0 is reserved like NO_NODE
+typedef struct recordTable {
+    char** pages;
+    size_t pageCount;
+    size_t recordSize;
+    uint32_t used;     // Rows handed out so far, including row 0
+    uint32_t freeHead; // Released rows, linked through their first 4 bytes
+    size_t live;
+} recordTable;
+
+typedef struct arenaChunk {
+    struct arenaChunk* next;
+    size_t capacity;
+    size_t used;
+    char data[];
+} arenaChunk;
+
+// Header for blocks too big for the size-class free lists
+typedef struct largeBlock {
+    struct largeBlock* previous;
+    struct largeBlock* next;
+    size_t size;
+    size_t padding; // Keeps the payload 16-byte aligned
+} largeBlock;
+
+// Owns every allocation belonging to one tree
+typedef struct treePool {
+    nodeSlab** slabs; // The node table, indexed by nodeId / NODES_PER_SLAB
+    size_t slabCount;
+    size_t slabCapacity;
+    size_t slabUsed; // Nodes handed out from the newest slab
+    nodeId freeNodes;
+    size_t freeNodeCount;
+    size_t liveNodes;
+
+    recordTable folders;
+    recordTable files;
+    recordTable symlinks;
+    size_t recordBytes;
+
+    arenaChunk* chunks;
+    size_t chunkCount;
+    size_t arenaCapacity;
+    size_t arenaUsed;
+    size_t deadBytes;
+
+    void* freeBlocks[POOL_SIZE_CLASSES];
+    size_t blockBytes;
+    size_t freeBlockBytes;
+    largeBlock* largeBlocks;
+    size_t largeBytes;
+
+    size_t dirHandles;  // Folders holding a real directory handle
+    size_t stubFolders; // Mounted folders not read yet
+    struct watchRoot* watchers;
+} treePool;
+
+// Buffered byte stream used by the snapshot writer. 'flush' returns 0 on
+// success, so the same writer can target a file or a compressor.
+typedef struct byteSink {
+    int (*flush)(void* context, const char* data, size_t length);
+    void* context;
+    int failed;
+    size_t used;
+    char buffer[SINK_BUFFER_SIZE];
+} byteSink;
+
+// What a command can change about the running shell
+typedef struct shellState {
+    node* root;
+    node* currentFolder;
+    char* path;
+} shellState;
+
+// Command table entry: name, handler and how many arguments it accepts
+typedef struct commandDescriptor {
+    const char* name;
+    int (*handler)(shellState* state, char* command);
+    int minArguments;
+    int maxArguments;
+    const char* usage;
+} commandDescriptor;
+
+// Per-command call count and latency histogram
+typedef struct commandStats {
+    uint64_t calls;
+    uint64_t total;
+    uint64_t max;
+    uint32_t buckets[LATENCY_BUCKETS];
+} commandStats;
+
 // Function to create a new folder in the current directory
 // void make_dir(node* currentFolder, char* command, char* currentPath);
 
@@ -39,14 +313,29 @@ typedef struct node {
 // void touch(node* currentFolder, char* command, char* currentPath);
 
 // Function to list files and folders in the current directory
-void ls(node* currentFolder);
+void ls(node* currentFolder, enum listFormat format);
 
 // Function to recursively list files and folders in the current directory
-void lsrecursive(node* currentFolder, int indentCount);
+void lsrecursive(node* currentFolder, enum listFormat format);
+
+// Function to read the optional --format=plain|json argument of a listing
+int parseListFormat(const char* argument, enum listFormat* format);
 
 // Function to edit the content of an existing file
 void edit(node* currentFolder, char* command);
 
+// Functions to write, append to and read part of a file
+void writeFile(node* currentFolder, char* fileName, char* offsetText);
+void appendFile(node* currentFolder, char* fileName);
+void readFile(node* currentFolder, char* fileName, char* offsetText, char* lengthText);
+
+// Functions to keep file content in extents
+void contentStore(node* file, size_t offset, const char* data, size_t length);
+void contentLoad(node* file, size_t offset, char* buffer, size_t length);
+void contentClear(node* file, size_t from, size_t to);
+void contentCopy(node* to, node* from);
+void contentFree(node* file);
+
 // Function to print the current directory's full path
 void pwd(char* path);
 
@@ -59,7 +348,14 @@ node* cdup(node* currentFolder, char** path);
 // Function to free a node (and its children)
 void freeNode(node* freeingNode);
 
-// Function to remove a node (file or folder)
+// Function to create a detached node with the given name and type
+node* createNode(const char* name, enum nodeType type);
+
+// Functions to link a node into a folder, last or in its sorted place
+void appendChild(node* folder, node* child);
+void linkChild(node* folder, node* child);
+
+// Function to unlink a node (file or folder) from its parent
 void removeNode(node* removingNode);
 
 // Function to remove a file or folder
@@ -71,20 +367,52 @@ void mov(node* currentFolder, char* command);
 // Function to count the total number of files in the entire directory tree
 int countFiles(node* folder);
 
+// Function to count the folders in a tree, including the folder itself
+int countFolders(node* folder);
+
+// Functions to keep per-folder subtree totals in step with the tree
+subtreeTotals totalsOf(node* item);
+void propagateTotals(node* folder, subtreeTotals delta, int sign);
+void setFileSize(node* file, size_t size);
+
+// Function to report the files, folders, symlinks and bytes under a node
+void du(node* item);
+
 // // Function to save the directory structure to a file or compressed file
 // void saveDirectory(node* folder, void* file);
 
 // // Function to load the directory structure from a file or compressed file
 // node* loadDirectory(gzFile gz, node* parent);
 
-// Function to merge two directories, resolving conflicts interactively
-void mergeDirectories(node* destFolder, node* srcFolder);
+// Functions to save and load the directory structure as a binary snapshot
+void saveSnapshot(node* root, const char* filename);
+node* loadSnapshot(const char* filename);
+void writeSnapshot(node* root, byteSink* sink);
+node* buildFromSnapshot(const char* image, size_t length);
+int isSnapshot(const void* data, size_t length);
+void sinkWrite(byteSink* sink, const void* data, size_t length);
+void sinkFlush(byteSink* sink);
+node* nextPreorder(node* current, node* top);
+
+// Functions to merge two directories and to read the --policy= argument
+void mergeDirectories(node* destFolder, node* srcFolder, enum mergePolicy policy, shellState* shell);
+int parseMergePolicy(const char* argument, enum mergePolicy* policy);
 
 // Function to create a symbolic link to an existing file or folder
 int createSymlink(node* currentFolder, char* sourcePath, char* linkName, node* root);
 
 // Function to sort files and folders in the current directory by name or date
 void sortDirectory(node* folder, const char* criterion);
+int compareNodesByName(const void* a, const void* b);
+int compareNodesByDate(const void* a, const void* b);
+
+// Functions to keep the children of a sorted folder in order as they change
+void setChildOrder(node* folder, enum sortMode mode);
+void orderLink(node* folder, node* child);
+void orderDropTower(node* folder, node* child);
+int orderTake(node* child);
+void orderFree(node* folder);
+void setNodeDate(node* item, time_t date);
 
 // Function to compress the entire directory structure into a compressed file
 void compressDirectory(node* folder, const char* filename);
@@ -92,180 +420,1033 @@ void compressDirectory(node* folder, const char* filename);
 // Function to decompress a file and restore the directory structure
 node* decompressDirectory(const char* filename);
 
+// Function to import a real directory tree into a folder, scanning in parallel
+node* importDirectory(node* destination, const char* realDirectory);
+
+// Function to search a subtree in parallel by name, type, size and date
+size_t findNodes(node* currentFolder, node* root, const char* path, char** tests, size_t testCount);
+
+// Functions to find names by substring through a trigram index over every name
+void locate(node* root, const char* text);
+void trigramBuildIndex();
+void trigramNoteName(node* item);
+void trigramReset();
+
+// Functions to mount a real directory whose folders are read on first use
+node* mountDirectory(node* destination, const char* realDirectory);
+void hydrateFolder(node* folder);
+
+// Functions to keep watched folders in step with changes made outside the shell
+void watchDirectory(node* folder);
+void watchHydrated(node* folder);
+void unwatchFolder(node* folder);
+void unwatchAll();
+void releaseWatches(treePool* pool);
+void applyWatchEvents(shellState* state);
+void printWatchStats();
+
+// Functions to resolve a path, answering repeated lookups from the path cache
+node* parsePath(node* currentFolder, const char* path, node* root);
+node* lookupPath(node* currentFolder, const char* path, node* root, char* missing, size_t missingSize);
+void invalidatePathCache();
+
+// Functions to follow symlinks through their cached targets and to name a node's path
+node* symlinkStep(node* link, node* root);
+node* resolveSymlinks(node* item, node* root, int* error);
+char* nodePath(node* item);
+void clearPathCache();
+
 // Function to get a node
 node* getNode(node *currentFolder, char* name, enum nodeType type);
 node* getNodeTypeless(node *currentFolder, char* name);
 
+// Functions to keep a folder's child index in sync with its child list
+void indexInsert(node* folder, node* child);
+void indexRemove(node* folder, node* child);
+node* indexLookup(node* folder, const char* name);
+void indexFree(node* folder);
+
+// Function to assign a node's name and its cached hash
+void setNodeName(node* item, const char* name);
+unsigned int hashName(const char* name);
+
 // Function to read and display the contents of a file
 void echo(node* currentFolder, char* fileName, node* root);
 
+// Function to copy a file next to itself or into a folder
+void cp(node* currentFolder, char* sourceName, char* destinationName);
+
 // Function to display coloful nodes
 void displayNode(node* item);
 
-char* getString() {
-    size_t size = 10;
-    char* str = (char*)malloc(size);
-    size_t len = 0;
-    int ch;
+// Functions to queue changes for the real filesystem, wait for them and
+// report the ones that failed
+void mirrorSubmit(enum mirrorKind kind, node* folder, const char* name, char* data, size_t length);
+void mirrorPatch(node* folder, const char* name, char* data, size_t length, uint64_t offset);
+void mirrorRemoveFolder(node* folder);
+void mirrorWait();
+void reportMirrorErrors();
+void mirrorShutdown();
+void printMirrorStats();
+
+// Functions to tie folders to the real directories they mirror
+char* realPathOf(node* folder, const char* name);
+char* realDirectoryOf(node* folder);
+void detachDirHandle(node* folder);
+void releaseDirHandles(treePool* pool);
+void bindRealDirectory(node* folder, const char* path);
+
+// Functions to print confirmations (skipped in batch mode) and errors (counted)
+void note(const char* format, ...);
+void reportError(const char* format, ...);
+
+// Functions to run commands interactively, from a script or in batch mode
+int executeCommand(shellState* state, char* command);
+void buildCommandTable();
+const commandDescriptor* findCommand(const char* name, size_t length);
+void printCommandStats();
+int runCommands(shellState* state, FILE* input, int interactive);
+int sourceScript(shellState* state, const char* filename);
+void printBatchSummary(const struct timespec* start, unsigned long commands, unsigned long errors);
+
+// Functions to take snapshots of the tree and roll back to them by undoing
+// the changes recorded since
+void snapshotTake(const char* tag);
+void snapshotRollback(shellState* state, const char* tag);
+void snapshotDrop(const char* tag);
+void printSnapshots();
+void journalReset();
+void discardNode(node* item);
+
+// Functions to manage the allocation pool that owns a whole tree
+treePool* poolCreate();
+void poolDestroy(treePool* pool);
+node* poolAllocNode(treePool* pool);
+void poolFreeNode(treePool* pool, node* freeingNode);
+void poolAttachPayload(treePool* pool, node* item);
+char* poolString(treePool* pool, const char* text);
+void poolDiscardString(treePool* pool, const char* text);
+void* poolAlloc(treePool* pool, size_t size);
+void poolRelease(treePool* pool, void* block, size_t size);
+void printPoolStats(treePool* pool);
+
+// Per-tree allocator. Nodes come from fixed-size slabs with a free list,
+// names and other strings are bump-allocated from arena chunks, and
+// variable-sized blocks (child index tables) use power-of-two free lists
+// carved from the same chunks. Dropping a tree releases everything with
+// one pass over the slab and chunk lists instead of a free per node.
+static treePool* activePool = NULL;
+
+// Changes made since the oldest snapshot, newest last. Only what a change
+// overwrites is kept: a rollback undoes them in reverse, so a snapshot
+// costs one marker and nodes nobody touched are never copied.
+typedef struct journalEntry {
+    enum journalKind kind;
+    nodeId item;
+    nodeId parent;   // Unlinked: the folder it left
+    nodeId previous; // Unlinked: the child it followed
+    int64_t value;   // Old date, size, sort mode or patch offset; 1 for a new node once Linked; a mirror kind
+    void* saved;     // Old name, bytes, extent map, child order or target; a marker's tag; a real entry
+    size_t length;   // Bytes or children in 'saved'
+} journalEntry;
+
+// Real entry a change was queued for while a snapshot existed. Holds a
+// reference to the directory handle, so it outlives the folder.
+typedef struct mirroredChange {
+    struct dirHandle* dir;
+    char name[];
+} mirroredChange;
+
+typedef struct changeJournal {
+    journalEntry* entries;
+    size_t count;
+    size_t capacity;
+    size_t markers;
+    int replaying; // Undoing or dropping entries, which are not recorded again
+} changeJournal;
+
+static changeJournal journal;
+
+static int journaling() {
+    return journal.markers > 0 && !journal.replaying;
+}
 
-    while ((ch = fgetc(stdin)) != EOF && ch != '\n') {
-        if (len + 1 >= size) {
-            size += 16;
-            str = (char*)realloc(str, size);
+static journalEntry* journalPush(enum journalKind kind, node* item);
+
+static void* poolCarve(treePool* pool, size_t size, size_t alignment) {
+    arenaChunk* chunk = pool->chunks;
+    if (chunk) {
+        uintptr_t start = ((uintptr_t)(chunk->data + chunk->used) + alignment - 1) & ~(uintptr_t)(alignment - 1);
+        size_t offset = start - (uintptr_t)chunk->data;
+        if (offset + size <= chunk->capacity) {
+            pool->arenaUsed += offset + size - chunk->used;
+            chunk->used = offset + size;
+            return chunk->data + offset;
         }
-        str[len++] = ch;
     }
-    str[len] = '\0';
-    return str;
+
+    // Oversized requests get a chunk of their own behind the current one
+    size_t capacity = size + alignment > ARENA_CHUNK_SIZE ? size + alignment : ARENA_CHUNK_SIZE;
+    arenaChunk* fresh = malloc(sizeof(arenaChunk) + capacity);
+    fresh->capacity = capacity;
+    fresh->used = 0;
+    if (chunk && capacity > ARENA_CHUNK_SIZE) {
+        fresh->next = chunk->next;
+        chunk->next = fresh;
+    } else {
+        fresh->next = chunk;
+        pool->chunks = fresh;
+    }
+    pool->chunkCount++;
+    pool->arenaCapacity += capacity;
+
+    uintptr_t start = ((uintptr_t)fresh->data + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    size_t offset = start - (uintptr_t)fresh->data;
+    fresh->used = offset + size;
+    pool->arenaUsed += fresh->used;
+    return fresh->data + offset;
 }
 
-// Week 2: Count Total Files
-int countFiles(node* folder) {
-    if (!folder) return 0;
+treePool* poolCreate() {
+    treePool* pool = calloc(1, sizeof(treePool));
+    pool->folders.recordSize = sizeof(folderRecord);
+    pool->files.recordSize = sizeof(fileRecord);
+    pool->symlinks.recordSize = sizeof(symlinkRecord);
+    return pool;
+}
+
+void poolDestroy(treePool* pool) {
+    if (!pool) return;
+    invalidatePathCache(); // Cached node ids may be handed out again by another pool
+    releaseDirHandles(pool);
+    releaseWatches(pool);
 
-    int count = 0;
-    if (folder->type == File) {
-        count++;
+    for (size_t i = 0; i < pool->slabCount; i++) {
+        free(pool->slabs[i]);
+    }
+    free(pool->slabs);
+    free(pool->folders.pages);
+    free(pool->files.pages);
+    free(pool->symlinks.pages);
+    while (pool->chunks) {
+        arenaChunk* next = pool->chunks->next;
+        free(pool->chunks);
+        pool->chunks = next;
+    }
+    while (pool->largeBlocks) {
+        largeBlock* next = pool->largeBlocks->next;
+        free(pool->largeBlocks);
+        pool->largeBlocks = next;
     }
+    free(pool);
+}
+
+static inline node* poolNodeAt(treePool* pool, nodeId id) {
+    if (id == NO_NODE) return NULL;
+    return &pool->slabs[id / NODES_PER_SLAB]->nodes[id % NODES_PER_SLAB];
+}
+
+// Returns the node table index of a node, found through its slab header
+static inline nodeId idOf(node* item) {
+    if (item == NULL) return NO_NODE;
+    nodeSlab* slab = (nodeSlab*)((uintptr_t)item & ~(uintptr_t)(SLAB_BYTES - 1));
+    return (nodeId)(slab->number * NODES_PER_SLAB + (size_t)(item - slab->nodes));
+}
+
+// Returns the node with the given index in the active tree
+static inline node* nodeAt(nodeId id) {
+    return poolNodeAt(activePool, id);
+}
 
-    node* currentNode = folder->child;
-    while (currentNode) {
-        count += countFiles(currentNode);
-        currentNode = currentNode->next;
+node* poolAllocNode(treePool* pool) {
+    node* fresh;
+    if (pool->freeNodes != NO_NODE) {
+        fresh = poolNodeAt(pool, pool->freeNodes);
+        pool->freeNodes = fresh->next;
+        pool->freeNodeCount--;
+    } else {
+        if (pool->slabCount == 0 || pool->slabUsed == NODES_PER_SLAB) {
+            if (pool->slabCount == pool->slabCapacity) {
+                pool->slabCapacity = pool->slabCapacity ? pool->slabCapacity * 2 : 16;
+                pool->slabs = realloc(pool->slabs, pool->slabCapacity * sizeof(nodeSlab*));
+            }
+            nodeSlab* slab = aligned_alloc(SLAB_BYTES, SLAB_BYTES);
+            slab->number = pool->slabCount;
+            pool->slabs[pool->slabCount++] = slab;
+            // Slot 0 of the first slab is NO_NODE
+            pool->slabUsed = slab->number == 0 ? 1 : 0;
+        }
+        fresh = &pool->slabs[pool->slabCount - 1]->nodes[pool->slabUsed++];
     }
-    return count;
+    pool->liveNodes++;
+    memset(fresh, 0, sizeof(node));
+    return fresh;
 }
 
-int countFolders(node* folder) {
-    if (!folder) return 0;
+static recordTable* poolRecordTable(treePool* pool, enum nodeType type) {
+    if (type == Folder) return &pool->folders;
+    if (type == File) return &pool->files;
+    return &pool->symlinks;
+}
+
+static inline void* recordAt(recordTable* table, uint32_t row) {
+    return table->pages[row / RECORDS_PER_PAGE] + (size_t)(row % RECORDS_PER_PAGE) * table->recordSize;
+}
+
+// Returns a zeroed row of the table, never row 0
+static uint32_t recordAlloc(treePool* pool, recordTable* table) {
+    uint32_t row;
+    if (table->freeHead) {
+        row = table->freeHead;
+        memcpy(&table->freeHead, recordAt(table, row), sizeof(uint32_t));
+    } else {
+        if (table->used == 0) table->used = 1;
+        if (table->used % RECORDS_PER_PAGE == 0 || table->pageCount == 0) {
+            table->pages = realloc(table->pages, (table->pageCount + 1) * sizeof(char*));
+            table->pages[table->pageCount++] = poolCarve(pool, RECORDS_PER_PAGE * table->recordSize, POOL_MIN_BLOCK);
+            pool->recordBytes += RECORDS_PER_PAGE * table->recordSize;
+        }
+        row = table->used++;
+    }
+    table->live++;
+    memset(recordAt(table, row), 0, table->recordSize);
+    return row;
+}
+
+static void recordFree(recordTable* table, uint32_t row) {
+    memcpy(recordAt(table, row), &table->freeHead, sizeof(uint32_t));
+    table->freeHead = row;
+    table->live--;
+}
 
-    int count = 0;
-    if (folder->type == Folder) {
-        count++;
+// Gives a node the side-table row its type needs. Files only get one
+// once they have a size or content.
+void poolAttachPayload(treePool* pool, node* item) {
+    if (item->payload == 0) {
+        item->payload = recordAlloc(pool, poolRecordTable(pool, item->type));
     }
+}
 
-    node* currentNode = folder->child;
-    while (currentNode) {
-        count += countFiles(currentNode);
-        currentNode = currentNode->next;
+void poolFreeNode(treePool* pool, node* freeingNode) {
+    if (freeingNode->payload) {
+        recordFree(poolRecordTable(pool, freeingNode->type), freeingNode->payload);
     }
-    return count;
+    freeingNode->flags |= NODE_FREED;
+    freeingNode->next = pool->freeNodes;
+    pool->freeNodes = idOf(freeingNode);
+    pool->freeNodeCount++;
+    pool->liveNodes--;
 }
 
-void getRealPath(node* currentFolder, char* realPath) {
-    // Temporary buffer to build the path
-    char tempPath[1024] = "";
-    node* folder = currentFolder;
+// Accessors for the links and side-table payloads of the active tree
+static inline node* parentOf(node* item) { return nodeAt(item->parent); }
+static inline node* nextOf(node* item) { return nodeAt(item->next); }
+static inline node* previousOf(node* item) { return nodeAt(item->previous); }
+
+static inline folderRecord* folderOf(node* item) {
+    return item->type == Folder && item->payload ? recordAt(&activePool->folders, item->payload) : NULL;
+}
+
+static inline fileRecord* fileOf(node* item) {
+    return item->type == File && item->payload ? recordAt(&activePool->files, item->payload) : NULL;
+}
+
+static inline symlinkRecord* symlinkOf(node* item) {
+    return item->type == Symlink && item->payload ? recordAt(&activePool->symlinks, item->payload) : NULL;
+}
+
+static inline node* firstChildOf(node* folder) {
+    if (folder->flags & NODE_STUB) hydrateFolder(folder);
+    folderRecord* record = folderOf(folder);
+    return record ? nodeAt(record->child) : NULL;
+}
+
+static inline char* nameOf(node* item) {
+    if (item->flags & NODE_LONG_NAME) {
+        char* longName;
+        memcpy(&longName, item->name, sizeof(char*));
+        return longName;
+    }
+    return item->name;
+}
+
+static inline size_t nodeSize(node* item) {
+    fileRecord* record = fileOf(item);
+    return record ? record->size : 0;
+}
+
+static inline int numberOfItems(node* folder) {
+    folderRecord* record = folderOf(folder);
+    return record ? record->numberOfItems : 0;
+}
+
+// Whether a file's content is held in memory rather than only on disk
+static inline int hasContent(node* item) {
+    fileRecord* record = fileOf(item);
+    return record && record->content;
+}
+
+static inline char* symlinkTarget(node* item) {
+    symlinkRecord* record = symlinkOf(item);
+    return record ? record->target : NULL;
+}
+
+// What a node adds to the totals of each of its ancestors
+subtreeTotals totalsOf(node* item) {
+    subtreeTotals totals = {0, 0, 0, 0};
+    if (item->type == Folder) {
+        totals = folderOf(item)->totals;
+        totals.folders++;
+    } else if (item->type == File) {
+        totals.files = 1;
+        totals.bytes = nodeSize(item);
+    } else {
+        totals.symlinks = 1;
+    }
+    return totals;
+}
+
+// Adds (sign 1) or subtracts (sign -1) 'delta' from 'folder' and every folder above it
+void propagateTotals(node* folder, subtreeTotals delta, int sign) {
+    for (; folder; folder = parentOf(folder)) {
+        subtreeTotals* totals = &folderOf(folder)->totals;
+        if (sign > 0) {
+            totals->files += delta.files;
+            totals->folders += delta.folders;
+            totals->symlinks += delta.symlinks;
+            totals->bytes += delta.bytes;
+        } else {
+            totals->files -= delta.files;
+            totals->folders -= delta.folders;
+            totals->symlinks -= delta.symlinks;
+            totals->bytes -= delta.bytes;
+        }
+    }
+}
+
+void setFileSize(node* file, size_t size) {
+    poolAttachPayload(activePool, file);
+    fileRecord* record = fileOf(file);
+    size_t previous = record->size;
+    if (previous != size && journaling()) journalPush(JournalResized, file)->value = (int64_t)previous;
+    record->size = size;
+
+    subtreeTotals delta = {0, 0, 0, size > previous ? size - previous : previous - size};
+    propagateTotals(parentOf(file), delta, size > previous ? 1 : -1);
+}
+
+char* poolString(treePool* pool, const char* text) {
+    size_t length = strlen(text) + 1;
+    char* copy = poolCarve(pool, length, 1);
+    memcpy(copy, text, length);
+    return copy;
+}
+
+// Arena strings are never reused; discarded bytes are only accounted for
+void poolDiscardString(treePool* pool, const char* text) {
+    if (text) pool->deadBytes += strlen(text) + 1;
+}
 
-    while (folder != NULL && strcmp(folder->name, "/") != 0) {
-        // Prepend the current folder's name
-        char buffer[256];
-        snprintf(buffer, sizeof(buffer), "/%s", folder->name);
-        strcat(tempPath, buffer);
+static int poolSizeClass(size_t size) {
+    int sizeClass = 0;
+    size_t blockSize = POOL_MIN_BLOCK;
+    while (blockSize < size) {
+        blockSize <<= 1;
+        sizeClass++;
+    }
+    return sizeClass;
+}
 
-        // Move to the parent folder
-        folder = folder->parent;
+// Returns zeroed memory for a block of 'size' bytes
+void* poolAlloc(treePool* pool, size_t size) {
+    int sizeClass = poolSizeClass(size);
+    if (sizeClass >= POOL_SIZE_CLASSES) {
+        largeBlock* block = calloc(1, sizeof(largeBlock) + size);
+        block->size = size;
+        block->next = pool->largeBlocks;
+        if (block->next) block->next->previous = block;
+        pool->largeBlocks = block;
+        pool->largeBytes += size;
+        return block + 1;
     }
 
-    // Start from root if the current folder is the root node
-    if (folder == NULL) {
-        snprintf(realPath, 1024, "/");
+    size_t blockSize = (size_t)POOL_MIN_BLOCK << sizeClass;
+    void* block = pool->freeBlocks[sizeClass];
+    if (block) {
+        pool->freeBlocks[sizeClass] = *(void**)block;
+        pool->freeBlockBytes -= blockSize;
     } else {
-        // Reverse the constructed path to get the correct real path
-        snprintf(realPath, 1024, ".");
-        strncat(realPath, tempPath, 1024 - strlen(realPath) - 1);
+        block = poolCarve(pool, blockSize, POOL_MIN_BLOCK);
+        pool->blockBytes += blockSize;
+    }
+    memset(block, 0, blockSize);
+    return block;
+}
+
+void poolRelease(treePool* pool, void* block, size_t size) {
+    if (!block) return;
+
+    int sizeClass = poolSizeClass(size);
+    if (sizeClass >= POOL_SIZE_CLASSES) {
+        largeBlock* header = (largeBlock*)block - 1;
+        if (header->previous) header->previous->next = header->next;
+        else pool->largeBlocks = header->next;
+        if (header->next) header->next->previous = header->previous;
+        pool->largeBytes -= header->size;
+        free(header);
+        return;
+    }
+
+    *(void**)block = pool->freeBlocks[sizeClass];
+    pool->freeBlocks[sizeClass] = block;
+    pool->freeBlockBytes += (size_t)POOL_MIN_BLOCK << sizeClass;
+}
+
+// Bytes allocated for extent 'index'; only the last one may be partial
+static size_t extentCapacity(extentMap* map, size_t index) {
+    return index + 1 == map->count ? map->tailCapacity : EXTENT_SIZE;
+}
+
+// Moves extent 'index' into a block of 'capacity' bytes, keeping its bytes
+static void extentResize(extentMap* map, size_t index, size_t capacity) {
+    size_t old = extentCapacity(map, index);
+    char* block = poolAlloc(activePool, capacity);
+    memcpy(block, map->extents[index], old);
+    poolRelease(activePool, map->extents[index], old);
+    map->extents[index] = block;
+}
+
+// Extent 'index' with room for its first 'needed' bytes, allocated or
+// grown as necessary. Extents past the old end start out as holes.
+static char* extentFor(extentMap* map, size_t index, size_t needed) {
+    if (index >= map->count) {
+        if (index >= map->capacity) {
+            size_t capacity = map->capacity ? map->capacity : 4;
+            while (capacity <= index) capacity *= 2;
+            char** extents = poolAlloc(activePool, capacity * sizeof(char*));
+            if (map->count > 0) memcpy(extents, map->extents, map->count * sizeof(char*));
+            poolRelease(activePool, map->extents, map->capacity * sizeof(char*));
+            map->extents = extents;
+            map->capacity = capacity;
+        }
+        // The old tail is no longer last, so it needs a whole extent
+        if (map->count > 0 && map->extents[map->count - 1] && map->tailCapacity < EXTENT_SIZE) {
+            extentResize(map, map->count - 1, EXTENT_SIZE);
+        }
+        map->count = index + 1;
+        map->tailCapacity = 0;
+    }
+
+    if (index + 1 < map->count) {
+        if (!map->extents[index]) map->extents[index] = poolAlloc(activePool, EXTENT_SIZE);
+    } else if (map->tailCapacity < needed) {
+        size_t capacity = (size_t)POOL_MIN_BLOCK << poolSizeClass(needed);
+        if (map->extents[index]) {
+            extentResize(map, index, capacity);
+        } else {
+            map->extents[index] = poolAlloc(activePool, capacity);
+        }
+        map->tailCapacity = capacity;
+    }
+    return map->extents[index];
+}
+
+// Copies 'data' to 'offset' of a file's content, allocating only the
+// extents it covers. The size is left to the caller.
+void contentStore(node* file, size_t offset, const char* data, size_t length) {
+    fileRecord* record = fileOf(file);
+    if (!record->content) record->content = poolAlloc(activePool, sizeof(extentMap));
+    extentMap* map = record->content;
+
+    while (length > 0) {
+        size_t index = offset / EXTENT_SIZE;
+        size_t within = offset % EXTENT_SIZE;
+        size_t piece = EXTENT_SIZE - within < length ? EXTENT_SIZE - within : length;
+        memcpy(extentFor(map, index, within + piece) + within, data, piece);
+        offset += piece;
+        data += piece;
+        length -= piece;
+    }
+}
+
+// Copies 'length' bytes from 'offset' of a file's content into 'buffer',
+// with zeros for holes
+void contentLoad(node* file, size_t offset, char* buffer, size_t length) {
+    extentMap* map = fileOf(file)->content;
+    while (length > 0) {
+        size_t index = offset / EXTENT_SIZE;
+        size_t within = offset % EXTENT_SIZE;
+        size_t piece = EXTENT_SIZE - within < length ? EXTENT_SIZE - within : length;
+        size_t stored = 0;
+        if (index < map->count && map->extents[index] && within < extentCapacity(map, index)) {
+            stored = extentCapacity(map, index) - within;
+            if (stored > piece) stored = piece;
+            memcpy(buffer, map->extents[index] + within, stored);
+        }
+        memset(buffer + stored, 0, piece - stored);
+        offset += piece;
+        buffer += piece;
+        length -= piece;
+    }
+}
+
+// Zeroes what the extents hold between 'from' and 'to', so bytes left past
+// the end of a file do not reappear when it grows over them
+void contentClear(node* file, size_t from, size_t to) {
+    extentMap* map = fileOf(file)->content;
+    for (; map && from < to; from = (from / EXTENT_SIZE + 1) * EXTENT_SIZE) {
+        size_t index = from / EXTENT_SIZE;
+        if (index >= map->count) break;
+        size_t within = from % EXTENT_SIZE;
+        size_t end = to - from < EXTENT_SIZE - within ? within + (to - from) : EXTENT_SIZE;
+        if (end > extentCapacity(map, index)) end = extentCapacity(map, index);
+        if (map->extents[index] && within < end) memset(map->extents[index] + within, 0, end - within);
+    }
+}
+
+// Gives 'to' its own copy of the extents 'from' holds, holes included
+void contentCopy(node* to, node* from) {
+    extentMap* map = fileOf(from)->content;
+    size_t size = nodeSize(from);
+    contentStore(to, 0, NULL, 0);
+    for (size_t i = 0; i < map->count && i * EXTENT_SIZE < size; i++) {
+        if (!map->extents[i]) continue;
+        size_t length = extentCapacity(map, i);
+        if (length > size - i * EXTENT_SIZE) length = size - i * EXTENT_SIZE;
+        contentStore(to, i * EXTENT_SIZE, map->extents[i], length);
+    }
+}
+
+static void extentMapFree(extentMap* map) {
+    for (size_t i = 0; i < map->count; i++) poolRelease(activePool, map->extents[i], extentCapacity(map, i));
+    poolRelease(activePool, map->extents, map->capacity * sizeof(char*));
+    poolRelease(activePool, map, sizeof(extentMap));
+}
+
+// While a snapshot may want the old content back, the journal keeps its
+// extents instead. A file with none yet is recorded too, so a rollback
+// drops whatever content it is given next.
+void contentFree(node* file) {
+    fileRecord* record = fileOf(file);
+    if (!record) return;
+    extentMap* map = record->content;
+    if (journaling()) journalPush(JournalContent, file)->saved = map;
+    else if (map) extentMapFree(map);
+    record->content = NULL;
+}
+
+// Prints pool occupancy and fragmentation for the 'mem' command
+void printPoolStats(treePool* pool) {
+    size_t nodeCapacity = pool->slabCount * NODES_PER_SLAB;
+    size_t stringBytes = pool->arenaUsed - pool->blockBytes - pool->recordBytes;
+
+    printf("Nodes:   %zu live, %zu on free list, %zu slabs (%zu slots of %zu bytes, %.1f%% occupied)\n",
+           pool->liveNodes, pool->freeNodeCount, pool->slabCount, nodeCapacity, sizeof(node),
+           nodeCapacity ? 100.0 * pool->liveNodes / nodeCapacity : 0.0);
+    printf("Records: %zu folders, %zu files, %zu symlinks in %zu bytes of side tables\n",
+           pool->folders.live, pool->files.live, pool->symlinks.live, pool->recordBytes);
+    printf("Strings: %zu bytes in use, %zu bytes discarded (%.1f%% fragmentation)\n",
+           stringBytes - pool->deadBytes, pool->deadBytes,
+           stringBytes ? 100.0 * pool->deadBytes / stringBytes : 0.0);
+    printf("Blocks:  %zu bytes carved, %zu bytes on free lists, %zu bytes in large blocks\n",
+           pool->blockBytes, pool->freeBlockBytes, pool->largeBytes);
+    printf("Arena:   %zu chunks, %zu of %zu bytes used (%.1f%%)\n",
+           pool->chunkCount, pool->arenaUsed, pool->arenaCapacity,
+           pool->arenaCapacity ? 100.0 * pool->arenaUsed / pool->arenaCapacity : 0.0);
+}
+
+
+// Where commands (and input they prompt for) are read from
+static FILE* commandInput = NULL;
+static int quietMode = 0;
+static unsigned long commandCount = 0;
+static unsigned long errorCount = 0;
+
+void note(const char* format, ...) {
+    if (quietMode) return;
+    va_list arguments;
+    va_start(arguments, format);
+    vprintf(format, arguments);
+    va_end(arguments);
+}
+
+void reportError(const char* format, ...) {
+    errorCount++;
+    va_list arguments;
+    va_start(arguments, format);
+    vprintf(format, arguments);
+    va_end(arguments);
+}
+
+// Reads one line from the command input. Returns NULL at end of input.
+char* getString() {
+    char* str = NULL;
+    size_t size = 0;
+    ssize_t len = getline(&str, &size, commandInput ? commandInput : stdin);
+    if (len < 0) {
+        free(str);
+        return NULL;
+    }
+    if (len > 0 && str[len - 1] == '\n') str[--len] = '\0';
+    if (len > 0 && str[len - 1] == '\r') str[--len] = '\0';
+    return str;
+}
+
+// Week 2: Count Total Files
+int countFiles(node* folder) {
+    if (!folder) return 0;
+    if (folder->type == File) return 1;
+    return folder->type == Folder ? (int)folderOf(folder)->totals.files : 0;
+}
+
+int countFolders(node* folder) {
+    if (!folder || folder->type != Folder) return 0;
+    return 1 + (int)folderOf(folder)->totals.folders;
+}
+
+void du(node* item) {
+    subtreeTotals totals = item->type == Folder ? folderOf(item)->totals : totalsOf(item);
+    printf("Files: %" PRIu64 "\nFolders: %" PRIu64 "\nSymlinks: %" PRIu64 "\nSize: %" PRIu64 " bytes\n",
+           totals.files, totals.folders, totals.symlinks, totals.bytes);
+}
+
+// Path cache. Resolved paths are kept in a direct-mapped table keyed by
+// the folder the walk started from and the path text. Each entry records
+// the tree generation it was made in; anything that can change what a
+// path resolves to (unlinking, renaming, loading) bumps the generation,
+// which retires every entry at once. Single components are answered by
+// the per-folder child index and need no entry of their own.
+typedef struct pathCacheEntry {
+    unsigned int hash;
+    uint32_t generation; // 0 marks an unused entry
+    nodeId start;
+    nodeId target;
+    char* path;
+    size_t capacity; // Bytes allocated for 'path', reused by later entries
+} pathCacheEntry;
+
+static pathCacheEntry pathCache[PATH_CACHE_SLOTS];
+static uint32_t treeGeneration = 1;
+static uint64_t pathCacheHits = 0;
+static uint64_t pathCacheMisses = 0;
+
+void invalidatePathCache() {
+    if (++treeGeneration == 0) {
+        // The counter wrapped, so old generations could look current again
+        clearPathCache();
+        treeGeneration = 1;
     }
 }
 
-node* parsePath(node* currentFolder, char* path, node* root) {
-    // Handle absolute path
-    if (path[0] == '/') {
-        currentFolder = root;
-        path++; // Skip the initial '/'
+void clearPathCache() {
+    for (size_t i = 0; i < PATH_CACHE_SLOTS; i++) {
+        free(pathCache[i].path);
+        pathCache[i].path = NULL;
+        pathCache[i].capacity = 0;
+        pathCache[i].generation = 0;
     }
+}
+
+static unsigned int pathCacheHash(nodeId start, const char* path) {
+    return hashName(path) ^ (start * 2654435761u);
+}
 
-    char* token = strtok(path, "/");
-    while (token != NULL) {
+// Walks 'path' one component at a time. Returns NULL if a component is
+// missing and copies its name into 'missing'.
+static node* walkPath(node* folder, const char* path, char* missing, size_t missingSize) {
+    size_t length = strlen(path);
+    char buffer[MAX_PATH_LENGTH];
+    char* copy = length < sizeof(buffer) ? buffer : malloc(length + 1);
+    memcpy(copy, path, length + 1);
+
+    // strtok_r leaves the caller's own strtok state alone
+    char* state = NULL;
+    for (char* token = strtok_r(copy, "/", &state); token && folder; token = strtok_r(NULL, "/", &state)) {
         if (strcmp(token, "..") == 0) {
             // Move to the parent directory
-            if (currentFolder->parent) {
-                currentFolder = currentFolder->parent;
+            if (folder->parent) {
+                folder = parentOf(folder);
             } else {
-                printf("Already at the root directory.\n");
+                note("Already at the root directory.\n");
             }
-        } else if (strcmp(token, ".") == 0) {
-            // Stay in the current directory (do nothing)
-        } else {
-            // Use getNodeTypeless to find the child node by name
-            node* nextFolder = getNodeTypeless(currentFolder, token);
-            if (nextFolder) {
-                currentFolder = nextFolder;
-            } else {
-                printf("Error: Directory or file '%s' not found.\n", token);
+        } else if (strcmp(token, ".") != 0) {
+            node* child = getNodeTypeless(folder, token);
+            if (!child && missing) snprintf(missing, missingSize, "%s", token);
+            folder = child;
+        }
+    }
+
+    if (copy != buffer) free(copy);
+    return folder;
+}
+
+node* lookupPath(node* currentFolder, const char* path, node* root, char* missing, size_t missingSize) {
+    node* start = path[0] == '/' ? root : currentFolder;
+    nodeId startId = idOf(start);
+    unsigned int hash = pathCacheHash(startId, path);
+    pathCacheEntry* entry = &pathCache[hash & (PATH_CACHE_SLOTS - 1)];
+
+    if (entry->generation == treeGeneration && entry->hash == hash && entry->start == startId &&
+        strcmp(entry->path, path) == 0) {
+        pathCacheHits++;
+        return nodeAt(entry->target);
+    }
+
+    pathCacheMisses++;
+    node* target = walkPath(start, path, missing, missingSize);
+    if (target) {
+        size_t length = strlen(path) + 1;
+        if (length > entry->capacity) {
+            free(entry->path);
+            entry->capacity = length < 64 ? 64 : length;
+            entry->path = malloc(entry->capacity);
+        }
+        memcpy(entry->path, path, length);
+        entry->hash = hash;
+        entry->generation = treeGeneration;
+        entry->start = startId;
+        entry->target = idOf(target);
+    }
+    return target;
+}
+
+node* parsePath(node* currentFolder, const char* path, node* root) {
+    char missing[256];
+    node* target = lookupPath(currentFolder, path, root, missing, sizeof(missing));
+    if (!target) reportError("Error: Directory or file '%s' not found.\n", missing);
+    return target;
+}
+
+// Node a symlink's target names, relative to the folder holding the link.
+// A target found is kept until something is unlinked, renamed or loaded.
+// A missing one is looked up again every time, because creating the
+// target does not bump the generation.
+node* symlinkStep(node* link, node* root) {
+    symlinkRecord* record = symlinkOf(link);
+    if (!record || !record->target) return NULL;
+    if (record->generation == treeGeneration) return nodeAt(record->resolved);
+
+    char missing[256];
+    node* target = lookupPath(parentOf(link), record->target, root, missing, sizeof(missing));
+    if (target) {
+        record->resolved = idOf(target);
+        record->generation = treeGeneration;
+    }
+    return target;
+}
+
+// Follows symlinks from 'item' to the first node that is not one. Returns
+// NULL with 'error' set to ENOENT for a dangling link, or ELOOP for a cycle
+// or a chain longer than SYMLINK_MAX_HOPS.
+node* resolveSymlinks(node* item, node* root, int* error) {
+    nodeId visited[SYMLINK_MAX_HOPS];
+    for (size_t hops = 0; item && item->type == Symlink; hops++) {
+        if (hops == SYMLINK_MAX_HOPS) {
+            *error = ELOOP;
+            return NULL;
+        }
+        for (size_t i = 0; i < hops; i++) {
+            if (visited[i] == idOf(item)) {
+                *error = ELOOP;
                 return NULL;
             }
         }
-        token = strtok(NULL, "/");
+        visited[hops] = idOf(item);
+        item = symlinkStep(item, root);
     }
+    if (!item) *error = ENOENT;
+    return item;
+}
 
-    return currentFolder;
+// Absolute path of a node in the tree. The caller frees it.
+char* nodePath(node* item) {
+    size_t length = 2;
+    for (node* cursor = item; parentOf(cursor); cursor = parentOf(cursor)) {
+        length += strlen(nameOf(cursor)) + 1;
+    }
+    char* path = malloc(length);
+    char* end = path + length - 1;
+    *end = '\0';
+    for (node* cursor = item; parentOf(cursor); cursor = parentOf(cursor)) {
+        size_t size = strlen(nameOf(cursor));
+        end -= size;
+        memcpy(end, nameOf(cursor), size);
+        *--end = '/';
+    }
+    if (end == path + length - 1) *--end = '/';
+    memmove(path, end, strlen(end) + 1);
+    return path;
+}
+
+
+// Writes all of 'data' to 'fd', retrying short writes. Returns 0 or -errno.
+static int writeFully(int fd, const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -errno;
+        }
+        data += written;
+        length -= (size_t)written;
+    }
+    return 0;
+}
+
+// Copies 'size' bytes of the regular file 'in' to 'out' without bringing
+// them into a buffer of ours: sendfile where the kernel takes the pair,
+// splice if 'out' is a pipe it refused, and otherwise one mmap of the file
+// handed to a single write. Returns 0 or -errno.
+static int streamFile(int in, int out, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t sent = sendfile(out, in, NULL, size - done);
+        if (sent > 0) {
+            done += (size_t)sent;
+            continue;
+        }
+        if (sent == 0) return 0; // The file got shorter
+        if (errno == EINTR) continue;
+        if (errno != EINVAL && errno != ENOSYS) return -errno;
+        break;
+    }
+
+    struct stat info;
+    if (done < size && fstat(out, &info) == 0 && S_ISFIFO(info.st_mode)) {
+        while (done < size) {
+            loff_t offset = done;
+            ssize_t moved = splice(in, &offset, out, NULL, size - done, SPLICE_F_MOVE);
+            if (moved > 0) {
+                done += (size_t)moved;
+                continue;
+            }
+            if (moved == 0) return 0;
+            if (errno == EINTR) continue;
+            if (errno != EINVAL) return -errno;
+            break;
+        }
+    }
+    if (done == size) return 0;
+
+    char* mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, in, 0);
+    if (mapped == MAP_FAILED) return -errno;
+    madvise(mapped, size, MADV_SEQUENTIAL);
+    int result = writeFully(out, mapped + done, size - done);
+    munmap(mapped, size);
+    return result;
 }
 
+// Copies the real file at 'from' to 'to', replacing it. Returns 0 or -errno.
+static int copyRealFile(const char* from, const char* to) {
+    int in = open(from, O_RDONLY | O_CLOEXEC);
+    if (in < 0) return -errno;
+    struct stat info;
+    if (fstat(in, &info) != 0) {
+        int error = errno;
+        close(in);
+        return -error;
+    }
+    int out = open(to, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out < 0) {
+        int error = errno;
+        close(in);
+        return -error;
+    }
+    int result = streamFile(in, out, info.st_size);
+    if (close(out) != 0 && result == 0) result = -errno;
+    close(in);
+    return result;
+}
 
 // Function to read and display the contents of a file
 void echo(node* currentFolder, char* fileName, node* root) {
     // Find the node with the given file name in the current folder
     node* targetNode = getNodeTypeless(currentFolder, fileName);
     if (targetNode == NULL) {
-        printf("Error: File '%s' not found.\n", fileName);
+        reportError("Error: File '%s' not found.\n", fileName);
         return;
     }
 
-    // If the node is a symlink, resolve it to its target
+    // If the node is a symlink, follow it (and any it points to) to the end
     if (targetNode->type == Symlink) {
-        char* targetPath = targetNode->symlinkTarget;
-        printf("Following symlink '%s' -> '%s'\n", fileName, targetPath);
-
-        // Resolve the symlink path
-        targetNode = parsePath(currentFolder, targetPath, root);
+        note("Following symlink '%s' -> '%s'\n", fileName, symlinkTarget(targetNode));
+        int error;
+        targetNode = resolveSymlinks(targetNode, root, &error);
         if (targetNode == NULL) {
-            printf("Error: Target of symlink '%s' not found.\n", fileName);
+            if (error == ELOOP) reportError("Error: Too many levels of symbolic links at '%s'.\n", fileName);
+            else reportError("Error: Target of symlink '%s' not found.\n", fileName);
             return;
         }
     }
 
     // Ensure the resolved node is a file
     if (targetNode->type != File) {
-        printf("Error: '%s' is not a file.\n", fileName);
+        reportError("Error: '%s' is not a file.\n", fileName);
         return;
     }
 
-    // Construct the real file path
-    char realPath[MAX_PATH_LENGTH];
-    getRealPath(targetNode->parent, realPath);
-    char fullPath[MAX_PATH_LENGTH];
-    int n = snprintf(fullPath, sizeof(fullPath), "%s/%s", realPath, targetNode->name);
-
-    // Check if the output was truncated
-    if (n < 0 || n >= (int)sizeof(fullPath)) {
-        fprintf(stderr, "Error: Path too long for file '%s'.\n", fileName);
+    // Stream the real file to stdout, once queued writes have landed
+    char* fullPath = realPathOf(parentOf(targetNode), nameOf(targetNode));
+    mirrorWait();
+    int fd = open(fullPath, O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        reportError("Error: Could not open file '%s'.\n", fullPath);
+        if (fd >= 0) close(fd);
+        free(fullPath);
         return;
     }
 
-    // Open and read the file contents
-    FILE* file = fopen(fullPath, "r");
-    if (file == NULL) {
-        printf("Error: Could not open file '%s'.\n", fullPath);
+    printf("Contents of '%s':\n", fullPath);
+    fflush(stdout); // Keep order with what printf has buffered
+    int result = streamFile(fd, STDOUT_FILENO, info.st_size);
+    if (result != 0) reportError("Error: Could not read file '%s': %s\n", fullPath, strerror(-result));
+
+    close(fd);
+    free(fullPath);
+}
+
+void cp(node* currentFolder, char* sourceName, char* destinationName) {
+    node* source = getNode(currentFolder, sourceName, File);
+    if (!source) {
+        reportError("Error: File '%s' not found.\n", sourceName);
         return;
     }
 
-    printf("Contents of '%s':\n", fullPath);
-    char buffer[256];
-    while (fgets(buffer, sizeof(buffer), file) != NULL) {
-        printf("%s", buffer);
+    // Into a folder under its own name, or here under a new one
+    node* folder = currentFolder;
+    char* name = destinationName;
+    node* existing = getNodeTypeless(currentFolder, destinationName);
+    if (existing && existing->type == Folder) {
+        folder = existing;
+        name = sourceName;
+        existing = getNodeTypeless(folder, name);
+    }
+    if (existing) {
+        reportError("'%s' already exists in the destination folder!\n", name);
+        return;
     }
 
-    fclose(file);
+    node* copy = createNode(name, File);
+    if (nodeSize(source) > 0 || hasContent(source)) {
+        poolAttachPayload(activePool, copy);
+        fileOf(copy)->size = nodeSize(source);
+        if (hasContent(source)) contentCopy(copy, source);
+    }
+    appendChild(folder, copy);
+
+    // The real copy goes kernel to kernel, once queued writes have landed
+    char* from = realPathOf(currentFolder, sourceName);
+    char* to = realPathOf(folder, name);
+    mirrorWait();
+    int result = copyRealFile(from, to);
+    if (result != 0) {
+        reportError("Error: Could not copy '%s' to '%s' in the real filesystem: %s\n", from, to, strerror(-result));
+    } else {
+        note("Copied '%s' to '%s'.\n", sourceName, to);
+    }
+    free(from);
+    free(to);
 }
 
 
@@ -281,24 +1462,29 @@ void saveDirectoryToFile(node* folder, FILE* file, int depth) {
     fprintf(file, "\"type\": \"%s\",\n", folder->type == Folder ? "Folder" : (folder->type == File ? "File" : "Symlink"));
 
     for (int i = 0; i <= depth; i++) fprintf(file, "  ");
-    fprintf(file, "\"name\": \"%s\",\n", folder->name);
+    fprintf(file, "\"name\": \"%s\",\n", nameOf(folder));
 
     for (int i = 0; i <= depth; i++) fprintf(file, "  ");
-    fprintf(file, "\"size\": %zu,\n", folder->size);
+    fprintf(file, "\"size\": %zu,\n", nodeSize(folder));
 
     for (int i = 0; i <= depth; i++) fprintf(file, "  ");
     fprintf(file, "\"date\": %ld", folder->date);
 
-    if (folder->type == File && folder->content) {
+    if (folder->type == File && hasContent(folder)) {
+        size_t size = nodeSize(folder);
+        char* content = malloc(size + 1);
+        contentLoad(folder, 0, content, size);
+        content[size] = '\0';
         fprintf(file, ",\n");
         for (int i = 0; i <= depth; i++) fprintf(file, "  ");
-        fprintf(file, "\"content\": \"%s\"", folder->content);
+        fprintf(file, "\"content\": \"%s\"", content);
+        free(content);
     }
 
     if (folder->type == Symlink) {
         fprintf(file, ",\n");
         for (int i = 0; i <= depth; i++) fprintf(file, "  ");
-        fprintf(file, "\"symlinkTarget\": \"%s\"", folder->symlinkTarget);
+        fprintf(file, "\"symlinkTarget\": \"%s\"", symlinkTarget(folder));
     }
 
     // Children
@@ -306,10 +1492,10 @@ void saveDirectoryToFile(node* folder, FILE* file, int depth) {
     for (int i = 0; i <= depth; i++) fprintf(file, "  ");
     fprintf(file, "\"children\": [\n");
 
-    node* current = folder->child;
+    node* current = firstChildOf(folder);
     while (current) {
         saveDirectoryToFile(current, file, depth + 1);
-        current = current->next;
+        current = nextOf(current);
         if (current) fprintf(file, ",\n");
     }
 
@@ -326,7 +1512,7 @@ void saveDirectoryToFile(node* folder, FILE* file, int depth) {
 void saveDirectory(node* root, const char* filename) {
     FILE* file = fopen(filename, "w");
     if (!file) {
-        printf("Error: Could not open file '%s' for saving.\n", filename);
+        reportError("Error: Could not open file '%s' for saving.\n", filename);
         return;
     }
 
@@ -334,74 +1520,583 @@ void saveDirectory(node* root, const char* filename) {
     fprintf(file, "\n"); // Final newline for cleanliness
     fclose(file);
 
-    printf("Directory structure saved to '%s'.\n", filename);
+    note("Directory structure saved to '%s'.\n", filename);
 }
 
 
-node* loadDirectoryFromFile(FILE* file, node* parent) {
-    char line[1024];
-    node* firstChild = NULL;
-    node* previousSibling = NULL;
+// Binary snapshot format. A header is followed by three sections: the
+// node table in pre-order (so every parent precedes its children), the
+// string heap holding NUL-terminated names, and the content heap holding
+// file contents and symlink targets. All integers are in host byte order.
+#define SNAPSHOT_MAGIC "SFSSNAP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_NO_PARENT UINT32_MAX
+#define SNAPSHOT_HAS_DATA 0x01
+#define SNAPSHOT_SORT_BY_NAME 0x02 // Folder keeps its children sorted
+#define SNAPSHOT_SORT_BY_DATE 0x04
+
+typedef struct snapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t nodeCount;
+    uint64_t stringHeapSize;
+    uint64_t contentHeapSize;
+} snapshotHeader;
+
+typedef struct snapshotNode {
+    uint32_t parent; // Pre-order index of the parent
+    uint8_t type;
+    uint8_t flags;
+    uint16_t reserved;
+    int64_t date;
+    uint64_t size;
+    uint64_t nameOffset;
+    uint64_t dataOffset; // Content for files, target for symlinks
+    uint64_t dataLength;
+} snapshotNode;
+
+// Buffered writer that hands full buffers to 'flush'
+void sinkWrite(byteSink* sink, const void* data, size_t length) {
+    const char* bytes = data;
+    while (length > 0 && !sink->failed) {
+        size_t room = SINK_BUFFER_SIZE - sink->used;
+        size_t chunk = length < room ? length : room;
+        memcpy(sink->buffer + sink->used, bytes, chunk);
+        sink->used += chunk;
+        bytes += chunk;
+        length -= chunk;
+        if (sink->used == SINK_BUFFER_SIZE) sinkFlush(sink);
+    }
+}
 
-    while (fgets(line, sizeof(line), file)) {
-        // End of the current folder's children
-        if (strstr(line, "]")) break;
+void sinkFlush(byteSink* sink) {
+    if (sink->used > 0 && !sink->failed) {
+        if (sink->flush(sink->context, sink->buffer, sink->used) != 0) sink->failed = 1;
+    }
+    sink->used = 0;
+}
 
-        // Check for opening brace indicating a new node
-        if (strstr(line, "{")) {
-            // Create a new node
-            node* newNode = malloc(sizeof(node));
-            newNode->parent = parent;
-            newNode->child = NULL;
-            newNode->next = NULL;
-            newNode->previous = previousSibling;
-            newNode->symlinkTarget = NULL;
-            newNode->numberOfItems = 0;
+// Next node in pre-order within the subtree rooted at 'top', without recursion
+node* nextPreorder(node* current, node* top) {
+    node* child = firstChildOf(current);
+    if (child) return child;
 
-            // Parse node properties
-            while (fgets(line, sizeof(line), file) && !strstr(line, "}")) {
-                if (strstr(line, "\"type\":")) {
-                    if (strstr(line, "Folder")) {
-                        newNode->type = Folder;
-                    } else if (strstr(line, "File")) {
-                        newNode->type = File;
+    while (current != top) {
+        node* sibling = nextOf(current);
+        if (sibling) return sibling;
+        current = parentOf(current);
+    }
+    return NULL;
+}
+
+// Whether a node has data for the content heap, and how many bytes
+static int snapshotData(node* item, uint64_t* length) {
+    if (item->type == File) {
+        *length = nodeSize(item);
+        return hasContent(item);
+    }
+    char* target = symlinkTarget(item);
+    *length = target ? strlen(target) : 0;
+    return target != NULL;
+}
+
+// Streams the snapshot of the subtree at 'root' into 'sink'. The tree is
+// walked once to size the sections, then once per section.
+void writeSnapshot(node* root, byteSink* sink) {
+    snapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header.version = SNAPSHOT_VERSION;
+
+    for (node* item = root; item; item = nextPreorder(item, root)) {
+        uint64_t length;
+        header.nodeCount++;
+        header.stringHeapSize += strlen(nameOf(item)) + 1;
+        if (snapshotData(item, &length)) header.contentHeapSize += length;
+    }
+    sinkWrite(sink, &header, sizeof(header));
+
+    // Node table. 'ancestors' holds the pre-order index of each folder on
+    // the path from the root to the current node.
+    size_t depthCapacity = 64;
+    size_t depth = 0;
+    uint32_t* ancestors = malloc(depthCapacity * sizeof(uint32_t));
+    uint64_t nameOffset = 0;
+    uint64_t dataOffset = 0;
+    uint32_t index = 0;
+    node* item = root;
+
+    while (item) {
+        snapshotNode record;
+        memset(&record, 0, sizeof(record));
+        record.parent = depth == 0 ? SNAPSHOT_NO_PARENT : ancestors[depth - 1];
+        record.type = item->type;
+        record.date = item->date;
+        record.size = nodeSize(item);
+        record.nameOffset = nameOffset;
+
+        childOrder* order = item->type == Folder ? folderOf(item)->order : NULL;
+        if (order) record.flags |= order->mode == SortByName ? SNAPSHOT_SORT_BY_NAME : SNAPSHOT_SORT_BY_DATE;
+        if (snapshotData(item, &record.dataLength)) {
+            record.flags |= SNAPSHOT_HAS_DATA;
+            record.dataOffset = dataOffset;
+            dataOffset += record.dataLength;
+        } else {
+            record.dataLength = 0;
+        }
+        nameOffset += strlen(nameOf(item)) + 1;
+        sinkWrite(sink, &record, sizeof(record));
+
+        // Same walk as nextPreorder, tracking the depth on the way
+        node* child = firstChildOf(item);
+        if (child) {
+            if (depth == depthCapacity) {
+                depthCapacity *= 2;
+                ancestors = realloc(ancestors, depthCapacity * sizeof(uint32_t));
+            }
+            ancestors[depth++] = index;
+            item = child;
+        } else {
+            while (item != root && !nextOf(item)) {
+                item = parentOf(item);
+                depth--;
+            }
+            item = item == root ? NULL : nextOf(item);
+        }
+        index++;
+    }
+    free(ancestors);
+
+    for (node* item = root; item; item = nextPreorder(item, root)) {
+        sinkWrite(sink, nameOf(item), strlen(nameOf(item)) + 1);
+    }
+    for (node* item = root; item; item = nextPreorder(item, root)) {
+        uint64_t length;
+        if (!snapshotData(item, &length)) continue;
+        if (item->type == Symlink) {
+            sinkWrite(sink, symlinkTarget(item), length);
+            continue;
+        }
+        // File content goes straight from the extents into the sink buffer
+        for (uint64_t offset = 0; offset < length && !sink->failed;) {
+            if (sink->used == SINK_BUFFER_SIZE) sinkFlush(sink);
+            size_t piece = SINK_BUFFER_SIZE - sink->used;
+            if (piece > length - offset) piece = length - offset;
+            contentLoad(item, offset, sink->buffer + sink->used, piece);
+            sink->used += piece;
+            offset += piece;
+        }
+    }
+    sinkFlush(sink);
+}
+
+static int flushToFile(void* context, const char* data, size_t length) {
+    return fwrite(data, 1, length, (FILE*)context) == length ? 0 : -1;
+}
+
+void saveSnapshot(node* root, const char* filename) {
+    FILE* file = fopen(filename, "wb");
+    if (!file) {
+        reportError("Error: Could not open file '%s' for saving.\n", filename);
+        return;
+    }
+
+    byteSink* sink = calloc(1, sizeof(byteSink));
+    sink->flush = flushToFile;
+    sink->context = file;
+    writeSnapshot(root, sink);
+    int failed = sink->failed;
+    free(sink);
+
+    if (fclose(file) != 0 || failed) {
+        reportError("Error: Could not write snapshot to '%s'.\n", filename);
+        return;
+    }
+    note("Directory structure saved to '%s' (binary).\n", filename);
+}
+
+int isSnapshot(const void* data, size_t length) {
+    return length >= sizeof(snapshotHeader) && memcmp(data, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) == 0;
+}
+
+// Incremental snapshot reader. The sections arrive in order and names and
+// data are laid out in the same pre-order as the node table, so node i is
+// created as soon as its name has arrived and its data is copied as it
+// streams in. Input can be fed in pieces of any size.
+enum snapshotStage {StageHeader, StageTable, StageNames, StageContents, StageDone, StageFailed};
+
+typedef struct snapshotBuilder {
+    snapshotHeader header;
+    enum snapshotStage stage;
+    uint64_t stageUsed;   // Bytes of the current section consumed so far
+    const char* table;    // Node table, borrowed or owned
+    char* ownedTable;
+    int stableInput;      // Fed buffers outlive the builder, so the table can be borrowed
+    uint64_t inputLength; // Size of the whole input when known up front, else 0
+    nodeId* built;
+    uint64_t nextName;    // Next node waiting for its name
+    uint64_t nextData;    // Next node whose data is being copied
+    uint64_t dataUsed;
+    int copying;          // Started on the data of node nextData
+    char* pendingName;    // Name split across two feeds, or symlink target being copied
+    size_t pendingLength;
+    size_t pendingCapacity;
+    node* root;
+} snapshotBuilder;
+
+static snapshotNode snapshotRecord(snapshotBuilder* builder, uint64_t i) {
+    snapshotNode record;
+    memcpy(&record, builder->table + i * sizeof(snapshotNode), sizeof(record));
+    return record;
+}
+
+// Moves past sections that are complete, including empty ones
+static void builderAdvance(snapshotBuilder* builder) {
+    if (builder->stage == StageHeader && builder->stageUsed == sizeof(snapshotHeader)) {
+        snapshotHeader* header = &builder->header;
+        if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 || header->version != SNAPSHOT_VERSION ||
+            header->nodeCount == 0 || header->nodeCount >= UINT32_MAX || header->stringHeapSize < header->nodeCount) {
+            builder->stage = StageFailed;
+            return;
+        }
+        // Sections follow the header back to back, so a known input size
+        // bounds each of them before anything is sized from the header
+        if (builder->inputLength) {
+            uint64_t left = builder->inputLength - sizeof(snapshotHeader);
+            uint64_t tableSize = header->nodeCount * sizeof(snapshotNode);
+            if (tableSize > left || header->stringHeapSize > left - tableSize ||
+                header->contentHeapSize != left - tableSize - header->stringHeapSize) {
+                builder->stage = StageFailed;
+                return;
+            }
+        }
+        builder->built = malloc(header->nodeCount * sizeof(nodeId));
+        if (!builder->built) {
+            builder->stage = StageFailed;
+            return;
+        }
+        builder->stage = StageTable;
+        builder->stageUsed = 0;
+    }
+    if (builder->stage == StageTable && builder->stageUsed == builder->header.nodeCount * sizeof(snapshotNode)) {
+        builder->stage = StageNames;
+        builder->stageUsed = 0;
+    }
+    if (builder->stage == StageNames && builder->nextName == builder->header.nodeCount) {
+        if (builder->stageUsed != builder->header.stringHeapSize) {
+            builder->stage = StageFailed;
+            return;
+        }
+        builder->stage = StageContents;
+        builder->stageUsed = 0;
+    }
+    if (builder->stage == StageContents) {
+        // Skip nodes without data
+        while (builder->nextData < builder->header.nodeCount &&
+               !(snapshotRecord(builder, builder->nextData).flags & SNAPSHOT_HAS_DATA)) {
+            builder->nextData++;
+        }
+        if (builder->nextData == builder->header.nodeCount) {
+            builder->stage = builder->stageUsed == builder->header.contentHeapSize ? StageDone : StageFailed;
+        }
+    }
+}
+
+// Creates node 'nextName' once its name is complete
+static int builderCreateNode(snapshotBuilder* builder, const char* name) {
+    uint64_t i = builder->nextName;
+    snapshotNode record = snapshotRecord(builder, i);
+
+    // Parents come first in pre-order, and the root is the only orphan
+    int validParent = i == 0 ? record.parent == SNAPSHOT_NO_PARENT : record.parent < i;
+    node* parent = i == 0 || !validParent ? NULL : nodeAt(builder->built[record.parent]);
+    if (!validParent || record.type > Symlink || (parent && parent->type != Folder) || (i == 0 && record.type != Folder)) {
+        return -1;
+    }
+    if ((record.flags & SNAPSHOT_HAS_DATA) && record.type == Folder) return -1;
+
+    node* newNode = createNode(name, record.type);
+    newNode->date = record.date;
+    if (record.type == Folder && (record.flags & (SNAPSHOT_SORT_BY_NAME | SNAPSHOT_SORT_BY_DATE))) {
+        setChildOrder(newNode, record.flags & SNAPSHOT_SORT_BY_NAME ? SortByName : SortByDate);
+    }
+    if (record.type == File && (record.size > 0 || (record.flags & SNAPSHOT_HAS_DATA))) {
+        poolAttachPayload(activePool, newNode);
+        fileOf(newNode)->size = record.size;
+    }
+
+    builder->built[i] = idOf(newNode);
+    // Totals are summed once at the end instead of walking up per node
+    if (parent) linkChild(parent, newNode);
+    else builder->root = newNode;
+    builder->nextName++;
+    return 0;
+}
+
+static size_t builderFeedNames(snapshotBuilder* builder, const char* input, size_t length) {
+    size_t consumed = 0;
+    while (consumed < length && builder->nextName < builder->header.nodeCount) {
+        const char* start = input + consumed;
+        const char* end = memchr(start, '\0', length - consumed);
+        size_t piece = end ? (size_t)(end - start) + 1 : length - consumed;
+
+        if (!end || builder->pendingLength > 0) {
+            if (builder->pendingLength + piece > builder->pendingCapacity) {
+                builder->pendingCapacity = (builder->pendingLength + piece) * 2;
+                builder->pendingName = realloc(builder->pendingName, builder->pendingCapacity);
+            }
+            memcpy(builder->pendingName + builder->pendingLength, start, piece);
+            builder->pendingLength += piece;
+        }
+        consumed += piece;
+
+        if (end) {
+            const char* name = builder->pendingLength > 0 ? builder->pendingName : start;
+            builder->pendingLength = 0;
+            if (builderCreateNode(builder, name) != 0) {
+                builder->stage = StageFailed;
+                break;
+            }
+        }
+    }
+    return consumed;
+}
+
+static size_t builderFeedContents(snapshotBuilder* builder, const char* input, size_t length) {
+    size_t consumed = 0;
+    while (consumed < length && builder->stage == StageContents) {
+        snapshotNode record = snapshotRecord(builder, builder->nextData);
+        node* item = nodeAt(builder->built[builder->nextData]);
+        if (!builder->copying) {
+            // Data must fit in what is left of the content section
+            uint64_t left = builder->header.contentHeapSize - builder->stageUsed;
+            if (record.dataOffset != builder->stageUsed || record.dataLength > left) {
+                builder->stage = StageFailed;
+                break;
+            }
+            if (item->type == File) contentStore(item, 0, NULL, 0);
+            builder->copying = 1;
+        }
+
+        // File content goes into its extents as it arrives; bytes past the
+        // recorded size are dropped
+        uint64_t wanted = record.dataLength - builder->dataUsed;
+        size_t piece = wanted < length - consumed ? wanted : length - consumed;
+        if (item->type == Symlink) {
+            // Buffered as it arrives, so a streamed section that ends early
+            // never has a target allocated at its recorded length
+            if (builder->dataUsed + piece > builder->pendingCapacity) {
+                size_t capacity = (builder->dataUsed + piece) * 2;
+                char* grown = realloc(builder->pendingName, capacity);
+                if (!grown) {
+                    builder->stage = StageFailed;
+                    break;
+                }
+                builder->pendingName = grown;
+                builder->pendingCapacity = capacity;
+            }
+            if (piece) memcpy(builder->pendingName + builder->dataUsed, input + consumed, piece);
+        } else if (builder->dataUsed < record.size) {
+            uint64_t kept = record.size - builder->dataUsed;
+            contentStore(item, builder->dataUsed, input + consumed, kept < piece ? kept : piece);
+        }
+        builder->dataUsed += piece;
+        builder->stageUsed += piece;
+        consumed += piece;
+
+        if (builder->dataUsed == record.dataLength) {
+            if (item->type == Symlink) {
+                char* target = poolCarve(activePool, record.dataLength + 1, 1);
+                if (record.dataLength) memcpy(target, builder->pendingName, record.dataLength);
+                target[record.dataLength] = '\0';
+                symlinkOf(item)->target = target;
+            }
+            builder->copying = 0;
+            builder->dataUsed = 0;
+            builder->nextData++;
+            builderAdvance(builder);
+        }
+    }
+    return consumed;
+}
+
+// Feeds the next piece of a snapshot. Returns -1 once the input is invalid.
+int builderFeed(snapshotBuilder* builder, const char* input, size_t length) {
+    while (length > 0) {
+        size_t consumed = 0;
+        if (builder->stage == StageHeader) {
+            consumed = sizeof(snapshotHeader) - builder->stageUsed;
+            if (consumed > length) consumed = length;
+            memcpy((char*)&builder->header + builder->stageUsed, input, consumed);
+            builder->stageUsed += consumed;
+        } else if (builder->stage == StageTable) {
+            uint64_t tableSize = builder->header.nodeCount * sizeof(snapshotNode);
+            consumed = tableSize - builder->stageUsed < length ? tableSize - builder->stageUsed : length;
+            if (builder->stableInput && builder->stageUsed == 0 && consumed == tableSize) {
+                builder->table = input;
+            } else {
+                if (!builder->ownedTable) builder->ownedTable = malloc(tableSize);
+                if (!builder->ownedTable) {
+                    builder->stage = StageFailed;
+                    return -1;
+                }
+                memcpy(builder->ownedTable + builder->stageUsed, input, consumed);
+                builder->table = builder->ownedTable;
+            }
+            builder->stageUsed += consumed;
+        } else if (builder->stage == StageNames) {
+            consumed = builderFeedNames(builder, input, length);
+            builder->stageUsed += consumed;
+        } else if (builder->stage == StageContents) {
+            consumed = builderFeedContents(builder, input, length);
+        } else {
+            // Trailing bytes after a complete snapshot, or an earlier failure
+            builder->stage = StageFailed;
+            return -1;
+        }
+
+        if (builder->stage == StageFailed) return -1;
+        builderAdvance(builder);
+        if (builder->stage == StageFailed) return -1;
+        input += consumed;
+        length -= consumed;
+    }
+    return 0;
+}
+
+// Releases the builder and returns the finished tree, or NULL if the
+// snapshot was invalid or truncated
+node* builderFinish(snapshotBuilder* builder) {
+    node* root = builder->stage == StageDone ? builder->root : NULL;
+
+    // Children follow their parents, so a reverse pass sees every folder
+    // complete before adding it to its own parent
+    for (uint64_t i = root ? builder->header.nodeCount - 1 : 0; i > 0; i--) {
+        node* item = nodeAt(builder->built[i]);
+        subtreeTotals delta = totalsOf(item);
+        subtreeTotals* totals = &folderOf(parentOf(item))->totals;
+        totals->files += delta.files;
+        totals->folders += delta.folders;
+        totals->symlinks += delta.symlinks;
+        totals->bytes += delta.bytes;
+    }
+    free(builder->built);
+    free(builder->ownedTable);
+    free(builder->pendingName);
+    return root;
+}
+
+// Builds a tree in the active pool from a complete snapshot image
+node* buildFromSnapshot(const char* image, size_t length) {
+    if (!isSnapshot(image, length)) return NULL;
+
+    snapshotBuilder builder;
+    memset(&builder, 0, sizeof(builder));
+    builder.stableInput = 1;
+    builder.inputLength = length;
+    builderFeed(&builder, image, length);
+    return builderFinish(&builder);
+}
+
+// Maps a snapshot file and builds the tree from it
+node* loadSnapshot(const char* filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        reportError("Error: Could not open file '%s' for loading.\n", filename);
+        return NULL;
+    }
+
+    struct stat info;
+    node* loadedRoot = NULL;
+    if (fstat(fd, &info) == 0 && info.st_size > 0) {
+        void* image = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (image != MAP_FAILED) {
+            posix_madvise(image, info.st_size, POSIX_MADV_SEQUENTIAL);
+            loadedRoot = buildFromSnapshot(image, info.st_size);
+            munmap(image, info.st_size);
+        }
+    }
+    close(fd);
+
+    if (loadedRoot) {
+        note("Directory structure loaded from '%s'.\n", filename);
+    } else {
+        reportError("Error: Failed to load directory structure from '%s'.\n", filename);
+    }
+    return loadedRoot;
+}
+
+
+node* loadDirectoryFromFile(FILE* file, node* parent) {
+    char line[1024];
+    node* firstChild = NULL;
+
+    while (fgets(line, sizeof(line), file)) {
+        // End of the current folder's children
+        if (strstr(line, "]")) break;
+
+        // Check for opening brace indicating a new node
+        if (strstr(line, "{")) {
+            // Create a new node
+            node* newNode = poolAllocNode(activePool);
+
+            // Parse node properties
+            while (fgets(line, sizeof(line), file) && !strstr(line, "}")) {
+                if (strstr(line, "\"type\":")) {
+                    if (strstr(line, "Folder")) {
+                        newNode->type = Folder;
+                    } else if (strstr(line, "File")) {
+                        newNode->type = File;
                     } else if (strstr(line, "Symlink")) {
                         newNode->type = Symlink;
                     }
+                    if (newNode->type != File) {
+                        poolAttachPayload(activePool, newNode);
+                    }
                 } else if (strstr(line, "\"name\":")) {
                     char name[256];
                     sscanf(line, " \"name\": \"%255[^\"]\"", name);
-                    newNode->name = strdup(name);
+                    setNodeName(newNode, name);
                 } else if (strstr(line, "\"size\":")) {
-                    sscanf(line, " \"size\": %zu", &newNode->size);
+                    size_t size = 0;
+                    sscanf(line, " \"size\": %zu", &size);
+                    if (newNode->type == File && size > 0) {
+                        setFileSize(newNode, size);
+                    }
                 } else if (strstr(line, "\"date\":")) {
                     sscanf(line, " \"date\": %ld", &newNode->date);
                 } else if (strstr(line, "\"symlinkTarget\":")) {
                     char target[256];
                     sscanf(line, " \"symlinkTarget\": \"%255[^\"]\"", target);
-                    newNode->symlinkTarget = strdup(target);
+                    if (symlinkOf(newNode)) symlinkOf(newNode)->target = poolString(activePool, target);
                 } else if (strstr(line, "\"content\":")) {
-                    char content[1024];
+                    char content[1024] = "";
                     sscanf(line, " \"content\": \"%1023[^\"]\"", content);
-                    newNode->content = strdup(content);
+                    if (newNode->type == File) {
+                        poolAttachPayload(activePool, newNode);
+                        contentStore(newNode, 0, content, strlen(content));
+                    }
                 } else if (strstr(line, "\"children\":")) {
                     // Recursively load children
-                    newNode->child = loadDirectoryFromFile(file, newNode);
-                    newNode->numberOfItems = countFiles(newNode);// + countFolders(newNode); // Update count
+                    loadDirectoryFromFile(file, newNode);
                 }
             }
 
+            if (newNode->type != File) {
+                poolAttachPayload(activePool, newNode);
+            }
+
             // Link sibling nodes properly
+            if (parent) {
+                appendChild(parent, newNode);
+            }
             if (!firstChild) {
                 firstChild = newNode; // First child under this parent
-            } else {
-                previousSibling->next = newNode; // Link as a sibling
-                newNode->previous = previousSibling; // Update previous pointer for the new node
             }
-            previousSibling = newNode; // Update the last sibling pointer
 
             // Debug output to track structure
-            printf("Loaded: %s (%s)\n", newNode->name,
+            note("Loaded: %s (%s)\n", nameOf(newNode),
                    (newNode->type == Folder ? "Folder" :
                    (newNode->type == File ? "File" : "Symlink")));
         }
@@ -413,10 +2108,18 @@ node* loadDirectoryFromFile(FILE* file, node* parent) {
 node* loadDirectory(const char* filename) {
     FILE* file = fopen(filename, "r");
     if (!file) {
-        printf("Error: Could not open file '%s' for loading.\n", filename);
+        reportError("Error: Could not open file '%s' for loading.\n", filename);
         return NULL;
     }
 
+    // Binary snapshots are recognised by their magic, anything else is text
+    char magic[sizeof(SNAPSHOT_MAGIC)];
+    if (fread(magic, 1, sizeof(magic), file) == sizeof(magic) && memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)) == 0) {
+        fclose(file);
+        return loadSnapshot(filename);
+    }
+    rewind(file);
+
     // node* root = malloc(sizeof(node));
     // root->type = Folder;
     // root->name = strdup("/");
@@ -429,15 +2132,14 @@ node* loadDirectory(const char* filename) {
 
     // Load the directory tree from the file
     node* loadedRoot = loadDirectoryFromFile(file, NULL);
-    loadedRoot->numberOfItems = countFiles(loadedRoot);
     fclose(file);
 
     // Ensure the loaded root has the correct parent-child structure
     if (loadedRoot) {
-        printf("Directory structure loaded from '%s'.\n", filename);
+        note("Directory structure loaded from '%s'.\n", filename);
         return loadedRoot;
     } else {
-        printf("Error: Failed to load directory structure from '%s'.\n", filename);
+        reportError("Error: Failed to load directory structure from '%s'.\n", filename);
         return NULL;
     }
 }
@@ -538,26 +2240,34 @@ node* loadDirectory(const char* filename) {
 // }
 
 // Week 3: Rename Node
+// Free the old name and assign the new name, re-keying the parent's index
+// and moving the node to its new place in a sorted folder
+static void relabelNode(node* item, const char* name) {
+    if (journaling()) journalPush(JournalRenamed, item)->saved = strdup(nameOf(item));
+    node* parentFolder = parentOf(item);
+    if (parentFolder) indexRemove(parentFolder, item);
+    int sorted = orderTake(item);
+    setNodeName(item, name);
+    if (sorted) orderLink(parentFolder, item);
+    if (parentFolder) indexInsert(parentFolder, item);
+}
+
 void renameNode(node* currentNode, const char* newName) {
     if (!currentNode) {
-        printf("Error: Node does not exist.\n");
+        reportError("Error: Node does not exist.\n");
         return;
     }
 
     // Check for conflicting names in the same directory
-    node* sibling = currentNode->parent ? currentNode->parent->child : NULL;
-    while (sibling) {
-        if (sibling != currentNode && strcmp(sibling->name, newName) == 0) {
-            printf("Error: A node with the name '%s' already exists in the current directory.\n", newName);
-            return;
-        }
-        sibling = sibling->next;
+    node* parentFolder = parentOf(currentNode);
+    node* sibling = parentFolder ? indexLookup(parentFolder, newName) : NULL;
+    if (sibling && sibling != currentNode) {
+        reportError("Error: A node with the name '%s' already exists in the current directory.\n", newName);
+        return;
     }
 
-    // Free the old name and assign the new name
-    free(currentNode->name);
-    currentNode->name = strdup(newName);
-    printf("Renamed to '%s'\n", currentNode->name);
+    relabelNode(currentNode, newName);
+    note("Renamed to '%s'\n", nameOf(currentNode));
 }
 
 
@@ -566,721 +2276,4538 @@ void displayFullPath(node* currentNode) {
     if (!currentNode) return;
 
     if (currentNode->parent) {
-        displayFullPath(currentNode->parent);
+        displayFullPath(parentOf(currentNode));
     }
-    printf("/%s", currentNode->name);
+    printf("/%s", nameOf(currentNode));
 }
 
-node* getNode(node *currentFolder, char* name, enum nodeType type) {
+// Marks a slot whose entry was removed, so probe chains stay intact.
+// Empty slots hold NO_NODE.
+#define INDEX_TOMBSTONE UINT32_MAX
 
-    if (currentFolder->child != NULL) {
+// FNV-1a hash of a node name
+unsigned int hashName(const char* name) {
+    unsigned int hash = 2166136261u;
+    while (*name) {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
 
-        node *currentNode = currentFolder->child;
+// Short names are copied into the node; longer ones go to the arena and
+// the node keeps a pointer to them. Any previous long name is discarded.
+void setNodeName(node* item, const char* name) {
+    if (item->flags & NODE_LONG_NAME) {
+        poolDiscardString(activePool, nameOf(item));
+        item->flags &= ~NODE_LONG_NAME;
+    }
 
-        while (currentNode->next != NULL) {
+    size_t length = strlen(name);
+    if (length < NODE_INLINE_NAME) {
+        memcpy(item->name, name, length + 1);
+    } else {
+        char* longName = poolString(activePool, name);
+        memcpy(item->name, &longName, sizeof(char*));
+        item->flags |= NODE_LONG_NAME;
+    }
+    item->hash = hashName(name);
+    trigramNoteName(item);
+}
 
-            if (strcmp(name, currentNode->name) == 0 && currentNode->type == type) {
-                return currentNode;
+// Returns the slot holding 'name', or NULL if the table does not contain it
+static nodeId* indexTableFind(indexTable* table, const char* name, unsigned int hash) {
+    if (table->capacity == 0) return NULL;
+
+    // Probes are bounded: a draining table may have no empty slot left
+    size_t mask = table->capacity - 1;
+    size_t i = hash & mask;
+    for (size_t probes = 0; probes < table->capacity; probes++, i = (i + 1) & mask) {
+        nodeId entry = table->slots[i];
+        if (entry == NO_NODE) return NULL;
+        if (entry != INDEX_TOMBSTONE) {
+            node* candidate = nodeAt(entry);
+            if (candidate->hash == hash && strcmp(nameOf(candidate), name) == 0) {
+                return &table->slots[i];
             }
-            currentNode = currentNode->next;
         }
-
-        if (strcmp(name, currentNode->name) == 0 && currentNode->type == type) {
-            return currentNode;
-        } else return NULL;
-
-    } else return NULL;
+    }
+    return NULL;
 }
 
-node* getNodeTypeless(node *currentFolder, char* name) {
-
-    if (currentFolder->child != NULL) {
+// Returns the slot holding exactly 'child', or NULL
+static nodeId* indexTableFindNode(indexTable* table, node* child) {
+    if (table->capacity == 0) return NULL;
+
+    nodeId id = idOf(child);
+    size_t mask = table->capacity - 1;
+    size_t i = child->hash & mask;
+    for (size_t probes = 0; probes < table->capacity; probes++, i = (i + 1) & mask) {
+        nodeId entry = table->slots[i];
+        if (entry == NO_NODE) return NULL;
+        if (entry == id) return &table->slots[i];
+    }
+    return NULL;
+}
 
-        node *currentNode = currentFolder->child;
+static void indexTablePut(indexTable* table, nodeId id, unsigned int hash) {
+    size_t mask = table->capacity - 1;
+    size_t i = hash & mask;
+    while (table->slots[i] != NO_NODE && table->slots[i] != INDEX_TOMBSTONE) {
+        i = (i + 1) & mask;
+    }
+    if (table->slots[i] == INDEX_TOMBSTONE) table->tombstones--;
+    table->slots[i] = id;
+    table->live++;
+}
 
-        while (currentNode->next != NULL) {
+// Moves up to 'steps' slots of the draining table into the current one
+static void indexDrainStep(childIndex* index, size_t steps) {
+    indexTable* old = &index->draining;
+    if (old->slots == NULL) return;
 
-            if (strcmp(name, currentNode->name) == 0) {
-                return currentNode;
-            }
-            currentNode = currentNode->next;
+    while (steps-- > 0 && index->drainCursor < old->capacity) {
+        nodeId entry = old->slots[index->drainCursor];
+        if (entry != NO_NODE && entry != INDEX_TOMBSTONE) {
+            indexTablePut(&index->current, entry, nodeAt(entry)->hash);
+            old->live--;
         }
+        // Leave a tombstone so lookups in the old table keep probing past it
+        old->slots[index->drainCursor++] = INDEX_TOMBSTONE;
+    }
 
-        if (strcmp(name, currentNode->name) == 0) {
-            return currentNode;
-        } else return NULL;
+    if (index->drainCursor == old->capacity) {
+        poolRelease(activePool, old->slots, old->capacity * sizeof(nodeId));
+        memset(old, 0, sizeof(*old));
+        index->drainCursor = 0;
+    }
+}
 
-    } else return NULL;
+// Starts a new table when the current one passes its load limit. The old
+// entries are migrated incrementally so no single insert pays for a rehash.
+static void indexGrowIfNeeded(childIndex* index) {
+    indexTable* table = &index->current;
+    if ((table->live + table->tombstones + 1) * 100 < table->capacity * CHILD_INDEX_MAX_LOAD) return;
+
+    // Only one migration at a time
+    indexDrainStep(index, SIZE_MAX);
+
+    // Double unless the table is mostly tombstones, then rebuild at the same size
+    size_t capacity = table->capacity ? table->capacity : CHILD_INDEX_INITIAL_CAPACITY;
+    if ((table->live + 1) * 200 >= capacity * CHILD_INDEX_MAX_LOAD) capacity *= 2;
+
+    index->draining = *table;
+    index->drainCursor = 0;
+    table->slots = poolAlloc(activePool, capacity * sizeof(nodeId));
+    table->capacity = capacity;
+    table->live = 0;
+    table->tombstones = 0;
 }
 
-void make_dir(node* currentFolder, char* command) {
-    if (strtok(command, " ") != NULL) {
-        char* folderName = strtok(NULL, " ");
-        if (folderName != NULL) {
-            // Check if the folder already exists in the virtual tree
-            if (getNodeTypeless(currentFolder, folderName) == NULL) {
-                // Create the folder in the virtual file system
-                currentFolder->numberOfItems++;
-                node* newFolder = (node*)malloc(sizeof(node));
-                if (currentFolder->child == NULL) {
-                    currentFolder->child = newFolder;
-                    newFolder->previous = NULL;
-                } else {
-                    node* currentNode = currentFolder->child;
-                    while (currentNode->next != NULL) {
-                        currentNode = currentNode->next;
-                    }
-                    currentNode->next = newFolder;
-                    newFolder->previous = currentNode;
-                }
+void indexInsert(node* folder, node* child) {
+    folderRecord* record = folderOf(folder);
+    if (record->index == NULL) {
+        record->index = poolAlloc(activePool, sizeof(childIndex));
+    }
+    childIndex* index = record->index;
 
-                char* newFolderName = strdup(folderName);
-                newFolder->name = newFolderName;
-                newFolder->type = Folder;
-                newFolder->numberOfItems = 0;
-                newFolder->size = 0;
-                newFolder->date = time(NULL);
-                newFolder->content = NULL;
-                newFolder->parent = currentFolder;
-                newFolder->next = NULL;
-                newFolder->child = NULL;
-
-                printf("Folder '%s' added to the virtual filesystem.\n", newFolder->name);
-
-                // Get the real path and create the folder in the real file system
-                char realPath[1024];
-                getRealPath(currentFolder, realPath);
-                char fullPath[1024];
-                snprintf(fullPath, sizeof(fullPath), "%s/%s", realPath, folderName);
-
-                if (mkdir(fullPath, 0755) == 0) {
-                    printf("Folder '%s' created in the real filesystem.\n", fullPath);
-                } else {
-                    perror("Error creating folder in the real filesystem");
-                }
-            } else {
-                fprintf(stderr, "'%s' already exists in the current directory!\n", folderName);
-            }
+    indexDrainStep(index, CHILD_INDEX_DRAIN_STEP);
+    indexGrowIfNeeded(index);
+    indexTablePut(&index->current, idOf(child), child->hash);
+}
+
+void indexRemove(node* folder, node* child) {
+    invalidatePathCache(); // Paths through this child may now resolve differently
+    folderRecord* record = folderOf(folder);
+    if (record == NULL || record->index == NULL) return;
+    childIndex* index = record->index;
+
+    indexTable* tables[2] = {&index->current, &index->draining};
+    for (int i = 0; i < 2; i++) {
+        nodeId* slot = indexTableFindNode(tables[i], child);
+        if (slot) {
+            *slot = INDEX_TOMBSTONE;
+            tables[i]->live--;
+            tables[i]->tombstones++;
+            break;
         }
     }
+    indexDrainStep(index, CHILD_INDEX_DRAIN_STEP);
 }
 
-void touch(node* currentFolder, char* command, char* currentPath) {
-    if (strtok(command, " ") != NULL) {
-        char* fileName = strtok(NULL, " ");
-        if (fileName != NULL) {
-            if (getNodeTypeless(currentFolder, fileName) == NULL) {
-                currentFolder->numberOfItems++;
-                node* newFile = malloc(sizeof(node));
-                // ... (Virtual tree addition remains unchanged)
-
-                // Construct the real path
-                char realPath[MAX_PATH_LENGTH];
-                getRealPath(currentFolder, realPath);
-                char fullPath[MAX_PATH_LENGTH];
-                int n = snprintf(fullPath, sizeof(fullPath), "%s/%s", realPath, fileName);
-
-                // Check for truncation
-                if (n < 0 || n >= (int)sizeof(fullPath)) {
-                    fprintf(stderr, "Error: Path too long for file '%s'.\n", fileName);
-                    return;
-                }
+node* indexLookup(node* folder, const char* name) {
+    if (folder->flags & NODE_STUB) hydrateFolder(folder);
+    folderRecord* record = folderOf(folder);
+    if (record == NULL || record->index == NULL) return NULL;
+    childIndex* index = record->index;
 
-                FILE* file = fopen(fullPath, "w");
-                if (file) {
-                    fclose(file);
-                    printf("File '%s' created in the real filesystem.\n", fullPath);
-                } else {
-                    printf("Error: Could not create file '%s'.\n", fullPath);
-                }
-            } else {
-                fprintf(stderr, "'%s' already exists in the current directory!\n", fileName);
-            }
-        }
-    }
+    unsigned int hash = hashName(name);
+    nodeId* slot = indexTableFind(&index->current, name, hash);
+    if (slot == NULL) slot = indexTableFind(&index->draining, name, hash);
+    return slot ? nodeAt(*slot) : NULL;
 }
 
-void ls(node *currentFolder) {
-    if (currentFolder->child == NULL) {
-        printf("___Empty____\n");
-        return;
-    }
+void indexFree(node* folder) {
+    folderRecord* record = folderOf(folder);
+    if (record == NULL || record->index == NULL) return;
+    childIndex* index = record->index;
+    poolRelease(activePool, index->current.slots, index->current.capacity * sizeof(nodeId));
+    poolRelease(activePool, index->draining.slots, index->draining.capacity * sizeof(nodeId));
+    poolRelease(activePool, index, sizeof(childIndex));
+    record->index = NULL;
+}
 
-    node *currentNode = currentFolder->child;
+node* getNode(node *currentFolder, char* name, enum nodeType type) {
+    node* found = indexLookup(currentFolder, name);
+    return (found && found->type == type) ? found : NULL;
+}
 
-    while (currentNode != NULL) {
-        struct tm *date_time = localtime(&currentNode->date);
-        char dateString[26];
-        strftime(dateString, 26, "%d %b %H:%M", date_time);
+node* getNodeTypeless(node *currentFolder, char* name) {
+    return indexLookup(currentFolder, name);
+}
 
-        if (currentNode->type == Folder) {
-            printf("%s%d items\t%s\t%s/%s\n", CYAN, currentNode->numberOfItems, dateString, currentNode->name, RESET);
-        } else if (currentNode->type == File) {
-            printf("%s%dB\t%s\t%s%s\n", YELLOW, (int)currentNode->size, dateString, currentNode->name, RESET);
-        } else if (currentNode->type == Symlink) {
-            printf("%s\t%s\t%s%s\n", BLUE, dateString, currentNode->name, RESET);
-        }
+// Real filesystem mirroring. Commands update the tree, queue the matching
+// change and return; one writer thread applies the queue in order. A batch
+// goes to io_uring as a single hard-linked chain, which runs in order and
+// keeps going past a failed link. When the kernel lacks the ring or its
+// opcodes the writer makes the same calls itself. A write or removal of a
+// file that still has a write waiting replaces that write. Failures are
+// kept until the next command reports them.
+//
+// Changes are made relative to the real directory of the folder they
+// happen in (mkdirat, openat, unlinkat), so nothing builds path strings and
+// the kernel walks a single component. Each mirrored folder has a handle
+// for its directory, created on first use and bound to that directory from
+// then on. Folders and queued changes hold references to handles. The
+// descriptors belong to the writer: it keeps at most MIRROR_FD_LIMIT open,
+// closes the least recently used, and reopens closed ones through their
+// parent.
+typedef struct dirHandle {
+    struct dirHandle* parent; // NULL for the working directory
+    char* name;
+    int references;
+    int fd;   // -1 while closed
+    int pins; // Ring requests in flight that use fd
+    struct dirHandle* older; // LRU of open descriptors
+    struct dirHandle* newer;
+    struct dirHandle* nextDead;
+} dirHandle;
+
+typedef struct mirrorOp {
+    enum mirrorKind kind;
+    dirHandle* dir;
+    char* name;
+    char* data;
+    size_t length;
+    uint64_t offset;   // Where a patch goes in the file
+    unsigned int slot; // Coalescing index slot
+    int mayBeMissing;  // A removal that replaced a write of a file that may never have existed
+    int result;        // 0 or -errno once applied
+    struct mirrorOp* next;
+} mirrorOp;
+
+typedef struct mirrorRing {
+    int fd;
+    unsigned int entries;
+    unsigned int* sqHead;
+    unsigned int* sqTail;
+    unsigned int* sqMask;
+    unsigned int* cqHead;
+    unsigned int* cqTail;
+    unsigned int* cqMask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* rings;
+    size_t ringsSize;
+    size_t sqesSize;
+} mirrorRing;
+
+typedef struct mirrorQueue {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    pthread_t writer;
+    int started;
+    int stopping;
+    int useRing;
+    mirrorRing ring;
+    mirrorOp* head;  // Waiting for the writer
+    mirrorOp* tail;
+    size_t queued;
+    size_t outstanding;  // Queued or being applied
+    mirrorOp* failures;  // Applied and failed, not reported yet
+    mirrorOp* lastFailure;
+    mirrorOp* latest[MIRROR_INDEX_SLOTS]; // Newest waiting change per path
+    dirHandle* deadHandles; // Released by the shell, freed by the writer
+    dirHandle* newest;      // Open descriptors, writer only
+    dirHandle* oldest;
+    size_t openDirs;
+    dirHandle** chain; // Scratch for reopening, writer only
+    size_t chainCapacity;
+    uint64_t submitted;
+    uint64_t coalesced;
+    uint64_t failed;
+} mirrorQueue;
+
+static mirrorQueue mirror = {.lock = PTHREAD_MUTEX_INITIALIZER, .changed = PTHREAD_COND_INITIALIZER};
+static dirHandle workingDirectory = {.name = ".", .references = 1, .fd = AT_FDCWD};
+
+static void lruUnlink(dirHandle* handle) {
+    if (handle->newer) handle->newer->older = handle->older;
+    else mirror.newest = handle->older;
+    if (handle->older) handle->older->newer = handle->newer;
+    else mirror.oldest = handle->newer;
+    handle->older = handle->newer = NULL;
+    mirror.openDirs--;
+}
 
-        currentNode = currentNode->next;
-    }
+static void lruPush(dirHandle* handle) {
+    handle->older = mirror.newest;
+    handle->newer = NULL;
+    if (mirror.newest) mirror.newest->newer = handle;
+    else mirror.oldest = handle;
+    mirror.newest = handle;
+    mirror.openDirs++;
 }
 
+// Closes the least recently used descriptors over the limit, except the
+// ones requests in flight still use
+static void lruTrim() {
+    dirHandle* handle = mirror.oldest;
+    while (mirror.openDirs > MIRROR_FD_LIMIT && handle) {
+        dirHandle* newer = handle->newer;
+        if (handle->pins == 0) {
+            close(handle->fd);
+            handle->fd = -1;
+            lruUnlink(handle);
+        }
+        handle = newer;
+    }
+}
 
-void lsrecursive(node *currentFolder, int indentCount) {
-    if (currentFolder->child == NULL) {
-        for (int i = 0; i < indentCount; ++i) {
-            printf("\t");
+// Drops a reference; the last one frees the handle and releases its
+// parent. While the writer runs it owns the descriptors, so the shell
+// hands dead handles over instead of freeing them.
+static void releaseHandle(dirHandle* handle, int onWriter) {
+    while (handle && __atomic_sub_fetch(&handle->references, 1, __ATOMIC_ACQ_REL) == 0) {
+        if (!onWriter && mirror.started) {
+            pthread_mutex_lock(&mirror.lock);
+            handle->nextDead = mirror.deadHandles;
+            mirror.deadHandles = handle;
+            pthread_mutex_unlock(&mirror.lock);
+            return;
         }
-        if (indentCount != 0) {
-            printf("└─");
+        dirHandle* parent = handle->parent;
+        if (handle->fd >= 0) {
+            close(handle->fd);
+            lruUnlink(handle);
         }
-        printf("___Empty____\n");
-    } else {
-        const char* YELLOW = "\033[38;5;226m"; // Google Yellow for files
-        const char* CYAN = "\033[36m";         // Cyan for folders
-        const char* BLUE = "\033[38;5;33m";    // Google Blue for symlinks
-        const char* RESET = "\033[0m";         // Reset color
-
-        node *currentNode = currentFolder->child;
+        free(handle->name);
+        free(handle);
+        handle = parent;
+    }
+}
 
-        while (currentNode != NULL) {
-            for (int i = 0; i < indentCount; ++i) {
-                printf("\t");
-            }
-            if (indentCount != 0) {
-                printf("└─");
-            }
+static void freeDeadHandles() {
+    pthread_mutex_lock(&mirror.lock);
+    dirHandle* dead = mirror.deadHandles;
+    mirror.deadHandles = NULL;
+    pthread_mutex_unlock(&mirror.lock);
+
+    while (dead) {
+        dirHandle* next = dead->nextDead;
+        dead->references = 1;
+        releaseHandle(dead, 1);
+        dead = next;
+    }
+}
 
-            struct tm *date_time = localtime(&currentNode->date);
-            char dateString[26];
-            strftime(dateString, 26, "%d %b %H:%M", date_time);
-
-            if (currentNode->type == Folder) {
-                // Print folder with cyan color
-                printf("%s%d items\t%s\t%s%s\n", CYAN, currentNode->numberOfItems, dateString, currentNode->name, RESET);
-            } else if (currentNode->type == File) {
-                // Print file with yellow color
-                printf("%s%dB\t%s\t%s%s\n", YELLOW, (int)currentNode->size, dateString, currentNode->name, RESET);
-            } else if (currentNode->type == Symlink) {
-                // Print symlink with blue color
-                printf("%s\t%s\t%s%s\n", BLUE, dateString, currentNode->name, RESET);
-            }
+// Handle for the real directory behind 'folder', made on first use along
+// with any missing ones above it. Shell thread only.
+static dirHandle* folderHandle(node* folder) {
+    size_t missing = 0;
+    node* cursor = folder;
+    while (parentOf(cursor) && !folderOf(cursor)->handle) {
+        missing++;
+        cursor = parentOf(cursor);
+    }
+    dirHandle* handle = parentOf(cursor) ? folderOf(cursor)->handle : &workingDirectory;
+    if (missing == 0) return handle;
+
+    node** chain = malloc(missing * sizeof(node*));
+    size_t i = missing;
+    for (node* item = folder; i > 0; item = parentOf(item)) chain[--i] = item;
+    for (i = 0; i < missing; i++) {
+        dirHandle* child = calloc(1, sizeof(dirHandle));
+        child->parent = handle;
+        __atomic_add_fetch(&handle->references, 1, __ATOMIC_RELAXED);
+        child->name = strdup(nameOf(chain[i]));
+        child->references = 1; // Held by the folder
+        child->fd = -1;
+        folderOf(chain[i])->handle = child;
+        activePool->dirHandles++;
+        handle = child;
+    }
+    free(chain);
+    return handle;
+}
 
-            // Recursively call lsrecursive for child folders
-            if (currentNode->type == Folder) {
-                lsrecursive(currentNode, indentCount + 1);
-            }
+void detachDirHandle(node* folder) {
+    folderRecord* record = folderOf(folder);
+    if (!record->handle) return;
+    releaseHandle(record->handle, 0);
+    record->handle = NULL;
+    activePool->dirHandles--;
+}
 
-            currentNode = currentNode->next;
+void releaseDirHandles(treePool* pool) {
+    for (uint32_t row = 1; pool->dirHandles > 0 && row < pool->folders.used; row++) {
+        folderRecord* record = recordAt(&pool->folders, row);
+        if (record->handle) {
+            releaseHandle(record->handle, 0);
+            record->handle = NULL;
+            pool->dirHandles--;
         }
     }
 }
 
-void edit(node* currentFolder, char* command) {
-    if (strtok(command, " ") != NULL) {
-        char* fileName = strtok(NULL, " ");
-        if (fileName != NULL) {
-            node* editingNode = getNode(currentFolder, fileName, File);
-            if (editingNode) {
-                printf("Enter new content for '%s':\n", fileName);
-                char* content = getString();
+// Ties 'folder' to an existing real directory given by absolute path,
+// such as the one it was imported from
+void bindRealDirectory(node* folder, const char* path) {
+    detachDirHandle(folder);
+    dirHandle* handle = calloc(1, sizeof(dirHandle));
+    handle->parent = &workingDirectory;
+    __atomic_add_fetch(&workingDirectory.references, 1, __ATOMIC_RELAXED);
+    handle->name = strdup(path);
+    handle->references = 1;
+    handle->fd = -1;
+    folderOf(folder)->handle = handle;
+    activePool->dirHandles++;
+}
 
-                // Update memory
-                if (editingNode->content) {
-                    free(editingNode->content);
-                }
-                editingNode->content = strdup(content);
-                editingNode->size = strlen(content);
-                editingNode->date = time(NULL);
-
-                // Write to the real file
-                char path[1024];
-                snprintf(path, sizeof(path), "%s/%s", currentFolder->name, fileName);
-                FILE* file = fopen(path, "w");
-                if (file) {
-                    fprintf(file, "%s", content);
-                    fclose(file);
-                    printf("Content written to file '%s' in the real filesystem.\n", path);
-                } else {
-                    printf("Error: Could not write to file '%s'.\n", path);
-                }
+// Path of 'name' inside a handle's directory, relative to the working
+// directory unless a bound directory makes it absolute. The caller frees it.
+static char* handlePath(dirHandle* dir, const char* name) {
+    size_t length = strlen(name) + 1;
+    for (dirHandle* handle = dir; handle; handle = handle->name[0] == '/' ? NULL : handle->parent) {
+        length += strlen(handle->name) + 1;
+    }
 
-                free(content);
-            } else {
-                printf("File '%s' not found.\n", fileName);
+    char* path = malloc(length);
+    char* cursor = path + length - 1;
+    *cursor = '\0';
+    const char* component = name;
+    for (;;) {
+        size_t size = strlen(component);
+        cursor -= size;
+        memcpy(cursor, component, size);
+        if (!dir) break;
+        *--cursor = '/';
+        component = dir->name;
+        dir = component[0] == '/' ? NULL : dir->parent;
+    }
+    return path;
+}
+
+char* realPathOf(node* folder, const char* name) {
+    return handlePath(folderHandle(folder), name);
+}
+
+char* realDirectoryOf(node* folder) {
+    dirHandle* handle = folderHandle(folder);
+    if (handle->name[0] == '/' || !handle->parent) return strdup(handle->name);
+    return handlePath(handle->parent, handle->name);
+}
+
+// Descriptor of a handle's directory in '*fd', reopening it and any
+// closed ancestors through their parents. Writer only. Returns 0 or -errno.
+static int handleDescriptor(dirHandle* handle, int* fd) {
+    if (handle->fd == -1) {
+        size_t closed = 0;
+        for (dirHandle* cursor = handle; cursor->fd == -1; cursor = cursor->parent) {
+            if (closed == mirror.chainCapacity) {
+                mirror.chainCapacity = mirror.chainCapacity ? 2 * mirror.chainCapacity : 16;
+                mirror.chain = realloc(mirror.chain, mirror.chainCapacity * sizeof(dirHandle*));
+            }
+            mirror.chain[closed++] = cursor;
+        }
+        while (closed > 0) {
+            dirHandle* opening = mirror.chain[--closed];
+            int opened = openat(opening->parent->fd, opening->name, O_PATH | O_DIRECTORY | O_CLOEXEC);
+            if (opened < 0) {
+                int error = errno;
+                lruTrim();
+                return -error;
             }
+            opening->fd = opened;
+            lruPush(opening);
         }
+        lruTrim();
+    } else if (handle != &workingDirectory) {
+        lruUnlink(handle);
+        lruPush(handle);
     }
+    *fd = handle->fd;
+    return 0;
 }
 
-void clear() {
-    #ifdef _WIN32
-        system("cls"); // Windows-specific command to clear the screen
-    #else
-        system("clear"); // Unix/Linux/Mac command to clear the screen
-    #endif
+static void ringTeardown(mirrorRing* ring) {
+    if (ring->sqes) munmap(ring->sqes, ring->sqesSize);
+    if (ring->rings) munmap(ring->rings, ring->ringsSize);
+    close(ring->fd);
+    memset(ring, 0, sizeof(*ring));
 }
 
+static int ringSupports(const struct io_uring_probe* probe, int opcode) {
+    return opcode <= probe->last_op && (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED);
+}
 
-void pwd(char *path) {
-    if (path && strlen(path) > 0) {
-        // Print the path directly without trimming the last character
-        printf("%s\n", path);
-    } else {
-        // Default to root if the path is not set or invalid
-        printf("/\n");
+// Sets up the ring, checks the opcodes the writer needs and registers the
+// one fixed file slot writes go through. Returns 0 on success.
+static int ringSetup(mirrorRing* ring) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = (int)syscall(__NR_io_uring_setup, MIRROR_RING_ENTRIES, &params);
+    if (ring->fd < 0) return -1;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        ringTeardown(ring);
+        return -1;
     }
-}
 
-node* cd(node *currentFolder, char *command, char **path, node *root) {
-    if (strtok(command, " ") != NULL) {
-        char* targetPath = strtok(NULL, " ");
-        if (targetPath != NULL) {
-            // Check if the path is absolute
-            if (targetPath[0] == '/') {
-                // Navigate to root explicitly for absolute paths
-                currentFolder = root;
-                *path = realloc(*path, sizeof(char) * 2);
-                strcpy(*path, "/");
-                targetPath++; // Skip the initial '/'
-            }
-
-            // Tokenize the path and navigate step-by-step
-            char* token = strtok(targetPath, "/");
-            while (token != NULL) {
-                if (strcmp(token, "..") == 0) {
-                    // Navigate to the parent directory
-                    if (currentFolder->parent != NULL) {
-                        currentFolder = currentFolder->parent;
-                        // Update the path
-                        char* lastSlash = strrchr(*path, '/');
-                        if (lastSlash && lastSlash != *path) {
-                            *lastSlash = '\0';
-                        } else {
-                            strcpy(*path, "/");
-                        }
-                    } else {
-                        printf("Already at the root directory.\n");
-                    }
-                } else if (strcmp(token, ".") == 0) {
-                    // Stay in the current directory (no-op)
-                } else {
-                    // Navigate to a child directory
-                    node* destinationFolder = getNode(currentFolder, token, Folder);
-                    if (destinationFolder != NULL) {
-                        currentFolder = destinationFolder;
-
-                        // Update the path
-                        size_t newPathLength = strlen(*path) + strlen(destinationFolder->name) + 2;
-                        *path = realloc(*path, sizeof(char) * newPathLength);
-                        if (strcmp(*path, "/") == 0) {
-                            strcat(*path, token);
-                        } else {
-                            strcat(strcat(*path, "/"), token);
-                        }
-                    } else {
-                        fprintf(stderr, "There is no '%s' folder in the current directory!\n", token);
-                        return currentFolder;
-                    }
-                }
+    size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ringsSize = sqSize > cqSize ? sqSize : cqSize;
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->rings = mmap(NULL, ring->ringsSize, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, IORING_OFF_SQ_RING);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, IORING_OFF_SQES);
+    if (ring->rings == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        if (ring->rings == MAP_FAILED) ring->rings = NULL;
+        if (ring->sqes == MAP_FAILED) ring->sqes = NULL;
+        ringTeardown(ring);
+        return -1;
+    }
 
-                token = strtok(NULL, "/");
-            }
-        } else {
-            printf("Error: No path provided.\n");
-        }
+    char* base = ring->rings;
+    ring->entries = params.sq_entries;
+    ring->sqHead = (unsigned int*)(base + params.sq_off.head);
+    ring->sqTail = (unsigned int*)(base + params.sq_off.tail);
+    ring->sqMask = (unsigned int*)(base + params.sq_off.ring_mask);
+    ring->cqHead = (unsigned int*)(base + params.cq_off.head);
+    ring->cqTail = (unsigned int*)(base + params.cq_off.tail);
+    ring->cqMask = (unsigned int*)(base + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(base + params.cq_off.cqes);
+    unsigned int* array = (unsigned int*)(base + params.sq_off.array);
+    for (unsigned int i = 0; i < params.sq_entries; i++) array[i] = i;
+
+    size_t probeSize = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = calloc(1, probeSize);
+    int supported = probe && syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+                    ringSupports(probe, IORING_OP_MKDIRAT) && ringSupports(probe, IORING_OP_UNLINKAT) &&
+                    ringSupports(probe, IORING_OP_OPENAT) && ringSupports(probe, IORING_OP_WRITE) &&
+                    ringSupports(probe, IORING_OP_CLOSE);
+    free(probe);
+
+    int sparse = -1;
+    if (!supported || syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES, &sparse, 1) != 0) {
+        ringTeardown(ring);
+        return -1;
     }
-    return currentFolder;
+    return 0;
 }
 
-node* cdup(node *currentFolder, char **path) {
-
-    size_t newPathLength = strlen(*path) - strlen(currentFolder->name);
+static struct io_uring_sqe* ringEntry(mirrorRing* ring, unsigned int position, mirrorOp* op, unsigned int step) {
+    struct io_uring_sqe* sqe = &ring->sqes[position & *ring->sqMask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->flags = IOSQE_IO_HARDLINK;
+    sqe->user_data = (uintptr_t)op | step; // Ops are malloc-aligned, so the low bits are free
+    return sqe;
+}
 
-    while (currentFolder->previous != NULL) {
-        currentFolder = currentFolder->previous;
+// Fills the entries for one change starting at 'position'. Returns how many.
+static unsigned int ringPrepare(mirrorRing* ring, unsigned int position, mirrorOp* op, int dir) {
+    struct io_uring_sqe* sqe = ringEntry(ring, position, op, 0);
+    sqe->fd = dir;
+    sqe->addr = (uintptr_t)op->name;
+    switch (op->kind) {
+    case MirrorMkdir:
+        sqe->opcode = IORING_OP_MKDIRAT;
+        sqe->len = 0755;
+        return 1;
+    case MirrorRemoveDir:
+        sqe->opcode = IORING_OP_UNLINKAT;
+        sqe->unlink_flags = AT_REMOVEDIR;
+        return 1;
+    case MirrorRemoveFile:
+        sqe->opcode = IORING_OP_UNLINKAT;
+        return 1;
+    case MirrorWrite:
+    case MirrorPatch:
+        break;
     }
-    if (currentFolder->parent != NULL ) {
-
-        *path = (char *) realloc(*path, sizeof(char)* newPathLength);
-        (*path)[newPathLength-1] = '\0';
 
-        currentFolder = currentFolder->parent;
-        return currentFolder;
-    } else {
-        return currentFolder;
+    // Open into fixed slot 0, write through it and close it again. A patch
+    // keeps the rest of the file and writes only its own range.
+    unsigned int count = 1;
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->open_flags = O_WRONLY | O_CREAT | (op->kind == MirrorWrite ? O_TRUNC : 0); // Direct descriptors refuse O_CLOEXEC
+    sqe->len = 0644;
+    sqe->file_index = 1; // Slot + 1
+    if (op->length > 0) {
+        sqe = ringEntry(ring, position + count++, op, 1);
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->flags |= IOSQE_FIXED_FILE;
+        sqe->addr = (uintptr_t)op->data;
+        sqe->len = op->length;
+        sqe->off = op->offset;
     }
+    sqe = ringEntry(ring, position + count++, op, 2);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = 1;
+    return count;
 }
 
-void freeNode(node *freeingNode) {
+// Runs a batch through the ring, a chain of at most 'entries' requests at
+// a time. Returns the first change not applied if the ring stops working.
+static mirrorOp* ringApply(mirrorRing* ring, mirrorOp* batch) {
+    while (batch) {
+        unsigned int tail = *ring->sqTail;
+        unsigned int count = 0;
+        int changesFolders = 0;
+        mirrorOp* op = batch;
+        for (; op && count + 3 <= ring->entries; op = op->next) {
+            // A closed directory may be one this chain creates or removes,
+            // so it is only opened once the chain has run
+            if (op->dir->fd == -1 && changesFolders) break;
+            if (op->kind == MirrorMkdir || op->kind == MirrorRemoveDir) changesFolders = 1;
+
+            int dir;
+            op->dir->pins++;
+            op->result = handleDescriptor(op->dir, &dir);
+            if (op->result == 0) count += ringPrepare(ring, tail + count, op, dir);
+        }
+
+        unsigned int submitted = 0;
+        if (count > 0) {
+            ring->sqes[(tail + count - 1) & *ring->sqMask].flags &= ~IOSQE_IO_HARDLINK;
+            __atomic_store_n(ring->sqTail, tail + count, __ATOMIC_RELEASE);
+        }
+        while (submitted < count) {
+            long entered = syscall(__NR_io_uring_enter, ring->fd, count - submitted, 0, 0, NULL, 0);
+            if (entered < 0) {
+                if (errno == EINTR) continue;
+                if (submitted == 0) {
+                    __atomic_store_n(ring->sqTail, tail, __ATOMIC_RELEASE);
+                    for (mirrorOp* done = batch; done != op; done = done->next) done->dir->pins--;
+                    return batch;
+                }
+                count = submitted; // Never queued, never completes
+                break;
+            }
+            submitted += entered;
+        }
+
+        // A hard-linked chain completes in order, so the first error an
+        // op sees is the one that explains it
+        for (unsigned int reaped = 0; reaped < count;) {
+            unsigned int head = *ring->cqHead;
+            unsigned int ready = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+            if (head == ready) {
+                syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+                continue;
+            }
+            for (; head != ready; head++, reaped++) {
+                struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cqMask];
+                mirrorOp* done = (mirrorOp*)(uintptr_t)(cqe->user_data & ~(uint64_t)3);
+                int result = cqe->res;
+                if ((cqe->user_data & 3) == 1 && result >= 0 && (size_t)result != done->length) result = -EIO;
+                if (result < 0 && done->result == 0) done->result = result;
+            }
+            __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+        }
 
-    if (freeingNode->child != NULL) {
+        for (mirrorOp* done = batch; done != op; done = done->next) done->dir->pins--;
+        lruTrim();
+        batch = op;
+    }
+    return NULL;
+}
 
-        node* currentNode = freeingNode->child;
+static int mirrorApply(mirrorOp* op) {
+    int dir;
+    int result = handleDescriptor(op->dir, &dir);
+    if (result != 0) return result;
+
+    switch (op->kind) {
+    case MirrorMkdir:
+        return mkdirat(dir, op->name, 0755) == 0 ? 0 : -errno;
+    case MirrorRemoveDir:
+        return unlinkat(dir, op->name, AT_REMOVEDIR) == 0 ? 0 : -errno;
+    case MirrorRemoveFile:
+        return unlinkat(dir, op->name, 0) == 0 ? 0 : -errno;
+    case MirrorWrite:
+    case MirrorPatch:
+        break;
+    }
 
-        while (currentNode->next != NULL) {
-            node* nextNode = currentNode->next;
-            freeNode(currentNode);
-            currentNode = nextNode;
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (op->kind == MirrorWrite ? O_TRUNC : 0);
+    int fd = openat(dir, op->name, flags, 0644);
+    if (fd < 0) return -errno;
+    for (size_t written = 0; written < op->length;) {
+        ssize_t n = pwrite(fd, op->data + written, op->length - written, op->offset + written);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            result = -errno;
+            break;
         }
-        freeNode(currentNode);
+        written += n;
     }
-    free(freeingNode->name);
-    free(freeingNode->content);
-    free(freeingNode);
+    if (close(fd) != 0 && result == 0) result = -errno;
+    return result;
+}
 
+static void mirrorFree(mirrorOp* op, int onWriter) {
+    releaseHandle(op->dir, onWriter);
+    free(op->name);
+    free(op->data);
+    free(op);
 }
 
-void removeNode(node *removingNode) {
-    if (removingNode->parent != NULL){
-        if (removingNode->next != NULL) {
-            removingNode->next->parent = removingNode->parent;
-            removingNode->parent->child = removingNode->next;
-            removingNode->next->previous = NULL;
-        } else {
-            removingNode->parent->child = NULL;
+static void* mirrorWriter(void* argument) {
+    (void)argument;
+    pthread_mutex_lock(&mirror.lock);
+    for (;;) {
+        while (!mirror.head && !mirror.stopping) pthread_cond_wait(&mirror.changed, &mirror.lock);
+        if (!mirror.head) break;
+
+        // Take everything waiting; the index only covers waiting changes
+        mirrorOp* batch = mirror.head;
+        mirror.head = mirror.tail = NULL;
+        mirror.queued = 0;
+        for (mirrorOp* op = batch; op; op = op->next) mirror.latest[op->slot] = NULL;
+        pthread_cond_broadcast(&mirror.changed);
+        pthread_mutex_unlock(&mirror.lock);
+
+        freeDeadHandles();
+        mirrorOp* remaining = batch;
+        if (mirror.useRing && (remaining = ringApply(&mirror.ring, batch)) != NULL) {
+            ringTeardown(&mirror.ring);
+            mirror.useRing = 0;
         }
-    } else {
-        if (removingNode->next != NULL) {
-            removingNode->previous->next = removingNode->next;
-            removingNode->next->previous  = removingNode->previous;
-        } else {
-            removingNode->previous->next = NULL;
+        for (mirrorOp* op = remaining; op; op = op->next) op->result = mirrorApply(op);
+
+        pthread_mutex_lock(&mirror.lock);
+        while (batch) {
+            mirrorOp* op = batch;
+            batch = op->next;
+            mirror.outstanding--;
+            if (op->result == 0 || (op->result == -ENOENT && op->mayBeMissing)) {
+                mirrorFree(op, 1);
+                continue;
+            }
+            mirror.failed++;
+            op->next = NULL;
+            if (mirror.lastFailure) mirror.lastFailure->next = op;
+            else mirror.failures = op;
+            mirror.lastFailure = op;
         }
+        pthread_cond_broadcast(&mirror.changed);
     }
+    pthread_mutex_unlock(&mirror.lock);
+
+    // Hand the descriptors back closed; the shell owns handles from here
+    freeDeadHandles();
+    while (mirror.oldest) {
+        dirHandle* handle = mirror.oldest;
+        close(handle->fd);
+        handle->fd = -1;
+        lruUnlink(handle);
+    }
+    free(mirror.chain);
+    mirror.chain = NULL;
+    mirror.chainCapacity = 0;
+    return NULL;
 }
 
-void rm(node* currentFolder, char* command) {
-    if (strtok(command, " ") != NULL) {
-        char* nodeName = strtok(NULL, " ");
-        if (nodeName != NULL) {
-            node* removingNode = getNodeTypeless(currentFolder, nodeName);
-            if (removingNode) {
-                printf("Do you really want to remove '%s' and its content? (y/n)\n", nodeName);
-                char* answer = getString();
-                if (strcmp(answer, "y") == 0) {
-                    // Remove from memory
-                    currentFolder->numberOfItems--;
-                    removeNode(removingNode);
-                    freeNode(removingNode);
+// Slot holding the newest waiting change for 'name' in 'dir', or the empty
+// slot where it would go
+static unsigned int mirrorSlot(dirHandle* dir, const char* name) {
+    unsigned int slot = (hashName(name) ^ (unsigned int)((uintptr_t)dir >> 4) * 2654435761u) & (MIRROR_INDEX_SLOTS - 1);
+    while (mirror.latest[slot] && (mirror.latest[slot]->dir != dir || strcmp(mirror.latest[slot]->name, name) != 0)) {
+        slot = (slot + 1) & (MIRROR_INDEX_SLOTS - 1);
+    }
+    return slot;
+}
 
-                    // Remove from real filesystem
-                    char path[1024];
-                    snprintf(path, sizeof(path), "%s/%s", currentFolder->name, nodeName);
-                    if (removingNode->type == Folder) {
-                        if (rmdir(path) == 0) {
-                            printf("Folder '%s' removed from the real filesystem.\n", path);
-                        } else {
-                            perror("Error removing folder from the real filesystem");
-                        }
-                    } else if (removingNode->type == File) {
-                        if (remove(path) == 0) {
-                            printf("File '%s' removed from the real filesystem.\n", path);
-                        } else {
-                            perror("Error removing file from the real filesystem");
-                        }
-                    }
-                }
-                free(answer);
-            } else {
-                printf("Node '%s' not found.\n", nodeName);
+// Queues a change to 'name' inside 'dir'. 'data' (the new file contents
+// for a write, the bytes at 'offset' for a patch) is taken over by the queue.
+static void mirrorQueueChange(enum mirrorKind kind, dirHandle* dir, const char* name, char* data, size_t length,
+                              uint64_t offset) {
+    __atomic_add_fetch(&dir->references, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&mirror.lock);
+    if (!mirror.started) {
+        mirror.useRing = ringSetup(&mirror.ring) == 0;
+        mirror.started = pthread_create(&mirror.writer, NULL, mirrorWriter, NULL) == 0;
+        if (!mirror.started) {
+            // No writer: apply it here, it will still be reported later
+            pthread_mutex_unlock(&mirror.lock);
+            if (mirror.useRing) ringTeardown(&mirror.ring);
+            mirror.useRing = 0;
+            mirrorOp op = {kind, dir, (char*)name, data, length, offset, 0, 0, 0, NULL};
+            int result = mirrorApply(&op);
+            if (result != 0) {
+                char* path = handlePath(dir, name);
+                reportError("Error: Could not update '%s' in the real filesystem: %s\n", path, strerror(-result));
+                free(path);
             }
+            releaseHandle(dir, 0);
+            free(data);
+            return;
+        }
+    }
+    mirror.submitted++;
+
+    unsigned int slot = mirrorSlot(dir, name);
+    mirrorOp* waiting = mirror.latest[slot];
+    int replaces = kind == MirrorWrite || kind == MirrorRemoveFile;
+    if (waiting && (waiting->kind == MirrorWrite || waiting->kind == MirrorPatch) && replaces) {
+        // The earlier write would be overwritten or removed; nothing between
+        // the two can depend on a file's contents
+        free(waiting->data);
+        waiting->mayBeMissing = kind == MirrorRemoveFile;
+        waiting->kind = kind;
+        waiting->data = data;
+        waiting->length = length;
+        waiting->offset = 0;
+        mirror.coalesced++;
+        pthread_mutex_unlock(&mirror.lock);
+        releaseHandle(dir, 0);
+        return;
+    }
+    if (waiting && waiting->kind == MirrorWrite && kind == MirrorPatch) {
+        // A patch to a file whose whole content is still waiting goes into
+        // that content; the gap before a patch past the end reads as zeros
+        if (offset + length > waiting->length) {
+            waiting->data = realloc(waiting->data, offset + length);
+            if (offset > waiting->length) memset(waiting->data + waiting->length, 0, offset - waiting->length);
+            waiting->length = offset + length;
         }
+        memcpy(waiting->data + offset, data, length);
+        free(data);
+        mirror.coalesced++;
+        pthread_mutex_unlock(&mirror.lock);
+        releaseHandle(dir, 0);
+        return;
     }
+
+    while (mirror.queued >= MIRROR_QUEUE_LIMIT) {
+        pthread_cond_wait(&mirror.changed, &mirror.lock);
+        slot = mirrorSlot(dir, name);
+    }
+
+    mirrorOp* op = malloc(sizeof(mirrorOp));
+    op->kind = kind;
+    op->dir = dir;
+    op->name = strdup(name);
+    op->data = data;
+    op->length = length;
+    op->offset = offset;
+    op->slot = slot;
+    op->mayBeMissing = 0;
+    op->result = 0;
+    op->next = NULL;
+    if (mirror.tail) mirror.tail->next = op;
+    else mirror.head = op;
+    mirror.tail = op;
+    mirror.latest[slot] = op;
+    mirror.queued++;
+    mirror.outstanding++;
+    pthread_cond_broadcast(&mirror.changed);
+    pthread_mutex_unlock(&mirror.lock);
 }
 
+// While a snapshot exists, notes which real entry a change went to and
+// the node that was there, so a rollback can bring the entry back in step
+static void journalMirrored(enum mirrorKind kind, node* item, dirHandle* dir, const char* name) {
+    if (!item) return;
+    size_t length = strlen(name) + 1;
+    mirroredChange* change = malloc(sizeof(mirroredChange) + length);
+    change->dir = dir;
+    __atomic_add_fetch(&dir->references, 1, __ATOMIC_RELAXED);
+    memcpy(change->name, name, length);
+    journalEntry* entry = journalPush(JournalMirrored, item);
+    entry->value = kind;
+    entry->saved = change;
+}
 
-void moveNode(node *movingNode, node *destinationFolder) {
+void mirrorSubmit(enum mirrorKind kind, node* folder, const char* name, char* data, size_t length) {
+    dirHandle* dir = folderHandle(folder);
+    if (journaling()) journalMirrored(kind, indexLookup(folder, name), dir, name);
+    mirrorQueueChange(kind, dir, name, data, length, 0);
+}
 
-    if (destinationFolder->child == NULL) {
-        destinationFolder->child = movingNode;
-        movingNode->previous = NULL;
-        movingNode->parent = destinationFolder;
-        movingNode->next = NULL;
-    } else {
+// Writes 'data' over 'length' bytes at 'offset' of a real file, leaving the
+// rest of it alone
+void mirrorPatch(node* folder, const char* name, char* data, size_t length, uint64_t offset) {
+    dirHandle* dir = folderHandle(folder);
+    if (journaling()) journalMirrored(MirrorPatch, indexLookup(folder, name), dir, name);
+    mirrorQueueChange(MirrorPatch, dir, name, data, length, offset);
+}
 
-        node *currentNode = destinationFolder->child;
-        while (currentNode->next != NULL) {
-            currentNode = currentNode->next;
-        }
+// Removes the real directory a folder is bound to, wherever a rename or
+// move has taken the folder since
+void mirrorRemoveFolder(node* folder) {
+    dirHandle* handle = folderOf(folder)->handle;
+    if (!handle) {
+        mirrorSubmit(MirrorRemoveDir, parentOf(folder), nameOf(folder), NULL, 0);
+        return;
+    }
+    if (journaling()) journalMirrored(MirrorRemoveDir, folder, handle->parent, handle->name);
+    mirrorQueueChange(MirrorRemoveDir, handle->parent, handle->name, NULL, 0, 0);
+}
 
-        currentNode->next = movingNode;
-        movingNode->previous = currentNode;
-        movingNode->parent = NULL;
-        movingNode->next = NULL;
+// Waits until every queued change has been applied
+void mirrorWait() {
+    pthread_mutex_lock(&mirror.lock);
+    while (mirror.outstanding > 0) pthread_cond_wait(&mirror.changed, &mirror.lock);
+    pthread_mutex_unlock(&mirror.lock);
+}
+
+void reportMirrorErrors() {
+    static const char* actions[] = {"create folder", "write file", "remove folder", "remove file", "update file"};
+    if (!__atomic_load_n(&mirror.failures, __ATOMIC_ACQUIRE)) return;
+
+    pthread_mutex_lock(&mirror.lock);
+    mirrorOp* failures = mirror.failures;
+    mirror.failures = mirror.lastFailure = NULL;
+    pthread_mutex_unlock(&mirror.lock);
+
+    while (failures) {
+        mirrorOp* op = failures;
+        failures = op->next;
+        char* path = handlePath(op->dir, op->name);
+        reportError("Error: Could not %s '%s' in the real filesystem: %s\n", actions[op->kind], path, strerror(-op->result));
+        free(path);
+        mirrorFree(op, 0);
     }
-    destinationFolder->numberOfItems++;
 }
 
-void mov(node *currentFolder, char *command) {
+// Drains the queue, stops the writer and reports what failed
+void mirrorShutdown() {
+    if (mirror.started) {
+        pthread_mutex_lock(&mirror.lock);
+        mirror.stopping = 1;
+        pthread_cond_broadcast(&mirror.changed);
+        pthread_mutex_unlock(&mirror.lock);
+        pthread_join(mirror.writer, NULL);
+        mirror.started = 0;
+        mirror.stopping = 0;
+    }
+    if (mirror.useRing) ringTeardown(&mirror.ring);
+    mirror.useRing = 0;
+    reportMirrorErrors();
+}
 
-    char* nodeName;
-    char* destinationName;
+void printMirrorStats() {
+    pthread_mutex_lock(&mirror.lock);
+    printf("Mirror: %" PRIu64 " changes queued, %" PRIu64 " coalesced, %" PRIu64 " failed, %zu pending (%s)\n",
+           mirror.submitted, mirror.coalesced, mirror.failed, mirror.outstanding,
+           !mirror.started ? "idle" : mirror.useRing ? "io_uring" : "writer thread");
+    pthread_mutex_unlock(&mirror.lock);
+}
 
+void make_dir(node* currentFolder, char* command) {
     if (strtok(command, " ") != NULL) {
-        nodeName = strtok(NULL, " ");
-        if (nodeName != NULL) {
-            destinationName = strtok(NULL, " ");
-            if (destinationName != NULL) {
-                if (strtok(NULL, " ")) {
-                    return;
-                } else {
-
-                    node* movingNode = getNodeTypeless(currentFolder, nodeName);
-                    node* destinationFolder = getNode(currentFolder, destinationName, Folder);
+        char* folderName = strtok(NULL, " ");
+        if (folderName != NULL) {
+            // Check if the folder already exists in the virtual tree
+            if (getNodeTypeless(currentFolder, folderName) == NULL) {
+                // Create the folder in the virtual file system
+                node* newFolder = createNode(folderName, Folder);
+                appendChild(currentFolder, newFolder);
 
-                    if (destinationFolder != NULL && movingNode != NULL && destinationFolder != movingNode) {
+                note("Folder '%s' added to the virtual filesystem.\n", nameOf(newFolder));
 
-                        removeNode(movingNode);
-                        moveNode(movingNode, destinationFolder);
-                    } else {
-                        fprintf(stderr, "Something you made wrong!\n");
-                    }
-                }
+                // Create the folder in the real file system
+                mirrorSubmit(MirrorMkdir, currentFolder, folderName, NULL, 0);
+            } else {
+                reportError("'%s' already exists in the current directory!\n", folderName);
             }
         }
     }
 }
 
-// Helper functions for comparing and swapping nodes (used for sorting)
-int compareNodesByName(const void* a, const void* b) {
-    node* nodeA = *(node**)a;
-    node* nodeB = *(node**)b;
-    return strcmp(nodeA->name, nodeB->name);
+void touch(node* currentFolder, char* command) {
+    if (strtok(command, " ") != NULL) {
+        char* fileName = strtok(NULL, " ");
+        if (fileName != NULL) {
+            if (getNodeTypeless(currentFolder, fileName) == NULL) {
+                // Create the file in the virtual file system
+                node* newFile = createNode(fileName, File);
+                appendChild(currentFolder, newFile);
+                note("File '%s' added to the virtual filesystem.\n", nameOf(newFile));
+
+                // Create the file in the real file system
+                mirrorSubmit(MirrorWrite, currentFolder, fileName, NULL, 0);
+            } else {
+                reportError("'%s' already exists in the current directory!\n", fileName);
+            }
+        }
+    }
 }
 
-int compareNodesByDate(const void* a, const void* b) {
-    node* nodeA = *(node**)a;
-    node* nodeB = *(node**)b;
-    return difftime(nodeA->date, nodeB->date);
+// Listing output. Lines are formatted straight into one buffer that goes
+// out with a single write() whenever it fills, dates are formatted once
+// per distinct minute, and colors are left out unless stdout is a terminal.
+typedef struct dateCacheEntry {
+    int64_t minute;
+    int valid;
+    char text[16];
+    size_t length;
+} dateCacheEntry;
+
+static dateCacheEntry dateCache[DATE_CACHE_SLOTS];
+static byteSink listingSink;
+static int colorOutput = -1; // Unknown until the first listing
+
+static int flushToOutput(void* context, const char* data, size_t length) {
+    (void)context;
+    while (length > 0) {
+        ssize_t written = write(STDOUT_FILENO, data, length);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += written;
+        length -= (size_t)written;
+    }
+    return 0;
 }
 
-void sortDirectory(node* folder, const char* criterion) {
-    if (!folder || folder->child == NULL) return;
+static void listingBegin() {
+    fflush(stdout); // Keep order with what printf has buffered
+    listingSink.flush = flushToOutput;
+    listingSink.context = NULL;
+    listingSink.failed = 0;
+    listingSink.used = 0;
+}
 
-    // Count the number of child nodes
-    int count = 0;
-    node* current = folder->child;
-    while (current) {
-        count++;
-        current = current->next;
+static inline void listBytes(const char* text, size_t length) {
+    if (listingSink.used + length <= SINK_BUFFER_SIZE) {
+        memcpy(listingSink.buffer + listingSink.used, text, length);
+        listingSink.used += length;
+    } else {
+        sinkWrite(&listingSink, text, length);
     }
+}
 
-    // Populate an array of child nodes
-    node** nodesArray = malloc(count * sizeof(node*));
-    current = folder->child;
-    for (int i = 0; i < count; i++) {
-        nodesArray[i] = current;
-        current = current->next;
-    }
+static inline void listText(const char* text) {
+    listBytes(text, strlen(text));
+}
 
-    // Sort the array based on the criterion
-    if (strcmp(criterion, "name") == 0) {
-        qsort(nodesArray, count, sizeof(node*), compareNodesByName);
-    } else if (strcmp(criterion, "date") == 0) {
-        qsort(nodesArray, count, sizeof(node*), compareNodesByDate);
+static void listNumber(uint64_t value) {
+    char digits[20];
+    size_t count = 0;
+    do {
+        digits[sizeof(digits) - ++count] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value > 0);
+    listBytes(digits + sizeof(digits) - count, count);
+}
+
+static void listDate(time_t date) {
+    int64_t minute = date >= 0 ? date / 60 : (date - 59) / 60;
+    dateCacheEntry* entry = &dateCache[(uint64_t)minute & (DATE_CACHE_SLOTS - 1)];
+    if (!entry->valid || entry->minute != minute) {
+        struct tm dateTime;
+        localtime_r(&date, &dateTime);
+        entry->length = strftime(entry->text, sizeof(entry->text), "%d %b %H:%M", &dateTime);
+        entry->minute = minute;
+        entry->valid = 1;
     }
+    listBytes(entry->text, entry->length);
+}
 
-    // Re-link the sorted nodes back into the tree
-    folder->child = nodesArray[0];
-    folder->child->previous = NULL;
-    for (int i = 0; i < count - 1; i++) {
-        nodesArray[i]->next = nodesArray[i + 1];
-        nodesArray[i + 1]->previous = nodesArray[i];
+static void listIndent(size_t depth) {
+    static const char tabs[] = "\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t";
+    if (depth == 0) return;
+    for (size_t left = depth; left > 0;) {
+        size_t step = left < sizeof(tabs) - 1 ? left : sizeof(tabs) - 1;
+        listBytes(tabs, step);
+        left -= step;
     }
-    nodesArray[count - 1]->next = NULL;
+    listText("└─");
+}
 
-    free(nodesArray);
-    printf("Directory sorted by %s.\n", criterion);
+static void listColor(const char* color) {
+    if (colorOutput) listText(color);
 }
 
-// Function to merge two directories, resolving any conflicts interactively
-void mergeDirectories(node* destFolder, node* srcFolder) {
-    if (!destFolder || !srcFolder || srcFolder->type != Folder || destFolder->type != Folder) return;
+// One line of ls or lsrecursive; ls marks folders with a trailing slash
+static void listLine(node* item, size_t depth, int slash) {
+    listIndent(depth);
+    if (item->type == Folder) {
+        listColor(CYAN);
+        if (item->flags & NODE_STUB) listText("?");
+        else listNumber((uint64_t)numberOfItems(item));
+        listText(" items\t");
+    } else if (item->type == File) {
+        listColor(YELLOW);
+        listNumber(nodeSize(item));
+        listText("B\t");
+    } else {
+        listColor(BLUE);
+        listText("\t");
+    }
+    listDate(item->date);
+    listText("\t");
+    listText(nameOf(item));
+    if (slash && item->type == Folder) listText("/");
+    listColor(RESET);
+    listText("\n");
+}
 
-    node* current = srcFolder->child;
-    while (current) {
-        node* next = current->next;
-        int choice;
-        // Check for conflicts (same name)
-        node* existing = getNodeTypeless(destFolder, current->name);
-        if (existing) {
-            printf("Conflict detected: %s already exists. Choose an option:\n", current->name);
-            printf("1. Skip\n2. Rename\n3. Overwrite\n");
-            
-            // Declare and initialize the choice variable
-            scanf("%d", &choice);
-            getchar(); // Consume the newline character
-
-            if (choice == 1) {
-                // Skip the conflicting file/folder
-                printf("Skipping %s\n", current->name);
-            } else if (choice == 2) {
-                // Rename the new file/folder
-                char newName[256];
-                printf("Enter a new name for %s: ", current->name);
-                fgets(newName, sizeof(newName), stdin);
-                newName[strcspn(newName, "\n")] = '\0'; // Remove newline
-                free(current->name);
-                current->name = strdup(newName);
-                printf("Renamed to %s\n", current->name);
-            } else if (choice == 3) {
-                // Overwrite the existing file/folder
-                printf("Overwriting %s\n", current->name);
-                removeNode(existing); // Remove the existing node
-            } else {
-                // Handle invalid input
-                printf("Invalid choice. Skipping %s.\n", current->name);
-                return;
-            }
-        }
+static void listEmpty(size_t depth) {
+    listIndent(depth);
+    listText("___Empty____\n");
+}
 
-        // Move the current node to the destination folder
-        if (!existing || choice == 3) {
-            current->parent = destFolder;
-            if (destFolder->child == NULL) {
-                destFolder->child = current;
-                current->previous = NULL;
-            } else {
-                node* last = destFolder->child;
-                while (last->next) last = last->next;
-                last->next = current;
-                current->previous = last;
-            }
+static void listJsonString(const char* text) {
+    static const char hex[] = "0123456789abcdef";
+    listText("\"");
+    const char* run = text;
+    for (const char* cursor = text; *cursor; cursor++) {
+        unsigned char c = (unsigned char)*cursor;
+        if (c >= 0x20 && c != '"' && c != '\\') continue;
+        listBytes(run, (size_t)(cursor - run));
+        if (c == '"') listText("\\\"");
+        else if (c == '\\') listText("\\\\");
+        else if (c == '\n') listText("\\n");
+        else if (c == '\t') listText("\\t");
+        else {
+            char escape[] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 15]};
+            listBytes(escape, sizeof(escape));
         }
-        current = next;
+        run = cursor + 1;
     }
-    printf("Directories merged.\n");
+    listText(run);
+    listText("\"");
 }
 
-// Handle symbolic links
-int createSymlink(node* currentFolder, char* sourcePath, char* linkName, node* root) {
-    // Use parsePath to find the source node
-    node* sourceNode = parsePath(currentFolder, sourcePath, root);
-    if (sourceNode == NULL) {
-        printf("Error: Source '%s' not found.\n", sourcePath);
-        return -1;
-    }
-
-    // Check if a node with the linkName already exists in the current folder
-    node* existingNode = getNodeTypeless(currentFolder, linkName); // Use getNodeTypeless
-    if (existingNode != NULL) {
-        printf("Error: A node with the name '%s' already exists.\n", linkName);
-        return -1;
+// A node as a JSON object, left open so children can follow
+static void listJsonOpen(node* item) {
+    static const char* types[] = {"file", "folder", "symlink"};
+    listText("{\"name\":");
+    listJsonString(nameOf(item));
+    listText(",\"type\":\"");
+    listText(types[item->type]);
+    listText("\",\"date\":");
+    if (item->date < 0) {
+        listText("-");
+        listNumber((uint64_t)-(int64_t)item->date);
+    } else {
+        listNumber((uint64_t)item->date);
     }
-
-    // Create the new symlink node
-    node* newLink = malloc(sizeof(node));
-    if (!newLink) {
-        printf("Error: Memory allocation failed.\n");
-        return -1;
+    if (item->type == Folder) {
+        listText(",\"items\":");
+        if (item->flags & NODE_STUB) listText("null");
+        else listNumber((uint64_t)numberOfItems(item));
+    } else if (item->type == File) {
+        listText(",\"size\":");
+        listNumber(nodeSize(item));
+    } else {
+        listText(",\"target\":");
+        listJsonString(symlinkTarget(item) ? symlinkTarget(item) : "");
     }
+}
 
-    newLink->type = Symlink;
-    newLink->name = strdup(linkName);
-    newLink->symlinkTarget = strdup(sourcePath); // Store the target path as a string
-    newLink->size = 0; // Size for symlinks can be 0 as it points to another node
-    newLink->date = time(NULL); // Set current time as the creation date
-    newLink->child = NULL;
-    newLink->next = NULL;
-    newLink->parent = currentFolder;
+int parseListFormat(const char* argument, enum listFormat* format) {
+    if (!argument) *format = ListDefault;
+    else if (strcmp(argument, "--format=plain") == 0) *format = ListPlain;
+    else if (strcmp(argument, "--format=json") == 0) *format = ListJson;
+    else return -1;
+    return 0;
+}
 
-    // Add the new symlink to the current folder's child list
-    if (currentFolder->child == NULL) {
-        currentFolder->child = newLink;
+void ls(node *currentFolder, enum listFormat format) {
+    if (colorOutput < 0) colorOutput = isatty(STDOUT_FILENO);
+    int savedColor = colorOutput;
+    if (format != ListDefault) colorOutput = 0;
+    listingBegin();
+
+    node* currentNode = firstChildOf(currentFolder);
+    if (format == ListJson) {
+        listText("[");
+        for (; currentNode; currentNode = nextOf(currentNode)) {
+            listJsonOpen(currentNode);
+            listText(nextOf(currentNode) ? "},\n" : "}");
+        }
+        listText("]\n");
+    } else if (currentNode == NULL) {
+        listEmpty(0);
     } else {
-        node* lastChild = currentFolder->child;
-        while (lastChild->next != NULL) {
-            lastChild = lastChild->next;
+        for (; currentNode; currentNode = nextOf(currentNode)) listLine(currentNode, 0, 1);
+        if (activePool->stubFolders > 0) {
+            listNumber(activePool->stubFolders);
+            listText(" folders not read from disk yet\n");
         }
-        lastChild->next = newLink;
     }
 
-    printf("Symbolic link '%s' -> '%s' created.\n", linkName, sourcePath);
-    return 0;
+    sinkFlush(&listingSink);
+    colorOutput = savedColor;
 }
 
-// Compression (using zlib)
-// void compressDirectory(node* folder, const char* filename) {
-//     if (!folder) return;
-
-//     FILE* file = fopen(filename, "wb");
-//     if (!file) {
-//         printf("Error: Unable to create compressed file '%s'.\n", filename);
-//         return;
-//     }
+// Walks the tree in preorder without recursion, so depth is only limited
+// by memory
+void lsrecursive(node *currentFolder, enum listFormat format) {
+    if (colorOutput < 0) colorOutput = isatty(STDOUT_FILENO);
+    int savedColor = colorOutput;
+    if (format != ListDefault) colorOutput = 0;
+    int json = format == ListJson;
+    listingBegin();
+
+    node* item = firstChildOf(currentFolder);
+    if (json) listText("[");
+    else if (!item) listEmpty(0);
+    size_t depth = 0;
+    while (item) {
+        if (item->flags & NODE_STUB) hydrateFolder(item);
+        if (json) listJsonOpen(item);
+        else listLine(item, depth, 0);
+
+        if (item->type == Folder) {
+            node* child = firstChildOf(item);
+            if (child) {
+                if (json) listText(",\"children\":[\n");
+                item = child;
+                depth++;
+                continue;
+            }
+            if (json) listText(",\"children\":[]");
+            else listEmpty(depth + 1);
+        }
 
-//     gzFile gzfile = gzdopen(fileno(file), "wb");
-//     if (!gzfile) {
-//         fclose(file);
-//         printf("Error: Unable to open compressed stream for '%s'.\n", filename);
-//         return;
-//     }
+        // Close every folder finished here, then go on with the next sibling
+        if (json) listText("}");
+        while (item && !nextOf(item)) {
+            item = parentOf(item);
+            if (item == currentFolder) {
+                item = NULL;
+            } else {
+                depth--;
+                if (json) listText("]}");
+            }
+        }
+        if (item) {
+            item = nextOf(item);
+            if (json) listText(",\n");
+        }
+    }
+    if (json) listText("]\n");
 
-//     // Save the directory structure into the compressed stream
-//     saveDirectory(folder, gzfile);
-//     gzclose(gzfile);
+    sinkFlush(&listingSink);
+    colorOutput = savedColor;
+}
 
-//     printf("Directory compressed to '%s'.\n", filename);
-// }
+void edit(node* currentFolder, char* command) {
+    if (strtok(command, " ") != NULL) {
+        char* fileName = strtok(NULL, " ");
+        if (fileName != NULL) {
+            node* editingNode = getNode(currentFolder, fileName, File);
+            if (editingNode) {
+                note("Enter new content for '%s':\n", fileName);
+                char* content = getString();
+                if (!content) content = strdup("");
 
+                // Update memory
+                poolAttachPayload(activePool, editingNode);
+                contentFree(editingNode);
+                contentStore(editingNode, 0, content, strlen(content));
+                setFileSize(editingNode, strlen(content));
+                setNodeDate(editingNode, time(NULL));
+
+                // Write to the real file; the queue keeps the content
+                mirrorSubmit(MirrorWrite, currentFolder, fileName, content, strlen(content));
+            } else {
+                reportError("File '%s' not found.\n", fileName);
+            }
+        }
+    }
+}
 
-// // Decompression (using zlib)
-// node* decompressDirectory(const char* filename) {
-//     FILE* file = fopen(filename, "rb");
-//     if (!file) {
-//         printf("Error: Unable to open compressed file '%s'.\n", filename);
-//         return NULL;
-//     }
+// Reads a byte offset or length argument
+static int parseByteCount(const char* text, size_t* value) {
+    if (!text || *text < '0' || *text > '9') return -1;
+    char* end;
+    errno = 0;
+    unsigned long long parsed = strtoull(text, &end, 10);
+    if (*end != '\0' || errno == ERANGE || parsed > SIZE_MAX / 2) return -1;
+    *value = parsed;
+    return 0;
+}
 
-//     gzFile gzfile = gzdopen(fileno(file), "rb");
-//     if (!gzfile) {
-//         fclose(file);
-//         printf("Error: Unable to open compressed stream for '%s'.\n", filename);
-//         return NULL;
-//     }
+// Writes 'content' at 'offset' of a file in the current folder. Content the
+// shell holds is patched in the extents the range covers; a file only known
+// by its size (imported or mounted) just grows. The real file gets only the
+// new bytes either way, and the queue takes 'content' over.
+static void writeRange(node* currentFolder, node* file, size_t offset, char* content) {
+    size_t length = strlen(content);
+    size_t size = nodeSize(file);
+    poolAttachPayload(activePool, file);
+    if (hasContent(file) && offset < size && journaling()) {
+        // Keep the bytes this write covers, for a rollback
+        journalEntry* entry = journalPush(JournalPatched, file);
+        entry->value = (int64_t)offset;
+        entry->length = length < size - offset ? length : size - offset;
+        entry->saved = malloc(entry->length);
+        contentLoad(file, offset, entry->saved, entry->length);
+    } else if (!hasContent(file) && size == 0 && journaling()) {
+        journalPush(JournalContent, file); // Had none, so a rollback drops what this write makes
+    }
+    if (hasContent(file) || size == 0) {
+        if (offset > size) contentClear(file, size, offset);
+        contentStore(file, offset, content, length);
+    }
+    if (offset + length > size) setFileSize(file, offset + length);
+    setNodeDate(file, time(NULL));
+    mirrorPatch(currentFolder, nameOf(file), content, length, offset);
+}
 
-//     // Create the root node
-//     node* folder = malloc(sizeof(node));
-//     folder->type = Folder;
-//     folder->name = strdup("/");
-//     folder->parent = NULL;
-//     folder->child = NULL;
-//     folder->next = NULL;
-//     folder->previous = NULL;
-//     folder->symlinkTarget = NULL;
-
-//     // Load the directory structure from the compressed stream
-//     folder->child = loadDirectory(gzfile, folder);
-//     gzclose(gzfile);
-
-//     printf("Directory decompressed from '%s'.\n", filename);
-//     return folder;
-// }
+void writeFile(node* currentFolder, char* fileName, char* offsetText) {
+    size_t offset;
+    if (parseByteCount(offsetText, &offset) != 0) {
+        reportError("Error: Invalid offset '%s'.\n", offsetText);
+        return;
+    }
+    node* file = getNode(currentFolder, fileName, File);
+    if (!file) {
+        reportError("File '%s' not found.\n", fileName);
+        return;
+    }
 
-void displayPrompt(const char* path) {
-    printf("┌──[%s%s%s]\n└─%s>%s ", BLUE, path, RESET, GREEN, RESET);
+    note("Enter content to write at offset %zu of '%s':\n", offset, fileName);
+    char* content = getString();
+    if (!content || !*content) {
+        free(content);
+        return;
+    }
+    writeRange(currentFolder, file, offset, content);
 }
 
-// [Not Working] 
-// // Function to enable raw mode for real-time input
-// void enableRawMode() {
-//     struct termios raw;
-//     tcgetattr(STDIN_FILENO, &raw);
-//     raw.c_lflag &= ~(ICANON | ECHO); // Disable canonical mode and echo
-//     tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
-// }
+void appendFile(node* currentFolder, char* fileName) {
+    node* file = getNode(currentFolder, fileName, File);
+    if (!file) {
+        reportError("File '%s' not found.\n", fileName);
+        return;
+    }
 
-// // Function to restore the terminal to default mode
-// void disableRawMode() {
-//     struct termios raw;
-//     tcgetattr(STDIN_FILENO, &raw);
-//     raw.c_lflag |= (ICANON | ECHO); // Enable canonical mode and echo
-//     tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
-// }
+    note("Enter content to append to '%s':\n", fileName);
+    char* content = getString();
+    if (!content || !*content) {
+        free(content);
+        return;
+    }
+    writeRange(currentFolder, file, nodeSize(file), content);
+}
 
-// // [Not Working] Function to read input in real-time with yellow color
-// char* getRealTimeInput() {
+// Prints 'length' bytes from 'offset' of a file, cut off at its end. Only
+// the extents in range are copied; without content in memory the bytes
+// come from the real file.
+void readFile(node* currentFolder, char* fileName, char* offsetText, char* lengthText) {
+    size_t offset, length;
+    if (parseByteCount(offsetText, &offset) != 0) {
+        reportError("Error: Invalid offset '%s'.\n", offsetText);
+        return;
+    }
+    if (parseByteCount(lengthText, &length) != 0) {
+        reportError("Error: Invalid length '%s'.\n", lengthText);
+        return;
+    }
+    node* file = getNode(currentFolder, fileName, File);
+    if (!file) {
+        reportError("File '%s' not found.\n", fileName);
+        return;
+    }
+
+    size_t size = nodeSize(file);
+    if (offset >= size) length = 0;
+    else if (length > size - offset) length = size - offset;
+
+    char* buffer = malloc(EXTENT_SIZE);
+    if (hasContent(file)) {
+        for (size_t done = 0; done < length;) {
+            size_t piece = length - done < EXTENT_SIZE ? length - done : EXTENT_SIZE;
+            contentLoad(file, offset + done, buffer, piece);
+            fwrite(buffer, 1, piece, stdout);
+            done += piece;
+        }
+    } else if (length > 0) {
+        char* path = realPathOf(currentFolder, fileName);
+        mirrorWait();
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            reportError("Error: Could not open file '%s'.\n", path);
+            free(path);
+            free(buffer);
+            return;
+        }
+        for (size_t done = 0; done < length;) {
+            size_t piece = length - done < EXTENT_SIZE ? length - done : EXTENT_SIZE;
+            ssize_t n = pread(fd, buffer, piece, offset + done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            fwrite(buffer, 1, n, stdout);
+            done += n;
+        }
+        close(fd);
+        free(path);
+    }
+    printf("\n");
+    free(buffer);
+}
+
+void clear() {
+    #ifdef _WIN32
+        system("cls"); // Windows-specific command to clear the screen
+    #else
+        system("clear"); // Unix/Linux/Mac command to clear the screen
+    #endif
+}
+
+
+void pwd(char *path) {
+    if (path && strlen(path) > 0) {
+        // Print the path directly without trimming the last character
+        printf("%s\n", path);
+    } else {
+        // Default to root if the path is not set or invalid
+        printf("/\n");
+    }
+}
+
+node* cd(node *currentFolder, char *command, char **path, node *root) {
+    if (strtok(command, " ") != NULL) {
+        char* targetPath = strtok(NULL, " ");
+        if (targetPath != NULL) {
+            // Resolve the whole path first so a bad component leaves us where we were
+            char missing[256];
+            node* destinationFolder = lookupPath(currentFolder, targetPath, root, missing, sizeof(missing));
+            if (destinationFolder == NULL || destinationFolder->type != Folder) {
+                reportError("There is no '%s' folder in the current directory!\n",
+                            destinationFolder ? nameOf(destinationFolder) : missing);
+                return currentFolder;
+            }
+
+            // Rebuild the displayed path from the folder's ancestors
+            size_t length = 0;
+            for (node* folder = destinationFolder; folder->parent; folder = parentOf(folder)) {
+                length += strlen(nameOf(folder)) + 1;
+            }
+            *path = realloc(*path, length + 2);
+            strcpy(*path, "/");
+            char* end = *path + length;
+            if (length > 0) *end = '\0';
+            for (node* folder = destinationFolder; folder->parent; folder = parentOf(folder)) {
+                size_t nameLength = strlen(nameOf(folder));
+                end -= nameLength;
+                memcpy(end, nameOf(folder), nameLength);
+                *--end = '/';
+            }
+            return destinationFolder;
+        } else {
+            reportError("Error: No path provided.\n");
+        }
+    }
+    return currentFolder;
+}
+
+node* cdup(node *currentFolder, char **path) {
+
+    size_t newPathLength = strlen(*path) - strlen(nameOf(currentFolder));
+
+    if (currentFolder->parent != NO_NODE ) {
+
+        *path = (char *) realloc(*path, sizeof(char)* newPathLength);
+        (*path)[newPathLength-1] = '\0';
+
+        currentFolder = parentOf(currentFolder);
+        return currentFolder;
+    } else {
+        return currentFolder;
+    }
+}
+
+// Sorted folders. sortBy gives a folder a mode it keeps: its child list
+// stays in that order, so listings just follow it. The list is the bottom
+// level of a skip list; one child in four also gets a tower on the level
+// above, one in sixteen two levels, and so on, so finding the place for a
+// new, renamed or redated child takes O(log n).
+static uint32_t orderSeed = 2463534242u;
+
+static int orderCompare(childOrder* order, node* a, node* b) {
+    int result = order->mode == SortByDate ? compareNodesByDate(&a, &b) : compareNodesByName(&a, &b);
+    if (result == 0) result = idOf(a) < idOf(b) ? -1 : idOf(a) > idOf(b);
+    return result;
+}
+
+static unsigned int orderHeight() {
+    orderSeed ^= orderSeed << 13;
+    orderSeed ^= orderSeed >> 17;
+    orderSeed ^= orderSeed << 5;
+    unsigned int height = 0;
+    for (uint32_t bits = orderSeed; (bits & 3) == 0 && height < ORDER_MAX_LEVELS; bits >>= 2) height++;
+    return height;
+}
+
+static size_t towerSize(unsigned int height) {
+    return sizeof(orderTower) + height * sizeof(orderTower*);
+}
+
+// Fills 'update' with the last tower before 'item' on each level and
+// returns the child 'item' belongs after, NULL for the front
+static node* orderSearch(node* folder, childOrder* order, node* item, orderTower** update) {
+    orderTower* previous = NULL;
+    for (int level = order->levels - 1; level >= 0; level--) {
+        orderTower* next = previous ? previous->next[level] : order->head[level];
+        while (next && orderCompare(order, nodeAt(next->item), item) < 0) {
+            previous = next;
+            next = next->next[level];
+        }
+        update[level] = previous;
+    }
+
+    node* after = previous ? nodeAt(previous->item) : NULL;
+    node* candidate = after ? nextOf(after) : nodeAt(folderOf(folder)->child);
+    while (candidate && orderCompare(order, candidate, item) < 0) {
+        after = candidate;
+        candidate = nextOf(candidate);
+    }
+    return after;
+}
+
+// Links 'child' into the sorted child list of 'folder'
+void orderLink(node* folder, node* child) {
+    folderRecord* record = folderOf(folder);
+    childOrder* order = record->order;
+    orderTower* update[ORDER_MAX_LEVELS];
+    unsigned int height = orderHeight();
+    node* last = nodeAt(record->lastChild);
+
+    // Children usually arrive in order (loading, sorted imports)
+    node* after;
+    if (height == 0 && (!last || orderCompare(order, last, child) < 0)) after = last;
+    else after = orderSearch(folder, order, child, update);
+
+    child->previous = after ? idOf(after) : NO_NODE;
+    child->next = after ? after->next : record->child;
+    if (child->next) nextOf(child)->previous = idOf(child);
+    else record->lastChild = idOf(child);
+    if (after) after->next = idOf(child);
+    else record->child = idOf(child);
+
+    if (height > 0) {
+        orderTower* tower = poolAlloc(activePool, towerSize(height));
+        tower->item = idOf(child);
+        tower->height = height;
+        for (unsigned int level = order->levels; level < height; level++) update[level] = NULL;
+        for (unsigned int level = 0; level < height; level++) {
+            orderTower** link = update[level] ? &update[level]->next[level] : &order->head[level];
+            tower->next[level] = *link;
+            *link = tower;
+        }
+        if (height > order->levels) order->levels = height;
+        child->flags |= NODE_TOWER;
+    }
+}
+
+// Drops the tower of a child about to leave the list or change its key
+void orderDropTower(node* folder, node* child) {
+    if (!(child->flags & NODE_TOWER)) return;
+    childOrder* order = folderOf(folder)->order;
+    orderTower* update[ORDER_MAX_LEVELS];
+    orderSearch(folder, order, child, update);
+    orderTower* tower = update[0] ? update[0]->next[0] : order->head[0];
+    for (unsigned int level = 0; level < tower->height; level++) {
+        orderTower** link = update[level] ? &update[level]->next[level] : &order->head[level];
+        *link = tower->next[level];
+    }
+    while (order->levels > 0 && !order->head[order->levels - 1]) order->levels--;
+    poolRelease(activePool, tower, towerSize(tower->height));
+    child->flags &= ~NODE_TOWER;
+}
+
+static void unlinkChild(folderRecord* record, node* child) {
+    if (child->previous) {
+        previousOf(child)->next = child->next;
+    } else {
+        record->child = child->next;
+    }
+    if (child->next) {
+        nextOf(child)->previous = child->previous;
+    } else {
+        record->lastChild = child->previous;
+    }
+}
+
+// Takes a child out of its sorted place before its name or date changes;
+// orderLink puts it back
+int orderTake(node* child) {
+    node* folder = parentOf(child);
+    if (!folder || !folderOf(folder)->order) return 0;
+    orderDropTower(folder, child);
+    unlinkChild(folderOf(folder), child);
+    return 1;
+}
+
+void setNodeDate(node* item, time_t date) {
+    if (item->date != date && journaling()) journalPush(JournalDated, item)->value = item->date;
+    node* folder = parentOf(item);
+    if (item->date == date || !folder || !folderOf(folder)->order || folderOf(folder)->order->mode != SortByDate) {
+        item->date = date;
+        return;
+    }
+    orderTake(item);
+    item->date = date;
+    orderLink(folder, item);
+}
+
+void orderFree(node* folder) {
+    folderRecord* record = folderOf(folder);
+    childOrder* order = record->order;
+    if (!order) return;
+    orderTower* tower = order->levels > 0 ? order->head[0] : NULL;
+    while (tower) {
+        orderTower* next = tower->next[0];
+        nodeAt(tower->item)->flags &= ~NODE_TOWER;
+        poolRelease(activePool, tower, towerSize(tower->height));
+        tower = next;
+    }
+    poolRelease(activePool, order, sizeof(childOrder));
+    record->order = NULL;
+}
+
+// Gives 'folder' a sort mode and puts its children in that order once
+void setChildOrder(node* folder, enum sortMode mode) {
+    if (journaling()) {
+        // An unsorted folder's order is only known from its list, so keep it
+        folderRecord* record = folderOf(folder);
+        journalEntry* entry = journalPush(JournalOrdered, folder);
+        entry->value = record->order ? record->order->mode : SortNone;
+        if (!record->order && record->numberOfItems > 0) {
+            nodeId* children = malloc(record->numberOfItems * sizeof(nodeId));
+            size_t count = 0;
+            for (node* child = firstChildOf(folder); child; child = nextOf(child)) children[count++] = idOf(child);
+            entry->saved = children;
+            entry->length = count;
+        }
+    }
+    orderFree(folder);
+    if (mode == SortNone) return;
+    folderRecord* record = folderOf(folder);
+    childOrder* order = poolAlloc(activePool, sizeof(childOrder));
+    memset(order, 0, sizeof(childOrder));
+    order->mode = mode;
+    record->order = order;
+    if (!record->child) return;
+
+    size_t count = (size_t)record->numberOfItems;
+    node** children = malloc(count * sizeof(node*));
+    node* current = nodeAt(record->child);
+    for (size_t i = 0; i < count; i++) {
+        children[i] = current;
+        current = nextOf(current);
+    }
+    qsort(children, count, sizeof(node*), mode == SortByName ? compareNodesByName : compareNodesByDate);
+
+    // Relink in order, building the towers from the front
+    orderTower* tails[ORDER_MAX_LEVELS] = {NULL};
+    record->child = idOf(children[0]);
+    record->lastChild = idOf(children[count - 1]);
+    for (size_t i = 0; i < count; i++) {
+        children[i]->previous = i > 0 ? idOf(children[i - 1]) : NO_NODE;
+        children[i]->next = i + 1 < count ? idOf(children[i + 1]) : NO_NODE;
+
+        unsigned int height = orderHeight();
+        if (height == 0) continue;
+        orderTower* tower = poolAlloc(activePool, towerSize(height));
+        tower->item = idOf(children[i]);
+        tower->height = height;
+        for (unsigned int level = 0; level < height; level++) {
+            tower->next[level] = NULL;
+            if (tails[level]) tails[level]->next[level] = tower;
+            else order->head[level] = tower;
+            tails[level] = tower;
+        }
+        if (height > order->levels) order->levels = height;
+        children[i]->flags |= NODE_TOWER;
+    }
+    free(children);
+}
+
+void freeNode(node *freeingNode) {
+    if (freeingNode->flags & NODE_STUB) {
+        freeingNode->flags &= ~NODE_STUB; // Nothing to read, it is going away
+        activePool->stubFolders--;
+    }
+
+    node* currentNode = firstChildOf(freeingNode);
+    while (currentNode != NULL) {
+        node* nextNode = nextOf(currentNode);
+        freeNode(currentNode);
+        currentNode = nextNode;
+    }
+
+    if (freeingNode->flags & NODE_LONG_NAME) {
+        poolDiscardString(activePool, nameOf(freeingNode));
+    }
+    contentFree(freeingNode);
+    poolDiscardString(activePool, symlinkTarget(freeingNode));
+    indexFree(freeingNode);
+    if (freeingNode->type == Folder) {
+        orderFree(freeingNode);
+        unwatchFolder(freeingNode);
+        detachDirHandle(freeingNode);
+    }
+    poolFreeNode(activePool, freeingNode);
+
+}
+
+node* createNode(const char* name, enum nodeType type) {
+    node* newNode = poolAllocNode(activePool);
+    setNodeName(newNode, name);
+    newNode->type = type;
+    newNode->date = time(NULL);
+    if (type != File) {
+        poolAttachPayload(activePool, newNode);
+    }
+    return newNode;
+}
+
+// Links 'child' last, or in its sorted place, without touching the totals above 'folder'
+void linkChild(node* folder, node* child) {
+    folderRecord* record = folderOf(folder);
+    nodeId childId = idOf(child);
+
+    child->parent = idOf(folder);
+    if (record->order) {
+        orderLink(folder, child);
+    } else {
+        child->previous = record->lastChild;
+        child->next = NO_NODE;
+        if (record->lastChild) {
+            nodeAt(record->lastChild)->next = childId;
+        } else {
+            record->child = childId;
+        }
+        record->lastChild = childId;
+    }
+    record->numberOfItems++;
+    indexInsert(folder, child);
+}
+
+void appendChild(node* folder, node* child) {
+    if (journaling()) journalPush(JournalLinked, child)->value = !(child->flags & NODE_DETACHED);
+    child->flags &= ~NODE_DETACHED;
+    linkChild(folder, child);
+    propagateTotals(folder, totalsOf(child), 1);
+}
+
+void removeNode(node *removingNode) {
+    node* parent = parentOf(removingNode);
+    if (parent == NULL) return;
+    folderRecord* record = folderOf(parent);
+    if (journaling()) {
+        journalEntry* entry = journalPush(JournalUnlinked, removingNode);
+        entry->parent = idOf(parent);
+        entry->previous = removingNode->previous;
+        removingNode->flags |= NODE_DETACHED;
+    }
+    propagateTotals(parent, totalsOf(removingNode), -1);
+
+    if (record->order) orderDropTower(parent, removingNode);
+    unlinkChild(record, removingNode);
+    record->numberOfItems--;
+    indexRemove(parent, removingNode);
+
+    removingNode->parent = NO_NODE;
+    removingNode->previous = NO_NODE;
+    removingNode->next = NO_NODE;
+}
+
+void rm(node* currentFolder, char* command) {
+    if (strtok(command, " ") != NULL) {
+        char* nodeName = strtok(NULL, " ");
+        if (nodeName != NULL) {
+            node* removingNode = getNodeTypeless(currentFolder, nodeName);
+            if (removingNode) {
+                note("Do you really want to remove '%s' and its content? (y/n)\n", nodeName);
+                char* answer = getString();
+                if (answer && strcmp(answer, "y") == 0) {
+                    // Remove from real filesystem, while the folder still
+                    // knows its real directory
+                    if (removingNode->type == Folder) {
+                        mirrorRemoveFolder(removingNode);
+                    } else if (removingNode->type == File) {
+                        mirrorSubmit(MirrorRemoveFile, currentFolder, nodeName, NULL, 0);
+                    }
+
+                    // Remove from memory
+                    removeNode(removingNode);
+                    discardNode(removingNode);
+                }
+                free(answer);
+            } else {
+                reportError("Node '%s' not found.\n", nodeName);
+            }
+        }
+    }
+}
+
+
+void moveNode(node *movingNode, node *destinationFolder) {
+    removeNode(movingNode);
+    appendChild(destinationFolder, movingNode);
+}
+
+void mov(node *currentFolder, char *command) {
+
+    char* nodeName;
+    char* destinationName;
+
+    if (strtok(command, " ") != NULL) {
+        nodeName = strtok(NULL, " ");
+        if (nodeName != NULL) {
+            destinationName = strtok(NULL, " ");
+            if (destinationName != NULL) {
+                if (strtok(NULL, " ")) {
+                    return;
+                } else {
+
+                    node* movingNode = getNodeTypeless(currentFolder, nodeName);
+                    node* destinationFolder = getNode(currentFolder, destinationName, Folder);
+
+                    if (destinationFolder != NULL && movingNode != NULL && destinationFolder != movingNode) {
+
+                        moveNode(movingNode, destinationFolder);
+                    } else {
+                        reportError("Something you made wrong!\n");
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Helper functions for comparing and swapping nodes (used for sorting)
+int compareNodesByName(const void* a, const void* b) {
+    node* nodeA = *(node**)a;
+    node* nodeB = *(node**)b;
+    return strcmp(nameOf(nodeA), nameOf(nodeB));
+}
+
+// Oldest first; the same minute falls back to the name
+int compareNodesByDate(const void* a, const void* b) {
+    node* nodeA = *(node**)a;
+    node* nodeB = *(node**)b;
+    if (nodeA->date != nodeB->date) return nodeA->date < nodeB->date ? -1 : 1;
+    return strcmp(nameOf(nodeA), nameOf(nodeB));
+}
+
+void sortDirectory(node* folder, const char* criterion) {
+    if (!folder) return;
+    enum sortMode mode = strcmp(criterion, "name") == 0 ? SortByName : strcmp(criterion, "date") == 0 ? SortByDate : SortNone;
+    if (folder->flags & NODE_STUB) hydrateFolder(folder);
+    setChildOrder(folder, mode);
+    if (mode == SortNone) note("Directory keeps its current order.\n");
+    else note("Directory sorted by %s, and kept that way.\n", criterion);
+}
+
+static int isWithin(node* item, node* folder) {
+    for (node* cursor = item; cursor; cursor = parentOf(cursor)) {
+        if (cursor == folder) return 1;
+    }
+    return 0;
+}
+
+// The shell's path, rebuilt from its folder after renames, moves and removals
+static void rebuildShellPath(shellState* shell) {
+    free(shell->path);
+    shell->path = nodePath(shell->currentFolder);
+}
+
+// Snapshots. Taking one only marks the journal; rolling back undoes the
+// entries after the mark, newest first, so every entry finds the tree
+// exactly as it left it.
+static journalEntry* journalPush(enum journalKind kind, node* item) {
+    if (journal.count == journal.capacity) {
+        journal.capacity = journal.capacity ? journal.capacity * 2 : 64;
+        journal.entries = realloc(journal.entries, journal.capacity * sizeof(journalEntry));
+    }
+    journalEntry* entry = &journal.entries[journal.count++];
+    memset(entry, 0, sizeof(journalEntry));
+    entry->kind = kind;
+    entry->item = item ? idOf(item) : NO_NODE;
+    return entry;
+}
+
+static void unwatchSubtree(node* item) {
+    if (item->type != Folder) return;
+    unwatchFolder(item);
+    for (node* child = firstChildOf(item); child; child = nextOf(child)) unwatchSubtree(child);
+}
+
+// Frees a node its caller took out of the tree. While a snapshot may bring
+// it back, the journal keeps it instead and only its watches go.
+void discardNode(node* item) {
+    if (!journaling()) {
+        freeNode(item);
+        return;
+    }
+    journalPush(JournalDiscarded, item);
+    unwatchSubtree(item);
+}
+
+// Puts 'child' back after 'previous', or first, as it was before it left
+static void insertChild(node* folder, node* child, nodeId previous) {
+    folderRecord* record = folderOf(folder);
+    child->flags &= ~NODE_DETACHED;
+    if (record->order) {
+        appendChild(folder, child);
+        return;
+    }
+    nodeId childId = idOf(child);
+    child->parent = idOf(folder);
+    child->previous = previous;
+    child->next = previous ? nodeAt(previous)->next : record->child;
+    if (previous) nodeAt(previous)->next = childId;
+    else record->child = childId;
+    if (child->next) nodeAt(child->next)->previous = childId;
+    else record->lastChild = childId;
+    record->numberOfItems++;
+    indexInsert(folder, child);
+    propagateTotals(folder, totalsOf(child), 1);
+}
+
+// Reverts one change. Whatever the entry kept goes back into the tree or
+// is freed.
+static void journalUndo(journalEntry* entry, shellState* shell) {
+    node* item = entry->item ? nodeAt(entry->item) : NULL;
+    switch (entry->kind) {
+    case JournalMarker:
+        free(entry->saved);
+        journal.markers--;
+        break;
+    case JournalLinked:
+        // A node made since goes away; one that was moved goes back next
+        if (entry->value && isWithin(shell->currentFolder, item)) shell->currentFolder = parentOf(item);
+        removeNode(item);
+        if (entry->value) freeNode(item);
+        break;
+    case JournalUnlinked:
+        insertChild(nodeAt(entry->parent), item, entry->previous);
+        break;
+    case JournalDiscarded:
+        break; // Its Unlinked entry, next, puts it back
+    case JournalRenamed:
+        relabelNode(item, entry->saved);
+        free(entry->saved);
+        break;
+    case JournalDated:
+        setNodeDate(item, (time_t)entry->value);
+        break;
+    case JournalResized:
+        setFileSize(item, (size_t)entry->value);
+        break;
+    case JournalContent:
+        contentFree(item);
+        fileOf(item)->content = entry->saved;
+        break;
+    case JournalPatched:
+        contentStore(item, (size_t)entry->value, entry->saved, entry->length);
+        free(entry->saved);
+        break;
+    case JournalOrdered:
+        setChildOrder(item, (enum sortMode)entry->value);
+        if (entry->length > 0) {
+            folderRecord* record = folderOf(item);
+            nodeId* children = entry->saved;
+            for (size_t i = 0; i < entry->length; i++) {
+                node* child = nodeAt(children[i]);
+                child->previous = i > 0 ? children[i - 1] : NO_NODE;
+                child->next = i + 1 < entry->length ? children[i + 1] : NO_NODE;
+            }
+            record->child = children[0];
+            record->lastChild = children[entry->length - 1];
+        }
+        free(entry->saved);
+        break;
+    case JournalRetargeted:
+        poolDiscardString(activePool, symlinkTarget(item));
+        symlinkOf(item)->target = entry->saved;
+        symlinkOf(item)->generation = 0;
+        break;
+    case JournalMirrored:
+        break; // The real entry is brought in step once the whole rollback is done
+    }
+}
+
+// Lets go of what an entry kept, once no snapshot is left that could undo it
+static void journalRelease(journalEntry* entry) {
+    switch (entry->kind) {
+    case JournalDiscarded:
+        freeNode(nodeAt(entry->item));
+        break;
+    case JournalContent:
+        if (entry->saved) extentMapFree(entry->saved);
+        break;
+    case JournalRetargeted:
+        poolDiscardString(activePool, entry->saved);
+        break;
+    case JournalMirrored:
+        releaseHandle(((mirroredChange*)entry->saved)->dir, 0);
+        free(entry->saved);
+        break;
+    default:
+        free(entry->saved);
+        break;
+    }
+}
+
+// Entries older than every snapshot can never be undone
+static void journalTrim() {
+    size_t first = 0;
+    while (first < journal.count && journal.entries[first].kind != JournalMarker) first++;
+    journal.replaying = 1;
+    for (size_t i = 0; i < first; i++) journalRelease(&journal.entries[i]);
+    journal.replaying = 0;
+    memmove(journal.entries, journal.entries + first, (journal.count - first) * sizeof(journalEntry));
+    journal.count -= first;
+}
+
+// The tree is going away with its pool, so only what was malloc'd is freed
+void journalReset() {
+    for (size_t i = 0; i < journal.count; i++) {
+        enum journalKind kind = journal.entries[i].kind;
+        if (kind == JournalMirrored) releaseHandle(((mirroredChange*)journal.entries[i].saved)->dir, 0);
+        if (kind != JournalDiscarded && kind != JournalContent && kind != JournalRetargeted) {
+            free(journal.entries[i].saved);
+        }
+    }
+    journal.count = 0;
+    journal.markers = 0;
+}
+
+static journalEntry* journalFindMarker(const char* tag) {
+    for (size_t i = journal.count; i-- > 0;) {
+        journalEntry* entry = &journal.entries[i];
+        if (entry->kind == JournalMarker && strcmp(entry->saved, tag) == 0) return entry;
+    }
+    return NULL;
+}
+
+void snapshotTake(const char* tag) {
+    if (journalFindMarker(tag)) {
+        reportError("Error: A snapshot named '%s' already exists.\n", tag);
+        return;
+    }
+    journalPush(JournalMarker, NULL)->saved = strdup(tag);
+    journal.markers++;
+    note("Snapshot '%s' taken.\n", tag);
+}
+
+// Real entry a rollback brings back in step with the tree: every kind of
+// change queued for it since the snapshot, and the node it held first,
+// which is the one the rolled back tree has there if any
+typedef struct mirroredStep {
+    mirroredChange* change;
+    nodeId item;
+    int kinds; // Bit per mirrorKind
+    size_t order;
+    size_t depth; // Directories between the entry and the working directory
+} mirroredStep;
+
+// Whether the real entry exists; a folder bound to a directory is named by
+// its absolute path
+static int mirroredExists(mirroredChange* change, struct stat* info) {
+    char* path = change->name[0] == '/' ? strdup(change->name) : handlePath(change->dir, change->name);
+    int exists = lstat(path, info) == 0;
+    free(path);
+    return exists;
+}
+
+static int compareMirroredSteps(const void* a, const void* b) {
+    const mirroredStep* x = a;
+    const mirroredStep* y = b;
+    if (x->change->dir != y->change->dir) return (uintptr_t)x->change->dir < (uintptr_t)y->change->dir ? -1 : 1;
+    int names = strcmp(x->change->name, y->change->name);
+    if (names != 0) return names;
+    return x->order < y->order ? -1 : x->order > y->order;
+}
+
+static int compareStepDepths(const void* a, const void* b) {
+    const mirroredStep* x = a;
+    const mirroredStep* y = b;
+    return x->depth < y->depth ? -1 : x->depth > y->depth;
+}
+
+// Queues the whole content of a file the shell holds. One known only by
+// its size kept its bytes on disk, and there is nothing to put back.
+static int mirrorWholeFile(dirHandle* dir, const char* name, node* file) {
+    size_t size = nodeSize(file);
+    if (!hasContent(file) && size > 0) return 0;
+    char* data = malloc(size ? size : 1);
+    if (size > 0) contentLoad(file, 0, data, size);
+    mirrorQueueChange(MirrorWrite, dir, name, data, size, 0);
+    return 1;
+}
+
+// Creates whatever of a folder's subtree is missing on disk
+static size_t mirrorMissingChildren(node* folder) {
+    size_t queued = 0;
+    dirHandle* dir = folderHandle(folder);
+    for (node* child = firstChildOf(folder); child; child = nextOf(child)) {
+        if (child->type == Symlink) continue;
+        char* path = handlePath(dir, nameOf(child));
+        struct stat info;
+        int exists = lstat(path, &info) == 0;
+        free(path);
+        if (exists) continue;
+        if (child->type == File) {
+            queued += mirrorWholeFile(dir, nameOf(child), child);
+        } else {
+            mirrorQueueChange(MirrorMkdir, dir, nameOf(child), NULL, 0, 0);
+            queued += 1 + mirrorMissingChildren(child);
+        }
+    }
+    return queued;
+}
+
+// Brings every real entry the undone changes touched in step with the
+// rolled back tree: entries it no longer has are removed, deepest first,
+// then missing or rewritten ones are made again, shallowest first. Returns
+// how many changes were queued.
+static size_t rollbackMirror(mirroredStep* steps, size_t count, node* root) {
+    qsort(steps, count, sizeof(mirroredStep), compareMirroredSteps);
+    size_t keys = 0;
+    for (size_t i = 0; i < count; i++) {
+        mirroredChange* change = steps[i].change;
+        if (keys > 0 && steps[keys - 1].change->dir == change->dir &&
+            strcmp(steps[keys - 1].change->name, change->name) == 0) {
+            steps[keys - 1].kinds |= steps[i].kinds;
+            releaseHandle(change->dir, 0);
+            free(change);
+            continue;
+        }
+        steps[keys] = steps[i];
+        steps[keys].depth = 0;
+        for (dirHandle* dir = change->dir; dir; dir = dir->parent) steps[keys].depth++;
+        keys++;
+    }
+    qsort(steps, keys, sizeof(mirroredStep), compareStepDepths);
+
+    size_t queued = 0;
+    mirrorWait();
+    for (size_t i = keys; i-- > 0;) {
+        node* item = nodeAt(steps[i].item);
+        int kept = !(item->flags & NODE_FREED) && item->type != Symlink && isWithin(item, root);
+        struct stat info;
+        int exists = mirroredExists(steps[i].change, &info);
+        if (exists && (!kept || S_ISDIR(info.st_mode) != (item->type == Folder))) {
+            enum mirrorKind kind = S_ISDIR(info.st_mode) ? MirrorRemoveDir : MirrorRemoveFile;
+            mirrorQueueChange(kind, steps[i].change->dir, steps[i].change->name, NULL, 0, 0);
+            queued++;
+        }
+    }
+
+    for (size_t i = 0; i < keys; i++) {
+        mirroredChange* change = steps[i].change;
+        node* item = nodeAt(steps[i].item);
+        if ((item->flags & NODE_FREED) || item->type == Symlink || !isWithin(item, root)) continue;
+        // Earlier entries may have just made this one
+        mirrorWait();
+        struct stat info;
+        int exists = mirroredExists(change, &info);
+        if (item->type == File) {
+            if (!exists || (steps[i].kinds & (1 << MirrorWrite | 1 << MirrorPatch))) {
+                queued += mirrorWholeFile(change->dir, change->name, item);
+            }
+        } else {
+            if (!exists) {
+                mirrorQueueChange(MirrorMkdir, change->dir, change->name, NULL, 0, 0);
+                queued++;
+            }
+            // Its children went with it
+            if (!exists || (steps[i].kinds & 1 << MirrorRemoveDir)) queued += mirrorMissingChildren(item);
+        }
+    }
+
+    for (size_t i = 0; i < keys; i++) {
+        releaseHandle(steps[i].change->dir, 0);
+        free(steps[i].change);
+    }
+    return queued;
+}
+
+// Undoes every change made after the snapshot; the snapshot stays, so
+// the shell can come back to it again. Later snapshots are gone. Real
+// entries that mkdir, touch, edit, write or rm changed since are then
+// made to match the tree again.
+void snapshotRollback(shellState* state, const char* tag) {
+    journalEntry* marker = journalFindMarker(tag);
+    if (!marker) {
+        reportError("Error: No snapshot named '%s'.\n", tag);
+        return;
+    }
+    size_t keep = (size_t)(marker - journal.entries) + 1;
+    mirroredStep* steps = malloc((journal.count - keep) * sizeof(mirroredStep) + 1);
+    size_t stepCount = 0;
+    for (size_t i = keep; i < journal.count; i++) {
+        journalEntry* entry = &journal.entries[i];
+        if (entry->kind != JournalMirrored) continue;
+        mirroredStep* step = &steps[stepCount];
+        step->change = entry->saved;
+        step->item = entry->item;
+        step->kinds = 1 << entry->value;
+        step->order = stepCount++;
+    }
+    size_t undone = journal.count - keep - stepCount;
+
+    journal.replaying = 1;
+    while (journal.count > keep) journalUndo(&journal.entries[--journal.count], state);
+    invalidatePathCache();
+    rebuildShellPath(state);
+    size_t queued = rollbackMirror(steps, stepCount, state->root);
+    journal.replaying = 0;
+    free(steps);
+    note("Rolled back to '%s', %zu changes undone, %zu real filesystem changes queued.\n", tag, undone, queued);
+}
+
+void snapshotDrop(const char* tag) {
+    journalEntry* marker = journalFindMarker(tag);
+    if (!marker) {
+        reportError("Error: No snapshot named '%s'.\n", tag);
+        return;
+    }
+    free(marker->saved);
+    size_t position = (size_t)(marker - journal.entries);
+    memmove(marker, marker + 1, (journal.count - position - 1) * sizeof(journalEntry));
+    journal.count--;
+    journal.markers--;
+    journalTrim();
+    note("Snapshot '%s' dropped.\n", tag);
+}
+
+// Lists the snapshots, oldest first, with the changes made since each and
+// the memory the journal holds to undo them
+void printSnapshots() {
+    size_t bytes = journal.capacity * sizeof(journalEntry);
+    for (size_t i = 0; i < journal.count; i++) {
+        journalEntry* entry = &journal.entries[i];
+        if (entry->kind == JournalRenamed || entry->kind == JournalMarker) bytes += strlen(entry->saved) + 1;
+        else if (entry->kind == JournalMirrored) {
+            bytes += sizeof(mirroredChange) + strlen(((mirroredChange*)entry->saved)->name) + 1;
+        }
+        else if (entry->kind == JournalPatched) bytes += entry->length;
+        else if (entry->kind == JournalOrdered) bytes += entry->length * sizeof(nodeId);
+        else if (entry->kind == JournalContent && entry->saved) {
+            extentMap* map = entry->saved;
+            for (size_t j = 0; j < map->count; j++) bytes += extentCapacity(map, j);
+        }
+    }
+    // Real entries noted for a rollback are not changes of their own
+    size_t changes = 0;
+    for (size_t i = 0; i < journal.count; i++) {
+        enum journalKind kind = journal.entries[i].kind;
+        changes += kind != JournalMarker && kind != JournalMirrored;
+    }
+    printf("Snapshots: %zu, %zu changes kept in %zu bytes\n", journal.markers, changes, bytes);
+
+    for (size_t i = 0; i < journal.count; i++) {
+        journalEntry* entry = &journal.entries[i];
+        if (entry->kind == JournalMarker) printf("  %-20s %zu changes since\n", (char*)entry->saved, changes);
+        else if (entry->kind != JournalMirrored) changes--;
+    }
+}
+
+// Merging. Every pair of same-named folders is matched by building a hash
+// table over the smaller child list and probing it with the larger one.
+// Matching only reads the tree, so pairs are spread over worker threads;
+// the moves, renames and frees are then applied on the shell thread,
+// deepest pairs first, so a merged folder is finished before its parent.
+typedef struct mergePair {
+    nodeId source;
+    nodeId destination;
+    uint32_t depth;
+    int deferred;         // A side is not read from disk yet; matched when applied
+    size_t firstConflict;
+    size_t conflictCount;
+} mergePair;
+
+typedef struct mergeConflict {
+    nodeId source;
+    nodeId existing;
+} mergeConflict;
+
+typedef struct mergeWorker {
+    pthread_t thread;
+    struct mergePlan* plan;
+    mergePair* pairs;
+    size_t pairCount;
+    size_t pairCapacity;
+    mergeConflict* conflicts;
+    size_t conflictCount;
+    size_t conflictCapacity;
+    nodeId* table;
+    size_t tableCapacity;
+} mergeWorker;
+
+typedef struct mergePlan {
+    pthread_mutex_t lock; // Guards the waiting pairs and 'active'
+    pthread_cond_t changed;
+    mergePair* waiting;
+    size_t waitingCount;
+    size_t waitingCapacity;
+    size_t active;        // Pairs being matched
+} mergePlan;
+
+typedef struct mergeRun {
+    enum mergePolicy policy;
+    shellState* shell;    // Moved out of folders that get freed, if any
+    size_t moved;
+    size_t foldersMerged;
+    size_t skipped;
+    size_t renamed;
+    size_t overwritten;
+} mergeRun;
+
+static void mergePush(mergePlan* plan, mergePair pair) {
+    pthread_mutex_lock(&plan->lock);
+    if (plan->waitingCount == plan->waitingCapacity) {
+        plan->waitingCapacity = plan->waitingCapacity ? 2 * plan->waitingCapacity : 64;
+        plan->waiting = realloc(plan->waiting, plan->waitingCapacity * sizeof(mergePair));
+    }
+    plan->waiting[plan->waitingCount++] = pair;
+    pthread_cond_signal(&plan->changed);
+    pthread_mutex_unlock(&plan->lock);
+}
+
+// Finds the names both folders of 'pair' hold. Same-named folders become
+// new pairs; everything else is a conflict for the policy.
+static void mergeMatch(mergeWorker* worker, mergePair pair) {
+    node* source = nodeAt(pair.source);
+    node* destination = nodeAt(pair.destination);
+    pair.deferred = (source->flags | destination->flags) & NODE_STUB ? 1 : 0;
+    pair.firstConflict = worker->conflictCount;
+    pair.conflictCount = 0;
+
+    int sourceBuilt = numberOfItems(source) <= numberOfItems(destination);
+    node* built = sourceBuilt ? source : destination;
+    node* probing = sourceBuilt ? destination : source;
+    size_t capacity = 16;
+    while (capacity < 2 * (size_t)numberOfItems(built)) capacity *= 2;
+
+    if (!pair.deferred && numberOfItems(built) > 0) {
+        if (capacity > worker->tableCapacity) {
+            free(worker->table);
+            worker->table = malloc(capacity * sizeof(nodeId));
+            worker->tableCapacity = capacity;
+        }
+        memset(worker->table, 0, capacity * sizeof(nodeId));
+        size_t mask = capacity - 1;
+        for (node* child = firstChildOf(built); child; child = nextOf(child)) {
+            size_t slot = child->hash & mask;
+            while (worker->table[slot] != NO_NODE) slot = (slot + 1) & mask;
+            worker->table[slot] = idOf(child);
+        }
+
+        for (node* child = firstChildOf(probing); child; child = nextOf(child)) {
+            size_t slot = child->hash & mask;
+            node* match = NULL;
+            for (; worker->table[slot] != NO_NODE; slot = (slot + 1) & mask) {
+                node* candidate = nodeAt(worker->table[slot]);
+                if (candidate->hash == child->hash && strcmp(nameOf(candidate), nameOf(child)) == 0) {
+                    match = candidate;
+                    break;
+                }
+            }
+            if (!match) continue;
+
+            node* sourceChild = sourceBuilt ? match : child;
+            node* existing = sourceBuilt ? child : match;
+            if (sourceChild->type == Folder && existing->type == Folder) {
+                mergePair inner = {idOf(sourceChild), idOf(existing), pair.depth + 1, 0, 0, 0};
+                mergePush(worker->plan, inner);
+                continue;
+            }
+            if (worker->conflictCount == worker->conflictCapacity) {
+                worker->conflictCapacity = worker->conflictCapacity ? 2 * worker->conflictCapacity : 64;
+                worker->conflicts = realloc(worker->conflicts, worker->conflictCapacity * sizeof(mergeConflict));
+            }
+            worker->conflicts[worker->conflictCount++] = (mergeConflict){idOf(sourceChild), idOf(existing)};
+            pair.conflictCount++;
+        }
+    }
+
+    if (worker->pairCount == worker->pairCapacity) {
+        worker->pairCapacity = worker->pairCapacity ? 2 * worker->pairCapacity : 64;
+        worker->pairs = realloc(worker->pairs, worker->pairCapacity * sizeof(mergePair));
+    }
+    worker->pairs[worker->pairCount++] = pair;
+}
+
+static void* mergeWorkerMain(void* argument) {
+    mergeWorker* worker = argument;
+    mergePlan* plan = worker->plan;
+    pthread_mutex_lock(&plan->lock);
+    for (;;) {
+        while (plan->waitingCount == 0 && plan->active > 0) pthread_cond_wait(&plan->changed, &plan->lock);
+        if (plan->waitingCount == 0) break;
+        mergePair pair = plan->waiting[--plan->waitingCount];
+        plan->active++;
+        pthread_mutex_unlock(&plan->lock);
+
+        mergeMatch(worker, pair);
+
+        pthread_mutex_lock(&plan->lock);
+        if (--plan->active == 0 && plan->waitingCount == 0) pthread_cond_broadcast(&plan->changed);
+    }
+    pthread_mutex_unlock(&plan->lock);
+    return NULL;
+}
+
+static int mergeDeeperFirst(const void* a, const void* b) {
+    const mergePair* first = a;
+    const mergePair* second = b;
+    return first->depth < second->depth ? 1 : first->depth > second->depth ? -1 : 0;
+}
+
+// Free name for a renamed entry, taken in neither folder
+static char* mergeFreeName(node* source, node* destination, const char* name) {
+    size_t length = strlen(name) + 16;
+    char* candidate = malloc(length);
+    for (unsigned int i = 1;; i++) {
+        snprintf(candidate, length, "%s~%u", name, i);
+        if (!indexLookup(destination, candidate) && !indexLookup(source, candidate)) return candidate;
+    }
+}
+
+// Frees 'existing' and puts 'item' in its place
+static void mergeReplace(mergeRun* run, node* item, node* existing) {
+    node* destination = parentOf(existing);
+    if (run->shell && existing->type == Folder && isWithin(run->shell->currentFolder, existing)) {
+        run->shell->currentFolder = destination;
+    }
+    removeNode(existing);
+    discardNode(existing);
+    moveNode(item, destination);
+    run->overwritten++;
+}
+
+// Settles one name both folders hold. Returns 1 if 'item' stays behind.
+static int mergeResolve(mergeRun* run, node* item, node* existing) {
+    node* source = parentOf(item);
+    node* destination = parentOf(existing);
+    int choice;
+    switch (run->policy) {
+    case MergeSkip:
+        choice = 1;
+        break;
+    case MergeRename:
+        choice = 2;
+        break;
+    case MergeOverwrite:
+        choice = 3;
+        break;
+    case MergeNewer:
+        choice = item->date > existing->date ? 3 : 1;
+        break;
+    case MergeLarger:
+        choice = totalsOf(item).bytes > totalsOf(existing).bytes ? 3 : 1;
+        break;
+    default: {
+        note("Conflict detected: %s already exists. Choose an option:\n", nameOf(item));
+        note("1. Skip\n2. Rename\n3. Overwrite\n");
+
+        // Read the choice from the same input as the commands
+        char* answer = getString();
+        choice = answer ? atoi(answer) : 0;
+        free(answer);
+        if (choice < 1 || choice > 3) {
+            reportError("Invalid choice. Skipping %s.\n", nameOf(item));
+            run->skipped++;
+            return 1;
+        }
+    }
+    }
+
+    if (choice == 1) {
+        if (run->policy == MergeAsk) note("Skipping %s\n", nameOf(item));
+        run->skipped++;
+        return 1;
+    }
+    if (choice == 3) {
+        if (run->policy == MergeAsk) note("Overwriting %s\n", nameOf(item));
+        mergeReplace(run, item, existing);
+        return 0;
+    }
+
+    char* newName;
+    if (run->policy == MergeAsk) {
+        note("Enter a new name for %s: ", nameOf(item));
+        newName = getString();
+        if (!newName || !*newName || indexLookup(destination, newName) || indexLookup(source, newName)) {
+            reportError("Error: '%s' is already taken. Skipping %s.\n", newName ? newName : "", nameOf(item));
+            free(newName);
+            run->skipped++;
+            return 1;
+        }
+    } else {
+        newName = mergeFreeName(source, destination, nameOf(item));
+    }
+    relabelNode(item, newName);
+    free(newName);
+    if (run->policy == MergeAsk) note("Renamed to %s\n", nameOf(item));
+    moveNode(item, destination);
+    run->renamed++;
+    return 0;
+}
+
+static void mergeFolders(mergeRun* run, node* destFolder, node* srcFolder, int top);
+
+// Applies a matched pair: conflicts first, then every other child moves
+static void mergeApply(mergeRun* run, mergePair* pair, mergeConflict* conflicts, int top) {
+    node* source = nodeAt(pair->source);
+    node* destination = nodeAt(pair->destination);
+    if (pair->deferred) {
+        // Read from disk now, and merged as a tree of its own
+        mergeFolders(run, destination, source, 1);
+    } else {
+        for (size_t i = 0; i < pair->conflictCount; i++) {
+            mergeConflict* conflict = &conflicts[pair->firstConflict + i];
+            node* item = nodeAt(conflict->source);
+            if (mergeResolve(run, item, nodeAt(conflict->existing))) item->flags |= NODE_MERGE_KEEP;
+        }
+
+        // Merged subfolders were marked to stay when their own pair was applied
+        for (node* child = firstChildOf(source); child;) {
+            node* next = nextOf(child);
+            if (child->flags & NODE_MERGE_KEEP) {
+                child->flags &= ~NODE_MERGE_KEEP;
+            } else {
+                moveNode(child, destination);
+                run->moved++;
+            }
+            child = next;
+        }
+    }
+
+    if (top) return;
+    run->foldersMerged++;
+    if (!firstChildOf(source) && !(run->shell && isWithin(run->shell->currentFolder, source))) {
+        removeNode(source);
+        discardNode(source);
+    } else {
+        source->flags |= NODE_MERGE_KEEP;
+    }
+}
+
+// Matches the whole pair of trees, on worker threads once there is more
+// than one pair to go around, then applies the result
+static void mergeFolders(mergeRun* run, node* destFolder, node* srcFolder, int top) {
+    mergePlan plan;
+    memset(&plan, 0, sizeof(plan));
+    pthread_mutex_init(&plan.lock, NULL);
+    pthread_cond_init(&plan.changed, NULL);
+
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t workerCount = online > 0 ? (size_t)online : 1;
+    mergeWorker* workers = calloc(workerCount, sizeof(mergeWorker));
+    for (size_t i = 0; i < workerCount; i++) workers[i].plan = &plan;
+
+    if (srcFolder->flags & NODE_STUB) hydrateFolder(srcFolder);
+    if (destFolder->flags & NODE_STUB) hydrateFolder(destFolder);
+    mergePair first = {idOf(srcFolder), idOf(destFolder), 0, 0, 0, 0};
+    mergeMatch(&workers[0], first);
+
+    size_t started = 0;
+    if (plan.waitingCount > 1 && workerCount > 1) {
+        for (; started < workerCount; started++) {
+            if (pthread_create(&workers[started].thread, NULL, mergeWorkerMain, &workers[started]) != 0) break;
+        }
+    }
+    if (started == 0) mergeWorkerMain(&workers[0]);
+    for (size_t i = 0; i < started; i++) pthread_join(workers[i].thread, NULL);
+
+    // Gather every worker's pairs and conflicts into one list
+    size_t pairCount = 0, conflictCount = 0;
+    for (size_t i = 0; i < workerCount; i++) {
+        pairCount += workers[i].pairCount;
+        conflictCount += workers[i].conflictCount;
+    }
+    mergePair* pairs = malloc(pairCount * sizeof(mergePair));
+    mergeConflict* conflicts = malloc((conflictCount ? conflictCount : 1) * sizeof(mergeConflict));
+    pairCount = conflictCount = 0;
+    for (size_t i = 0; i < workerCount; i++) {
+        mergeWorker* worker = &workers[i];
+        for (size_t j = 0; j < worker->pairCount; j++) {
+            pairs[pairCount] = worker->pairs[j];
+            pairs[pairCount++].firstConflict += conflictCount;
+        }
+        if (worker->conflictCount > 0) {
+            memcpy(conflicts + conflictCount, worker->conflicts, worker->conflictCount * sizeof(mergeConflict));
+        }
+        conflictCount += worker->conflictCount;
+        free(worker->pairs);
+        free(worker->conflicts);
+        free(worker->table);
+    }
+    free(workers);
+    free(plan.waiting);
+    pthread_mutex_destroy(&plan.lock);
+    pthread_cond_destroy(&plan.changed);
+
+    qsort(pairs, pairCount, sizeof(mergePair), mergeDeeperFirst);
+    for (size_t i = 0; i < pairCount; i++) mergeApply(run, &pairs[i], conflicts, top && pairs[i].depth == 0);
+    free(pairs);
+    free(conflicts);
+}
+
+// Function to merge two directories. Same-named folders are merged into
+// each other; other names both hold are settled by 'policy', asking for
+// each one with MergeAsk.
+void mergeDirectories(node* destFolder, node* srcFolder, enum mergePolicy policy, shellState* shell) {
+    if (!destFolder || !srcFolder || srcFolder->type != Folder || destFolder->type != Folder) return;
+    if (isWithin(destFolder, srcFolder) || isWithin(srcFolder, destFolder)) {
+        reportError("Error: Cannot merge a folder with one inside it.\n");
+        return;
+    }
+
+    mergeRun run = {policy, shell, 0, 0, 0, 0, 0};
+    mergeFolders(&run, destFolder, srcFolder, 1);
+    if (shell) rebuildShellPath(shell);
+    note("Directories merged: %zu moved, %zu folders merged. Conflicts: %zu skipped, %zu renamed, %zu overwritten.\n",
+         run.moved, run.foldersMerged, run.skipped, run.renamed, run.overwritten);
+}
+
+// Reads the optional --policy= argument of merge
+int parseMergePolicy(const char* argument, enum mergePolicy* policy) {
+    static const char* names[] = {"ask", "skip", "rename", "overwrite", "newer", "larger"};
+    if (strncmp(argument, "--policy=", 9) != 0) return -1;
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strcmp(argument + 9, names[i]) == 0) {
+            *policy = (enum mergePolicy)i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Handle symbolic links
+int createSymlink(node* currentFolder, char* sourcePath, char* linkName, node* root) {
+    // Use parsePath to find the source node
+    node* sourceNode = parsePath(currentFolder, sourcePath, root);
+    if (sourceNode == NULL) {
+        reportError("Error: Source '%s' not found.\n", sourcePath);
+        return -1;
+    }
+
+    // Check if a node with the linkName already exists in the current folder
+    node* existingNode = getNodeTypeless(currentFolder, linkName); // Use getNodeTypeless
+    if (existingNode != NULL) {
+        reportError("Error: A node with the name '%s' already exists.\n", linkName);
+        return -1;
+    }
+
+    // Create the new symlink node
+    node* newLink = createNode(linkName, Symlink);
+    symlinkOf(newLink)->target = poolString(activePool, sourcePath); // Store the target path as a string
+
+    // Add the new symlink to the current folder's child list, then keep the
+    // node the path named so the first follow needs no lookup
+    appendChild(currentFolder, newLink);
+    symlinkOf(newLink)->resolved = idOf(sourceNode);
+    symlinkOf(newLink)->generation = treeGeneration;
+
+    note("Symbolic link '%s' -> '%s' created.\n", linkName, sourcePath);
+    return 0;
+}
+
+// Compression (using zlib). The snapshot stream is cut into blocks that
+// worker threads deflate independently, each into a complete gzip member,
+// pigz style. Members are written in order, so the output is a standard
+// multi-member gzip file that gunzip and zcat read as one stream.
+enum compressState {BlockFree, BlockQueued, BlockDone};
+
+typedef struct compressBlock {
+    enum compressState state;
+    char input[SINK_BUFFER_SIZE];
+    size_t inputLength;
+    unsigned char* output;
+    size_t outputLength;
+    size_t outputCapacity;
+    int failed;
+} compressBlock;
+
+typedef struct compressPipeline {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    compressBlock* blocks;
+    size_t blockCount;
+    size_t submitted; // Blocks handed to the workers
+    size_t taken;     // Blocks picked up by a worker
+    size_t written;   // Blocks written to the file
+    size_t workers;   // Threads started; with none the writer deflates each block itself
+    int stopping;
+    FILE* file;
+    int failed;
+    size_t bytesIn;
+    size_t bytesOut;
+} compressPipeline;
+
+static void deflateBlock(compressBlock* block) {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    // windowBits 15 + 16 selects the gzip wrapper
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        block->failed = 1;
+        return;
+    }
+
+    size_t bound = deflateBound(&stream, block->inputLength);
+    if (bound > block->outputCapacity) {
+        free(block->output);
+        block->output = malloc(bound);
+        block->outputCapacity = bound;
+    }
+
+    stream.next_in = (unsigned char*)block->input;
+    stream.avail_in = block->inputLength;
+    stream.next_out = block->output;
+    stream.avail_out = bound;
+    block->failed = deflate(&stream, Z_FINISH) != Z_STREAM_END;
+    block->outputLength = stream.total_out;
+    deflateEnd(&stream);
+}
+
+static void* compressWorker(void* argument) {
+    compressPipeline* pipeline = argument;
+    pthread_mutex_lock(&pipeline->lock);
+    for (;;) {
+        while (pipeline->taken == pipeline->submitted && !pipeline->stopping) {
+            pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+        }
+        if (pipeline->taken == pipeline->submitted) break;
+
+        compressBlock* block = &pipeline->blocks[pipeline->taken++ % pipeline->blockCount];
+        pthread_mutex_unlock(&pipeline->lock);
+        deflateBlock(block);
+        pthread_mutex_lock(&pipeline->lock);
+        block->state = BlockDone;
+        pthread_cond_broadcast(&pipeline->changed);
+    }
+    pthread_mutex_unlock(&pipeline->lock);
+    return NULL;
+}
+
+// Waits for the oldest outstanding block and writes it out
+static void writeOldestBlock(compressPipeline* pipeline) {
+    compressBlock* block = &pipeline->blocks[pipeline->written % pipeline->blockCount];
+    if (!pipeline->workers) {
+        deflateBlock(block);
+        block->state = BlockDone;
+    }
+    pthread_mutex_lock(&pipeline->lock);
+    while (block->state != BlockDone) pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+    pthread_mutex_unlock(&pipeline->lock);
+
+    if (block->failed || fwrite(block->output, 1, block->outputLength, pipeline->file) != block->outputLength) {
+        pipeline->failed = 1;
+    }
+    pipeline->bytesOut += block->outputLength;
+    block->state = BlockFree;
+    pipeline->written++;
+}
+
+static int flushToCompressor(void* context, const char* data, size_t length) {
+    compressPipeline* pipeline = context;
+    if (pipeline->submitted - pipeline->written == pipeline->blockCount) writeOldestBlock(pipeline);
+
+    compressBlock* block = &pipeline->blocks[pipeline->submitted % pipeline->blockCount];
+    memcpy(block->input, data, length);
+    block->inputLength = length;
+    pipeline->bytesIn += length;
+
+    pthread_mutex_lock(&pipeline->lock);
+    block->state = BlockQueued;
+    pipeline->submitted++;
+    pthread_cond_broadcast(&pipeline->changed);
+    pthread_mutex_unlock(&pipeline->lock);
+    return pipeline->failed ? -1 : 0;
+}
+
+void compressDirectory(node* folder, const char* filename) {
+    if (!folder) return;
+
+    FILE* file = fopen(filename, "wb");
+    if (!file) {
+        reportError("Error: Unable to create compressed file '%s'.\n", filename);
+        return;
+    }
+
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = online > 0 ? (int)online : 1;
+
+    // Two blocks per worker keep every thread busy while the oldest is written
+    compressPipeline pipeline;
+    memset(&pipeline, 0, sizeof(pipeline));
+    pthread_mutex_init(&pipeline.lock, NULL);
+    pthread_cond_init(&pipeline.changed, NULL);
+    pipeline.blockCount = 2 * threads;
+    pipeline.blocks = calloc(pipeline.blockCount, sizeof(compressBlock));
+    pipeline.file = file;
+
+    pthread_t* workers = malloc(threads * sizeof(pthread_t));
+    for (; pipeline.workers < (size_t)threads; pipeline.workers++) {
+        if (pthread_create(&workers[pipeline.workers], NULL, compressWorker, &pipeline) != 0) break;
+    }
+
+    // Serialize on this thread while the workers compress earlier blocks
+    byteSink* sink = calloc(1, sizeof(byteSink));
+    sink->flush = flushToCompressor;
+    sink->context = &pipeline;
+    writeSnapshot(folder, sink);
+    int failed = sink->failed;
+    free(sink);
+
+    while (pipeline.written < pipeline.submitted) writeOldestBlock(&pipeline);
+
+    pthread_mutex_lock(&pipeline.lock);
+    pipeline.stopping = 1;
+    pthread_cond_broadcast(&pipeline.changed);
+    pthread_mutex_unlock(&pipeline.lock);
+    for (size_t i = 0; i < pipeline.workers; i++) pthread_join(workers[i], NULL);
+    free(workers);
+
+    for (size_t i = 0; i < pipeline.blockCount; i++) free(pipeline.blocks[i].output);
+    free(pipeline.blocks);
+    pthread_cond_destroy(&pipeline.changed);
+    pthread_mutex_destroy(&pipeline.lock);
+
+    if (fclose(file) != 0 || failed || pipeline.failed) {
+        reportError("Error: Could not write compressed file '%s'.\n", filename);
+        return;
+    }
+    note("Directory compressed to '%s' (%zu -> %zu bytes, %d threads).\n",
+           filename, pipeline.bytesIn, pipeline.bytesOut, threads);
+}
+
+
+// Decompression (using zlib). A reader thread inflates into a ring of
+// buffers while this thread builds the tree from the ones already filled.
+#define INFLATE_BUFFERS 4
+
+typedef struct inflateBuffer {
+    char data[SINK_BUFFER_SIZE];
+    int length; // Bytes filled, 0 at end of stream, -1 on error
+    int full;
+} inflateBuffer;
+
+typedef struct inflatePipeline {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    inflateBuffer buffers[INFLATE_BUFFERS];
+    gzFile gz;
+    int stopping;
+} inflatePipeline;
+
+static void* inflateReader(void* argument) {
+    inflatePipeline* pipeline = argument;
+    for (size_t sequence = 0;; sequence++) {
+        inflateBuffer* buffer = &pipeline->buffers[sequence % INFLATE_BUFFERS];
+        pthread_mutex_lock(&pipeline->lock);
+        while (buffer->full && !pipeline->stopping) pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+        int stopping = pipeline->stopping;
+        pthread_mutex_unlock(&pipeline->lock);
+        if (stopping) break;
+
+        // gzread continues across gzip members on its own
+        int length = gzread(pipeline->gz, buffer->data, sizeof(buffer->data));
+
+        pthread_mutex_lock(&pipeline->lock);
+        buffer->length = length;
+        buffer->full = 1;
+        pthread_cond_broadcast(&pipeline->changed);
+        pthread_mutex_unlock(&pipeline->lock);
+        if (length <= 0) break;
+    }
+    return NULL;
+}
+
+node* decompressDirectory(const char* filename) {
+    gzFile gz = gzopen(filename, "rb");
+    if (!gz) {
+        reportError("Error: Unable to open compressed file '%s'.\n", filename);
+        return NULL;
+    }
+    gzbuffer(gz, SINK_BUFFER_SIZE);
+
+    inflatePipeline* pipeline = calloc(1, sizeof(inflatePipeline));
+    pthread_mutex_init(&pipeline->lock, NULL);
+    pthread_cond_init(&pipeline->changed, NULL);
+    pipeline->gz = gz;
+
+    // Without a reader thread each buffer is inflated here just before use
+    pthread_t reader;
+    int reading = pthread_create(&reader, NULL, inflateReader, pipeline) == 0;
+
+    snapshotBuilder builder;
+    memset(&builder, 0, sizeof(builder));
+    int failed = 0;
+    for (size_t sequence = 0;; sequence++) {
+        inflateBuffer* buffer = &pipeline->buffers[sequence % INFLATE_BUFFERS];
+        if (!reading) {
+            buffer->length = gzread(gz, buffer->data, sizeof(buffer->data));
+            buffer->full = 1;
+        }
+        pthread_mutex_lock(&pipeline->lock);
+        while (!buffer->full) pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+        pthread_mutex_unlock(&pipeline->lock);
+
+        int length = buffer->length;
+        if (length < 0 || (length > 0 && builderFeed(&builder, buffer->data, length) != 0)) failed = 1;
+
+        pthread_mutex_lock(&pipeline->lock);
+        buffer->full = 0;
+        pipeline->stopping = failed;
+        pthread_cond_broadcast(&pipeline->changed);
+        pthread_mutex_unlock(&pipeline->lock);
+        if (length <= 0 || failed) break;
+    }
+
+    if (reading) pthread_join(reader, NULL);
+    pthread_cond_destroy(&pipeline->changed);
+    pthread_mutex_destroy(&pipeline->lock);
+    free(pipeline);
+    gzclose(gz);
+
+    node* folder = builderFinish(&builder);
+    if (!folder) {
+        reportError("Error: '%s' is not a valid compressed directory.\n", filename);
+        return NULL;
+    }
+    note("Directory decompressed from '%s'.\n", filename);
+    return folder;
+}
+
+// Import. Worker threads scan a real directory tree with getdents64 and
+// statx, each folder a task on the scanning thread's own deque; idle
+// workers steal the oldest task from another deque. Workers only record
+// what they find in their own entry arena, because the tree pool is not
+// shared between threads. This thread then creates and links the nodes in
+// one pass and sums folder totals bottom-up, like the snapshot loader.
+#define IMPORT_BUFFER_SIZE (64 * 1024)
+
+// Record layout returned by getdents64
+typedef struct linuxDirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+} linuxDirent64;
+
+typedef struct importEntry {
+    uint32_t parent; // Folder number of the containing folder
+    uint32_t folder; // Own folder number, for folders
+    uint8_t type;
+    uint64_t size;
+    time_t date;
+    char* name;   // In the worker's string chunks
+    char* target; // Symlink target, likewise
+    nodeId built;
+} importEntry;
+
+typedef struct importTask {
+    char* path;
+    uint32_t folder;
+} importTask;
+
+typedef struct importWorker {
+    pthread_t thread;
+    struct importScan* scan;
+    pthread_mutex_t lock; // Guards the deque; the owner works at the tail, thieves at the head
+    importTask* tasks;
+    size_t head;
+    size_t tail;
+    size_t capacity;
+    importEntry* entries;
+    size_t entryCount;
+    size_t entryCapacity;
+    arenaChunk* strings;
+    unsigned long failures;
+    char* firstFailure;
+} importWorker;
+
+typedef struct importScan {
+    importWorker* workers;
+    size_t workerCount;
+    int recursive;       // Scan the folders found too, or only list them as stubs
+    uint32_t nextFolder; // Folder numbers handed out; 0 is the imported folder
+    size_t pending;      // Folders queued or being scanned
+} importScan;
+
+static void importPush(importWorker* worker, importTask task) {
+    pthread_mutex_lock(&worker->lock);
+    if (worker->tail == worker->capacity) {
+        // Reuse the space thieves freed at the head before growing
+        if (worker->head > 0) {
+            memmove(worker->tasks, worker->tasks + worker->head, (worker->tail - worker->head) * sizeof(importTask));
+            worker->tail -= worker->head;
+            worker->head = 0;
+        }
+        if (worker->tail * 2 >= worker->capacity) {
+            worker->capacity = worker->capacity ? 2 * worker->capacity : 64;
+            worker->tasks = realloc(worker->tasks, worker->capacity * sizeof(importTask));
+        }
+    }
+    worker->tasks[worker->tail++] = task;
+    pthread_mutex_unlock(&worker->lock);
+}
+
+// Newest task from the worker's own deque (depth first keeps it small)
+static int importPop(importWorker* worker, importTask* task) {
+    pthread_mutex_lock(&worker->lock);
+    int found = worker->tail > worker->head;
+    if (found) *task = worker->tasks[--worker->tail];
+    pthread_mutex_unlock(&worker->lock);
+    return found;
+}
+
+// Oldest task from some other deque; those are nearest the top of the tree
+static int importSteal(importWorker* thief, importTask* task) {
+    importScan* scan = thief->scan;
+    size_t self = thief - scan->workers;
+    for (size_t i = 1; i < scan->workerCount; i++) {
+        importWorker* victim = &scan->workers[(self + i) % scan->workerCount];
+        if (pthread_mutex_trylock(&victim->lock) != 0) continue;
+        int found = victim->tail > victim->head;
+        if (found) *task = victim->tasks[victim->head++];
+        pthread_mutex_unlock(&victim->lock);
+        if (found) return 1;
+    }
+    return 0;
+}
+
+static char* importString(importWorker* worker, const char* text, size_t length) {
+    arenaChunk* chunk = worker->strings;
+    if (!chunk || chunk->capacity - chunk->used < length + 1) {
+        size_t capacity = length + 1 > ARENA_CHUNK_SIZE ? length + 1 : ARENA_CHUNK_SIZE;
+        chunk = malloc(sizeof(arenaChunk) + capacity);
+        chunk->capacity = capacity;
+        chunk->used = 0;
+        chunk->next = worker->strings;
+        worker->strings = chunk;
+    }
+    char* copy = chunk->data + chunk->used;
+    memcpy(copy, text, length);
+    copy[length] = '\0';
+    chunk->used += length + 1;
+    return copy;
+}
+
+static void importFailure(importWorker* worker, const char* path, const char* name, int error) {
+    if (worker->failures++ > 0) return;
+    size_t length = strlen(path) + strlen(name) + strlen(strerror(error)) + 8;
+    worker->firstFailure = malloc(length);
+    snprintf(worker->firstFailure, length, "%s%s%s: %s", path, name[0] ? "/" : "", name, strerror(error));
+}
+
+static void importScanFolder(importWorker* worker, importTask* task, char* buffer) {
+    importScan* scan = worker->scan;
+    int fd = open(task->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        importFailure(worker, task->path, "", errno);
+        return;
+    }
+
+    for (;;) {
+        long length = syscall(SYS_getdents64, fd, buffer, IMPORT_BUFFER_SIZE);
+        if (length <= 0) {
+            if (length < 0) importFailure(worker, task->path, "", errno);
+            break;
+        }
+
+        for (long offset = 0; offset < length;) {
+            linuxDirent64* dirent = (linuxDirent64*)(buffer + offset);
+            offset += dirent->d_reclen;
+            const char* name = dirent->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+
+            struct statx info;
+            if (statx(fd, name, AT_SYMLINK_NOFOLLOW, STATX_TYPE | STATX_SIZE | STATX_MTIME, &info) != 0) {
+                importFailure(worker, task->path, name, errno);
+                continue;
+            }
+            enum nodeType type;
+            if (S_ISDIR(info.stx_mode)) type = Folder;
+            else if (S_ISREG(info.stx_mode)) type = File;
+            else if (S_ISLNK(info.stx_mode)) type = Symlink;
+            else continue; // Devices, sockets and pipes have no counterpart
+
+            if (worker->entryCount == worker->entryCapacity) {
+                worker->entryCapacity = worker->entryCapacity ? 2 * worker->entryCapacity : 1024;
+                worker->entries = realloc(worker->entries, worker->entryCapacity * sizeof(importEntry));
+            }
+            importEntry* entry = &worker->entries[worker->entryCount++];
+            size_t nameLength = strlen(name);
+            entry->parent = task->folder;
+            entry->folder = 0;
+            entry->type = type;
+            entry->size = type == File ? info.stx_size : 0;
+            entry->date = info.stx_mtime.tv_sec;
+            entry->name = importString(worker, name, nameLength);
+            entry->target = NULL;
+
+            if (type == Symlink) {
+                char target[MAX_PATH_LENGTH];
+                ssize_t targetLength = readlinkat(fd, name, target, sizeof(target));
+                if (targetLength >= 0) entry->target = importString(worker, target, (size_t)targetLength);
+            } else if (type == Folder) {
+                entry->folder = __atomic_fetch_add(&scan->nextFolder, 1, __ATOMIC_RELAXED);
+                if (!scan->recursive) continue;
+                size_t pathLength = strlen(task->path);
+                importTask child = {malloc(pathLength + nameLength + 2), entry->folder};
+                memcpy(child.path, task->path, pathLength);
+                child.path[pathLength] = '/';
+                memcpy(child.path + pathLength + 1, name, nameLength + 1);
+                __atomic_add_fetch(&scan->pending, 1, __ATOMIC_RELAXED);
+                importPush(worker, child);
+            }
+        }
+    }
+    close(fd);
+}
+
+static void* importWorkerMain(void* argument) {
+    importWorker* worker = argument;
+    char* buffer = malloc(IMPORT_BUFFER_SIZE);
+    for (;;) {
+        importTask task;
+        if (importPop(worker, &task) || importSteal(worker, &task)) {
+            importScanFolder(worker, &task, buffer);
+            free(task.path);
+            __atomic_sub_fetch(&worker->scan->pending, 1, __ATOMIC_RELEASE);
+        } else if (__atomic_load_n(&worker->scan->pending, __ATOMIC_ACQUIRE) == 0) {
+            break;
+        } else {
+            sched_yield();
+        }
+    }
+    free(buffer);
+    return NULL;
+}
+
+// Creates the nodes the workers found and links them under 'top'. Without
+// a recursive scan the folders found are left as stubs.
+static void importBuild(importScan* scan, node* top) {
+    uint32_t folderCount = scan->nextFolder;
+    node** folders = malloc(folderCount * sizeof(node*));
+    uint32_t* parents = malloc(folderCount * sizeof(uint32_t));
+    folders[0] = top;
+
+    for (size_t w = 0; w < scan->workerCount; w++) {
+        importWorker* worker = &scan->workers[w];
+        for (size_t i = 0; i < worker->entryCount; i++) {
+            importEntry* entry = &worker->entries[i];
+            node* item = createNode(entry->name, entry->type);
+            item->date = entry->date;
+            if (entry->type == Folder) {
+                folders[entry->folder] = item;
+                parents[entry->folder] = entry->parent;
+                if (!scan->recursive) {
+                    item->flags |= NODE_STUB;
+                    activePool->stubFolders++;
+                }
+            } else if (entry->type == File && entry->size > 0) {
+                poolAttachPayload(activePool, item);
+                fileOf(item)->size = entry->size;
+            } else if (entry->type == Symlink && entry->target) {
+                symlinkOf(item)->target = poolString(activePool, entry->target);
+            }
+            entry->built = idOf(item);
+        }
+    }
+
+    // Link everything, counting files and symlinks into their own folder
+    for (size_t w = 0; w < scan->workerCount; w++) {
+        importWorker* worker = &scan->workers[w];
+        for (size_t i = 0; i < worker->entryCount; i++) {
+            importEntry* entry = &worker->entries[i];
+            node* folder = folders[entry->parent];
+            linkChild(folder, nodeAt(entry->built));
+            if (entry->type != Folder) {
+                subtreeTotals* totals = &folderOf(folder)->totals;
+                totals->files += entry->type == File;
+                totals->symlinks += entry->type == Symlink;
+                totals->bytes += entry->size;
+            }
+        }
+    }
+
+    // A folder is numbered after its parent, so going backwards every
+    // folder is complete before it is added to its parent
+    for (uint32_t id = folderCount - 1; id > 0; id--) {
+        subtreeTotals delta = totalsOf(folders[id]);
+        subtreeTotals* totals = &folderOf(folders[parents[id]])->totals;
+        totals->files += delta.files;
+        totals->folders += delta.folders;
+        totals->symlinks += delta.symlinks;
+        totals->bytes += delta.bytes;
+    }
+    free(folders);
+    free(parents);
+}
+
+static void importScanInit(importScan* scan, size_t workerCount, const char* path, int recursive) {
+    scan->workerCount = workerCount;
+    scan->workers = calloc(workerCount, sizeof(importWorker));
+    scan->recursive = recursive;
+    scan->nextFolder = 1;
+    scan->pending = 1;
+    for (size_t i = 0; i < workerCount; i++) {
+        scan->workers[i].scan = scan;
+        pthread_mutex_init(&scan->workers[i].lock, NULL);
+    }
+    importPush(&scan->workers[0], (importTask){strdup(path), 0});
+}
+
+static void importScanFree(importScan* scan) {
+    for (size_t i = 0; i < scan->workerCount; i++) {
+        importWorker* worker = &scan->workers[i];
+        while (worker->strings) {
+            arenaChunk* next = worker->strings->next;
+            free(worker->strings);
+            worker->strings = next;
+        }
+        free(worker->entries);
+        free(worker->tasks);
+        free(worker->firstFailure);
+        pthread_mutex_destroy(&worker->lock);
+    }
+    free(scan->workers);
+}
+
+// Entries the scan found, and the failures it ran into
+static size_t importResults(importScan* scan, unsigned long* failures, const char** firstFailure) {
+    size_t entries = 0;
+    *failures = 0;
+    *firstFailure = NULL;
+    for (size_t i = 0; i < scan->workerCount; i++) {
+        importWorker* worker = &scan->workers[i];
+        entries += worker->entryCount;
+        *failures += worker->failures;
+        if (!*firstFailure) *firstFailure = worker->firstFailure;
+    }
+    return entries;
+}
+
+// Makes a new folder in 'destination' for a real directory and returns
+// it with the directory bound, or NULL with the error reported.
+// 'canonical' receives the resolved path, which the caller frees.
+static node* importTarget(node* destination, const char* realDirectory, char** canonical) {
+    struct stat info;
+    *canonical = realpath(realDirectory, NULL);
+    if (!*canonical || stat(*canonical, &info) != 0 || !S_ISDIR(info.st_mode)) {
+        reportError("Error: '%s' is not a readable directory.\n", realDirectory);
+        free(*canonical);
+        return NULL;
+    }
+    char* name = strrchr(*canonical, '/') + 1;
+    if (!*name) name = "root";
+    if (getNodeTypeless(destination, name)) {
+        reportError("'%s' already exists in the current directory!\n", name);
+        free(*canonical);
+        return NULL;
+    }
+
+    node* top = createNode(name, Folder);
+    top->date = info.st_mtime;
+    bindRealDirectory(top, *canonical);
+    return top;
+}
+
+node* importDirectory(node* destination, const char* realDirectory) {
+    char* canonical;
+    node* top = importTarget(destination, realDirectory, &canonical);
+    if (!top) return NULL;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    importScan scan;
+    importScanInit(&scan, online > 0 ? (size_t)online : 1, canonical, 1);
+
+    // Worker 0 runs here if no thread could be started for it
+    size_t started = 0;
+    for (; started < scan.workerCount; started++) {
+        importWorker* worker = &scan.workers[started];
+        if (pthread_create(&worker->thread, NULL, importWorkerMain, worker) != 0) break;
+    }
+    if (started == 0) importWorkerMain(&scan.workers[0]);
+    for (size_t i = 0; i < started; i++) pthread_join(scan.workers[i].thread, NULL);
+
+    importBuild(&scan, top);
+    appendChild(destination, top);
+
+    unsigned long failures;
+    const char* firstFailure;
+    size_t entries = importResults(&scan, &failures, &firstFailure);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    note("Imported %zu entries from '%s' into '%s' in %.3fs (%.0f entries/sec, %zu threads).\n",
+         entries, canonical, nameOf(top), seconds, seconds > 0 ? entries / seconds : 0.0, started ? started : 1);
+    if (failures > 0) {
+        reportError("Error: Could not read %lu entries while importing, the first was %s.\n", failures, firstFailure);
+    }
+
+    importScanFree(&scan);
+    free(canonical);
+    return top;
+}
+
+// Mounting. A mounted folder and every folder found below it start out as
+// stubs: nothing is read until a lookup or listing reaches inside, which
+// reads that one directory and adds its folders as new stubs. Totals only
+// cover what has been read so far.
+node* mountDirectory(node* destination, const char* realDirectory) {
+    char* canonical;
+    node* top = importTarget(destination, realDirectory, &canonical);
+    if (!top) return NULL;
+
+    top->flags |= NODE_STUB;
+    activePool->stubFolders++;
+    appendChild(destination, top);
+    note("Mounted '%s' as '%s'.\n", canonical, nameOf(top));
+    free(canonical);
+    return top;
+}
+
+void hydrateFolder(node* folder) {
+    folder->flags &= ~NODE_STUB;
+    activePool->stubFolders--;
+
+    char* path = realDirectoryOf(folder);
+    importScan scan;
+    importScanInit(&scan, 1, path, 0);
+    importWorkerMain(&scan.workers[0]);
+
+    // Only the children are new; pass their totals on to the ancestors
+    subtreeTotals before = folderOf(folder)->totals;
+    importBuild(&scan, folder);
+    subtreeTotals after = folderOf(folder)->totals;
+    subtreeTotals delta = {after.files - before.files, after.folders - before.folders,
+                           after.symlinks - before.symlinks, after.bytes - before.bytes};
+    propagateTotals(parentOf(folder), delta, 1);
+    watchHydrated(folder);
+
+    unsigned long failures;
+    const char* firstFailure;
+    importResults(&scan, &failures, &firstFailure);
+    if (failures > 0) reportError("Error: Could not read %lu entries in '%s', the first was %s.\n", failures, path, firstFailure);
+    importScanFree(&scan);
+    free(path);
+}
+
+// Find. Like import, every folder is a task on the deque of the worker
+// that found it, and idle workers steal the oldest task from another
+// deque. The tree is only read, so workers test the children of their
+// folders directly and write matching paths to a buffer of their own,
+// which goes out whole under the output lock.
+#define FIND_BUFFER_SIZE (64 * 1024)
+
+typedef struct findQuery {
+    const char* glob;     // -name, matched with fnmatch
+    size_t globLength;    // Fewest bytes a name must have to match it
+    int globExact;        // No '*' in the pattern, so exactly that many
+    char globFirst;       // A plain first character the name must start with, or 0
+    regex_t regex;        // -regex, searched for in the name
+    int hasRegex;
+    int type;             // -type as a nodeType, or -1
+    int sizeCompare;      // -size: 1 larger, -1 smaller, 0 equal, 2 not asked
+    uint64_t size;
+    int hasNewer;         // -newer
+    time_t newer;
+} findQuery;
+
+typedef struct findTask {
+    char* path;
+    nodeId folder;
+} findTask;
+
+typedef struct findWorker {
+    pthread_t thread;
+    struct findScan* scan;
+    pthread_mutex_t lock; // Guards the deque; the owner works at the tail, thieves at the head
+    findTask* tasks;
+    size_t head;
+    size_t tail;
+    size_t capacity;
+    char* output;
+    size_t used;
+    char* path; // Path of the child being tested
+    size_t pathCapacity;
+    size_t matches;
+    size_t unread; // Mounted folders not read yet, so not searched
+} findWorker;
+
+typedef struct findScan {
+    findWorker* workers;
+    size_t workerCount;
+    findQuery* query;
+    size_t pending; // Folders queued or being searched
+    pthread_mutex_t outputLock;
+} findScan;
+
+// What every name a glob matches must have, so most names are turned away
+// before fnmatch: enough bytes (exactly that many without a '*') and the
+// pattern's first character when it is a plain one
+static void findPrepareGlob(findQuery* query, const char* glob) {
+    size_t length = 0;
+    int star = 0;
+    for (const char* cursor = glob; *cursor; cursor++) {
+        if (*cursor == '*') {
+            star = 1;
+            continue;
+        }
+        if (*cursor == '[') {
+            // A ']' right after the '[' or '[!' is part of the set
+            const char* set = cursor + 1;
+            if (*set == '!' || *set == '^') set++;
+            if (*set == ']') set++;
+            const char* close = strchr(set, ']');
+            if (close) cursor = close;
+        } else if (*cursor == '\\' && cursor[1]) {
+            cursor++;
+        }
+        length++;
+    }
+    query->glob = glob;
+    query->globLength = length;
+    query->globExact = !star;
+    if (glob[0] == '\\' && glob[1]) query->globFirst = glob[1];
+    else query->globFirst = strchr("*?[", glob[0]) ? 0 : glob[0];
+}
+
+// Reads a -size argument: bytes, or with a k, M or G suffix, and a leading
+// '+' or '-' for larger or smaller than that
+static int findParseSize(findQuery* query, const char* text) {
+    query->sizeCompare = *text == '+' ? 1 : *text == '-' ? -1 : 0;
+    if (query->sizeCompare != 0) text++;
+    if (*text < '0' || *text > '9') return -1;
+    char* end;
+    errno = 0;
+    unsigned long long size = strtoull(text, &end, 10);
+    unsigned int shift = 0;
+    if (*end == 'k') shift = 10;
+    else if (*end == 'M') shift = 20;
+    else if (*end == 'G') shift = 30;
+    if (shift) end++;
+    if (*end != '\0' || errno == ERANGE || size > (UINT64_MAX >> shift)) return -1;
+    query->size = (uint64_t)size << shift;
+    return 0;
+}
+
+// Reads a -newer argument: a local date as YYYY-MM-DD with an optional
+// THH:MM[:SS], or else the path of an entry whose date to compare with
+static int findParseDate(findQuery* query, const char* text, node* currentFolder, node* root) {
+    static const char* formats[] = {"%Y-%m-%dT%H:%M:%S", "%Y-%m-%dT%H:%M", "%Y-%m-%d"};
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+        struct tm dateTime;
+        memset(&dateTime, 0, sizeof(dateTime));
+        const char* end = strptime(text, formats[i], &dateTime);
+        if (end && *end == '\0') {
+            dateTime.tm_isdst = -1;
+            query->newer = mktime(&dateTime);
+            return 0;
+        }
+    }
+    node* reference = parsePath(currentFolder, text, root);
+    if (!reference) return -1;
+    query->newer = reference->date;
+    return 0;
+}
+
+static void findQueryFree(findQuery* query) {
+    if (query->hasRegex) regfree(&query->regex);
+}
+
+// Fills 'query' from the tests after the path; reports what it cannot use
+static int findParseQuery(findQuery* query, char** tests, size_t testCount, node* currentFolder, node* root) {
+    memset(query, 0, sizeof(findQuery));
+    query->type = -1;
+    query->sizeCompare = 2;
+    for (size_t i = 0; i < testCount; i += 2) {
+        const char* test = tests[i];
+        const char* value = i + 1 < testCount ? tests[i + 1] : NULL;
+        if (!value) {
+            reportError("Error: '%s' needs a value.\n", test);
+            break;
+        } else if (strcmp(test, "-name") == 0) {
+            findPrepareGlob(query, value);
+            continue;
+        } else if (strcmp(test, "-regex") == 0) {
+            if (query->hasRegex) regfree(&query->regex);
+            query->hasRegex = regcomp(&query->regex, value, REG_EXTENDED | REG_NOSUB) == 0;
+            if (query->hasRegex) continue;
+            reportError("Error: '%s' is not a valid regular expression.\n", value);
+        } else if (strcmp(test, "-type") == 0) {
+            query->type = strcmp(value, "f") == 0 ? File : strcmp(value, "d") == 0 ? Folder : strcmp(value, "l") == 0 ? Symlink : -1;
+            if (query->type >= 0) continue;
+            reportError("Error: -type takes f, d or l.\n");
+        } else if (strcmp(test, "-size") == 0) {
+            if (findParseSize(query, value) == 0) continue;
+            reportError("Error: '%s' is not a size.\n", value);
+        } else if (strcmp(test, "-newer") == 0) {
+            query->hasNewer = findParseDate(query, value, currentFolder, root) == 0;
+            if (query->hasNewer) continue;
+            reportError("Error: '%s' is neither a date (YYYY-MM-DD[THH:MM]) nor an entry.\n", value);
+        } else {
+            reportError("Error: Usage: find [path] [-name glob] [-regex re] [-type f|d|l] [-size [+|-]N[k|M|G]] [-newer date|path]\n");
+        }
+        findQueryFree(query);
+        return -1;
+    }
+    if (testCount % 2 != 0) {
+        findQueryFree(query);
+        return -1;
+    }
+    return 0;
+}
+
+// Cheap tests first; the name is only looked at when the rest pass
+static int findMatches(findQuery* query, node* item) {
+    if (query->type >= 0 && item->type != query->type) return 0;
+    if (query->sizeCompare != 2) {
+        if (item->type != File) return 0;
+        uint64_t size = nodeSize(item);
+        if (query->sizeCompare > 0 ? size <= query->size : query->sizeCompare < 0 ? size >= query->size : size != query->size) return 0;
+    }
+    if (query->hasNewer && item->date <= query->newer) return 0;
+    const char* name = nameOf(item);
+    if (query->glob) {
+        if (query->globFirst && name[0] != query->globFirst) return 0;
+        size_t length = strlen(name);
+        if (length < query->globLength || (query->globExact && length != query->globLength)) return 0;
+        if (fnmatch(query->glob, name, 0) != 0) return 0;
+    }
+    if (query->hasRegex && regexec(&query->regex, name, 0, NULL, 0) != 0) return 0;
+    return 1;
+}
+
+static void findFlush(findWorker* worker) {
+    if (worker->used == 0) return;
+    pthread_mutex_lock(&worker->scan->outputLock);
+    flushToOutput(NULL, worker->output, worker->used);
+    pthread_mutex_unlock(&worker->scan->outputLock);
+    worker->used = 0;
+}
+
+static void findEmit(findWorker* worker, const char* path, size_t length) {
+    if (worker->used + length + 1 > FIND_BUFFER_SIZE) findFlush(worker);
+    if (length + 1 > FIND_BUFFER_SIZE) {
+        // Longer than the whole buffer, so it goes out on its own
+        pthread_mutex_lock(&worker->scan->outputLock);
+        flushToOutput(NULL, path, length);
+        flushToOutput(NULL, "\n", 1);
+        pthread_mutex_unlock(&worker->scan->outputLock);
+    } else {
+        memcpy(worker->output + worker->used, path, length);
+        worker->output[worker->used + length] = '\n';
+        worker->used += length + 1;
+    }
+    worker->matches++;
+}
+
+static void findPush(findWorker* worker, findTask task) {
+    pthread_mutex_lock(&worker->lock);
+    if (worker->tail == worker->capacity) {
+        // Reuse the space thieves freed at the head before growing
+        if (worker->head > 0) {
+            memmove(worker->tasks, worker->tasks + worker->head, (worker->tail - worker->head) * sizeof(findTask));
+            worker->tail -= worker->head;
+            worker->head = 0;
+        }
+        if (worker->tail * 2 >= worker->capacity) {
+            worker->capacity = worker->capacity ? 2 * worker->capacity : 64;
+            worker->tasks = realloc(worker->tasks, worker->capacity * sizeof(findTask));
+        }
+    }
+    worker->tasks[worker->tail++] = task;
+    pthread_mutex_unlock(&worker->lock);
+}
+
+static int findPop(findWorker* worker, findTask* task) {
+    pthread_mutex_lock(&worker->lock);
+    int found = worker->tail > worker->head;
+    if (found) *task = worker->tasks[--worker->tail];
+    pthread_mutex_unlock(&worker->lock);
+    return found;
+}
+
+static int findSteal(findWorker* thief, findTask* task) {
+    findScan* scan = thief->scan;
+    size_t self = thief - scan->workers;
+    for (size_t i = 1; i < scan->workerCount; i++) {
+        findWorker* victim = &scan->workers[(self + i) % scan->workerCount];
+        if (pthread_mutex_trylock(&victim->lock) != 0) continue;
+        int found = victim->tail > victim->head;
+        if (found) *task = victim->tasks[victim->head++];
+        pthread_mutex_unlock(&victim->lock);
+        if (found) return 1;
+    }
+    return 0;
+}
+
+// Tests every child of one folder and queues its subfolders
+static void findSearchFolder(findWorker* worker, findTask* task) {
+    size_t pathLength = strlen(task->path);
+    size_t prefix = pathLength > 0 && task->path[pathLength - 1] == '/' ? pathLength : pathLength + 1;
+    for (node* child = firstChildOf(nodeAt(task->folder)); child; child = nextOf(child)) {
+        const char* name = nameOf(child);
+        size_t nameLength = strlen(name);
+        if (prefix + nameLength + 1 > worker->pathCapacity) {
+            worker->pathCapacity = 2 * (prefix + nameLength + 1);
+            worker->path = realloc(worker->path, worker->pathCapacity);
+        }
+        memcpy(worker->path, task->path, pathLength);
+        worker->path[prefix - 1] = '/';
+        memcpy(worker->path + prefix, name, nameLength + 1);
+
+        if (findMatches(worker->scan->query, child)) findEmit(worker, worker->path, prefix + nameLength);
+        if (child->type != Folder) continue;
+        if (child->flags & NODE_STUB) {
+            worker->unread++;
+        } else if (firstChildOf(child)) {
+            __atomic_add_fetch(&worker->scan->pending, 1, __ATOMIC_RELAXED);
+            findPush(worker, (findTask){strdup(worker->path), idOf(child)});
+        }
+    }
+}
+
+static void* findWorkerMain(void* argument) {
+    findWorker* worker = argument;
+    for (;;) {
+        findTask task;
+        if (findPop(worker, &task) || findSteal(worker, &task)) {
+            findSearchFolder(worker, &task);
+            free(task.path);
+            __atomic_sub_fetch(&worker->scan->pending, 1, __ATOMIC_RELEASE);
+        } else if (__atomic_load_n(&worker->scan->pending, __ATOMIC_ACQUIRE) == 0) {
+            break;
+        } else {
+            sched_yield();
+        }
+    }
+    findFlush(worker);
+    return NULL;
+}
+
+// Prints the path of every entry at or below 'path' that passes all the
+// tests, in no particular order once more than one core searches
+size_t findNodes(node* currentFolder, node* root, const char* path, char** tests, size_t testCount) {
+    node* start = parsePath(currentFolder, path, root);
+    if (!start) return 0;
+    findQuery query;
+    if (findParseQuery(&query, tests, testCount, currentFolder, root) != 0) return 0;
+
+    fflush(stdout); // Keep order with what printf has buffered
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    findScan scan;
+    scan.workerCount = online > 0 ? (size_t)online : 1;
+    scan.workers = calloc(scan.workerCount, sizeof(findWorker));
+    scan.query = &query;
+    scan.pending = 0;
+    pthread_mutex_init(&scan.outputLock, NULL);
+    for (size_t i = 0; i < scan.workerCount; i++) {
+        scan.workers[i].scan = &scan;
+        scan.workers[i].output = malloc(FIND_BUFFER_SIZE);
+        pthread_mutex_init(&scan.workers[i].lock, NULL);
+    }
+
+    // The starting entry is tested here; a folder then becomes the first task
+    findWorker* first = &scan.workers[0];
+    if (findMatches(&query, start)) findEmit(first, path, strlen(path));
+    if (start->flags & NODE_STUB) hydrateFolder(start); // Asked for by name, so read it
+    if (start->type == Folder && firstChildOf(start)) {
+        scan.pending = 1;
+        findPush(first, (findTask){strdup(path), idOf(start)});
+    }
+
+    // Worker 0 runs here if no thread could be started for it
+    size_t started = 0;
+    if (scan.pending > 0) {
+        for (; started < scan.workerCount; started++) {
+            findWorker* worker = &scan.workers[started];
+            if (pthread_create(&worker->thread, NULL, findWorkerMain, worker) != 0) break;
+        }
+    }
+    if (started == 0) findWorkerMain(first);
+    for (size_t i = 0; i < started; i++) pthread_join(scan.workers[i].thread, NULL);
+
+    size_t matches = 0;
+    size_t unread = 0;
+    for (size_t i = 0; i < scan.workerCount; i++) {
+        findWorker* worker = &scan.workers[i];
+        matches += worker->matches;
+        unread += worker->unread;
+        free(worker->output);
+        free(worker->path);
+        free(worker->tasks);
+        pthread_mutex_destroy(&worker->lock);
+    }
+    free(scan.workers);
+    pthread_mutex_destroy(&scan.outputLock);
+    findQueryFree(&query);
+    if (unread > 0) note("%zu folders not read from disk yet were not searched.\n", unread);
+    return matches;
+}
+
+// Locate. Every name is indexed under each run of three bytes in it, in
+// one open-addressed table per shard of trigrams. The index is built on
+// the first locate, and again after a load, by workers that take a range
+// of node ids each and then a shard each, so every posting list comes out
+// in id order. From then on setNodeName only notes which node it named,
+// and those are added before the next query. Nothing is taken out when a
+// node goes away: candidates are checked against the live tree instead,
+// and a list drops its stale ids whenever it has to be sorted again.
+#define TRIGRAM_SHARDS 64
+#define TRIGRAM_INITIAL_CAPACITY 64
+
+typedef struct trigramList {
+    uint32_t key; // The three bytes, first one highest; 0 marks a free slot
+    int unsorted; // Ids were added out of order since it was last sorted
+    nodeId* ids;
+    size_t count;
+    size_t capacity;
+} trigramList;
+
+typedef struct trigramShard {
+    trigramList* lists;
+    size_t capacity;
+    size_t used;
+} trigramShard;
+
+typedef struct trigramIndex {
+    int built;
+    trigramShard shards[TRIGRAM_SHARDS];
+    nodeId* named; // Named since the last query
+    size_t namedCount;
+    size_t namedCapacity;
+} trigramIndex;
+
+static trigramIndex trigrams;
+
+// A node id and one trigram of its name, as the build passes them between phases
+typedef struct trigramPosting {
+    uint32_t key;
+    nodeId item;
+} trigramPosting;
+
+typedef struct trigramWorker {
+    pthread_t thread;
+    struct trigramBuild* build;
+    nodeId first; // Range of node ids this worker reads
+    nodeId last;
+    trigramPosting* postings[TRIGRAM_SHARDS];
+    size_t counts[TRIGRAM_SHARDS];
+    size_t capacities[TRIGRAM_SHARDS];
+} trigramWorker;
+
+typedef struct trigramBuild {
+    trigramWorker* workers;
+    size_t workerCount;
+    size_t nextShard; // Shards handed out in the second phase
+} trigramBuild;
+
+static inline uint32_t trigramKey(const char* text) {
+    return (uint32_t)(unsigned char)text[0] << 16 | (uint32_t)(unsigned char)text[1] << 8 | (unsigned char)text[2];
+}
+
+static inline uint32_t trigramMix(uint32_t key) {
+    return key * 2654435761u;
+}
+
+static inline trigramShard* trigramShardOf(uint32_t key) {
+    return &trigrams.shards[trigramMix(key) % TRIGRAM_SHARDS];
+}
+
+static trigramList* trigramSlot(trigramShard* shard, uint32_t key) {
+    size_t mask = shard->capacity - 1;
+    for (size_t slot = (trigramMix(key) / TRIGRAM_SHARDS) & mask;; slot = (slot + 1) & mask) {
+        trigramList* list = &shard->lists[slot];
+        if (list->key == key || list->key == 0) return list;
+    }
+}
+
+static trigramList* trigramFind(uint32_t key) {
+    trigramShard* shard = trigramShardOf(key);
+    if (shard->capacity == 0) return NULL;
+    trigramList* list = trigramSlot(shard, key);
+    return list->key ? list : NULL;
+}
+
+static trigramList* trigramOpen(trigramShard* shard, uint32_t key) {
+    if (shard->capacity == 0 || (shard->used + 1) * 4 > shard->capacity * 3) {
+        trigramShard grown;
+        grown.capacity = shard->capacity ? 2 * shard->capacity : TRIGRAM_INITIAL_CAPACITY;
+        grown.lists = calloc(grown.capacity, sizeof(trigramList));
+        grown.used = shard->used;
+        for (size_t i = 0; i < shard->capacity; i++) {
+            if (shard->lists[i].key) *trigramSlot(&grown, shard->lists[i].key) = shard->lists[i];
+        }
+        free(shard->lists);
+        *shard = grown;
+    }
+    trigramList* list = trigramSlot(shard, key);
+    if (list->key == 0) {
+        list->key = key;
+        shard->used++;
+    }
+    return list;
+}
+
+static void trigramAppend(trigramList* list, nodeId item) {
+    if (list->count > 0 && list->ids[list->count - 1] >= item) {
+        if (list->ids[list->count - 1] == item) return; // The name has this trigram twice
+        list->unsorted = 1;
+    }
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? 2 * list->capacity : 4;
+        list->ids = realloc(list->ids, list->capacity * sizeof(nodeId));
+    }
+    list->ids[list->count++] = item;
+}
+
+// Node ids handed out so far; slots past the newest slab's last node were never used
+static size_t trigramSlots() {
+    return (activePool->slabCount ? activePool->slabCount - 1 : 0) * NODES_PER_SLAB + activePool->slabUsed;
+}
+
+static void* trigramCollect(void* argument) {
+    trigramWorker* worker = argument;
+    for (nodeId id = worker->first > NO_NODE ? worker->first : 1; id < worker->last; id++) {
+        node* item = nodeAt(id);
+        if (item->flags & NODE_FREED) continue;
+        const char* name = nameOf(item);
+        for (size_t i = 0; name[i] && name[i + 1] && name[i + 2]; i++) {
+            uint32_t key = trigramKey(name + i);
+            size_t shard = trigramMix(key) % TRIGRAM_SHARDS;
+            if (worker->counts[shard] == worker->capacities[shard]) {
+                worker->capacities[shard] = worker->capacities[shard] ? 2 * worker->capacities[shard] : 256;
+                worker->postings[shard] = realloc(worker->postings[shard], worker->capacities[shard] * sizeof(trigramPosting));
+            }
+            worker->postings[shard][worker->counts[shard]++] = (trigramPosting){key, id};
+        }
+    }
+    return NULL;
+}
+
+// Workers' ranges follow each other, so taking them in order keeps every
+// list in id order
+static void* trigramFill(void* argument) {
+    trigramWorker* self = argument;
+    trigramBuild* build = self->build;
+    for (;;) {
+        size_t shard = __atomic_fetch_add(&build->nextShard, 1, __ATOMIC_RELAXED);
+        if (shard >= TRIGRAM_SHARDS) break;
+        for (size_t w = 0; w < build->workerCount; w++) {
+            trigramWorker* worker = &build->workers[w];
+            for (size_t i = 0; i < worker->counts[shard]; i++) {
+                trigramPosting* posting = &worker->postings[shard][i];
+                trigramAppend(trigramOpen(&trigrams.shards[shard], posting->key), posting->item);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Runs 'work' on every worker, here for those no thread could be started for
+static void trigramRun(trigramBuild* build, void* (*work)(void*)) {
+    size_t started = 0;
+    for (; started < build->workerCount; started++) {
+        if (pthread_create(&build->workers[started].thread, NULL, work, &build->workers[started]) != 0) break;
+    }
+    for (size_t i = started; i < build->workerCount; i++) work(&build->workers[i]);
+    for (size_t i = 0; i < started; i++) pthread_join(build->workers[i].thread, NULL);
+}
+
+void trigramReset() {
+    for (size_t s = 0; s < TRIGRAM_SHARDS; s++) {
+        trigramShard* shard = &trigrams.shards[s];
+        for (size_t i = 0; i < shard->capacity; i++) free(shard->lists[i].ids);
+        free(shard->lists);
+        memset(shard, 0, sizeof(trigramShard));
+    }
+    trigrams.namedCount = 0;
+    trigrams.built = 0;
+}
+
+// Indexes every name in the active pool, one range of node ids per core
+void trigramBuildIndex() {
+    trigramReset();
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    trigramBuild build;
+    build.workerCount = online > 0 ? (size_t)online : 1;
+    build.workers = calloc(build.workerCount, sizeof(trigramWorker));
+    build.nextShard = 0;
+    size_t slots = trigramSlots();
+    size_t range = (slots + build.workerCount - 1) / build.workerCount;
+    for (size_t w = 0; w < build.workerCount; w++) {
+        build.workers[w].build = &build;
+        build.workers[w].first = (nodeId)(w * range < slots ? w * range : slots);
+        build.workers[w].last = (nodeId)((w + 1) * range < slots ? (w + 1) * range : slots);
+    }
+
+    trigramRun(&build, trigramCollect);
+    trigramRun(&build, trigramFill);
+    for (size_t w = 0; w < build.workerCount; w++) {
+        for (size_t s = 0; s < TRIGRAM_SHARDS; s++) free(build.workers[w].postings[s]);
+    }
+    free(build.workers);
+    trigrams.built = 1;
+}
+
+// Called by setNodeName; only a built index keeps track
+void trigramNoteName(node* item) {
+    if (!trigrams.built) return;
+    if (trigrams.namedCount == trigrams.namedCapacity) {
+        trigrams.namedCapacity = trigrams.namedCapacity ? 2 * trigrams.namedCapacity : 256;
+        trigrams.named = realloc(trigrams.named, trigrams.namedCapacity * sizeof(nodeId));
+    }
+    trigrams.named[trigrams.namedCount++] = idOf(item);
+}
+
+static int compareNodeIds(const void* a, const void* b) {
+    nodeId left = *(const nodeId*)a;
+    nodeId right = *(const nodeId*)b;
+    return left < right ? -1 : left > right;
+}
+
+// Sorts a list that had ids added out of order, dropping repeats and ids
+// whose node is gone or no longer has this trigram in its name
+static void trigramSortList(trigramList* list) {
+    if (!list->unsorted) return;
+    qsort(list->ids, list->count, sizeof(nodeId), compareNodeIds);
+    char key[3] = {(char)(list->key >> 16), (char)(list->key >> 8), (char)list->key};
+    size_t kept = 0;
+    for (size_t i = 0; i < list->count; i++) {
+        nodeId id = list->ids[i];
+        if (kept > 0 && list->ids[kept - 1] == id) continue;
+        node* item = nodeAt(id);
+        const char* name = nameOf(item);
+        if ((item->flags & NODE_FREED) || !memmem(name, strlen(name), key, sizeof(key))) continue;
+        list->ids[kept++] = id;
+    }
+    list->count = kept;
+    list->unsorted = 0;
+}
+
+// Adds the names given since the last query
+static void trigramCatchUp() {
+    for (size_t n = 0; n < trigrams.namedCount; n++) {
+        node* item = nodeAt(trigrams.named[n]);
+        if (item->flags & NODE_FREED) continue;
+        const char* name = nameOf(item);
+        for (size_t i = 0; name[i] && name[i + 1] && name[i + 2]; i++) {
+            uint32_t key = trigramKey(name + i);
+            trigramAppend(trigramOpen(trigramShardOf(key), key), trigrams.named[n]);
+        }
+    }
+    trigrams.namedCount = 0;
+}
+
+static int compareListLengths(const void* a, const void* b) {
+    size_t left = (*(trigramList* const*)a)->count;
+    size_t right = (*(trigramList* const*)b)->count;
+    return left < right ? -1 : left > right;
+}
+
+// Keeps the candidates that 'list' holds too; both are in id order, so
+// each candidate is searched for from where the previous one was found
+static size_t trigramIntersect(nodeId* candidates, size_t count, trigramList* list) {
+    size_t kept = 0;
+    size_t low = 0;
+    for (size_t i = 0; i < count && low < list->count; i++) {
+        size_t high = list->count;
+        while (low < high) {
+            size_t middle = low + (high - low) / 2;
+            if (list->ids[middle] < candidates[i]) low = middle + 1;
+            else high = middle;
+        }
+        if (low < list->count && list->ids[low] == candidates[i]) candidates[kept++] = candidates[i];
+    }
+    return kept;
+}
+
+// A match must still be in the tree, not in a subtree that was taken out
+// and is kept for a rollback
+static int locateInTree(node* item, node* root) {
+    while (item->parent) item = parentOf(item);
+    return item == root;
+}
+
+static void locateEmit(node* item, node* root, const char* text, size_t* matches) {
+    if ((item->flags & NODE_FREED) || !strstr(nameOf(item), text) || !locateInTree(item, root)) return;
+    char* path = nodePath(item);
+    listText(path);
+    listText("\n");
+    free(path);
+    (*matches)++;
+}
+
+// Prints the path of every entry whose name contains 'text'
+void locate(node* root, const char* text) {
+    if (!trigrams.built) trigramBuildIndex();
+    trigramCatchUp();
+    listingBegin();
+    size_t length = strlen(text);
+    size_t matches = 0;
+
+    if (length < 3) {
+        // Too short for a trigram, so every name is read
+        size_t slots = trigramSlots();
+        for (nodeId id = 1; id < slots; id++) locateEmit(nodeAt(id), root, text, &matches);
+    } else {
+        // Shortest list first, so the candidates only shrink
+        size_t listCount = length - 2;
+        trigramList** lists = malloc(listCount * sizeof(trigramList*));
+        int missing = 0;
+        for (size_t i = 0; i < listCount && !missing; i++) {
+            lists[i] = trigramFind(trigramKey(text + i));
+            if (!lists[i]) missing = 1;
+            else trigramSortList(lists[i]);
+        }
+        if (!missing) {
+            qsort(lists, listCount, sizeof(trigramList*), compareListLengths);
+            nodeId* candidates = malloc((lists[0]->count + 1) * sizeof(nodeId));
+            memcpy(candidates, lists[0]->ids, lists[0]->count * sizeof(nodeId));
+            size_t count = lists[0]->count;
+            for (size_t i = 1; i < listCount && count > 0; i++) count = trigramIntersect(candidates, count, lists[i]);
+            for (size_t i = 0; i < count; i++) locateEmit(nodeAt(candidates[i]), root, text, &matches);
+            free(candidates);
+        }
+        free(lists);
+    }
+
+    sinkFlush(&listingSink);
+    if (matches == 0) note("No names contain '%s'.\n", text);
+}
+
+// Watching. Each watched subtree has its own inotify instance, so when
+// the kernel queue overflows only that subtree has to be read again.
+// Events are only hints: before each command the waiting ones are read in
+// one batch and every name they mention is compared with what is on disk
+// now, which also makes repeated events for one name cost a single stat.
+// Rename pairs within a batch move the existing node instead.
+#define WATCH_BUFFER_SIZE (64 * 1024)
+#define WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | \
+                      IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+
+typedef struct watchRoot {
+    int fd;
+    nodeId top;
+    nodeId* folders; // Folder of each watch descriptor, NO_NODE once dropped
+    size_t capacity;
+    size_t watches;
+    int overflowed;
+    struct watchRoot* next;
+} watchRoot;
+
+typedef struct watchEvent {
+    watchRoot* root;
+    int wd;
+    uint32_t mask;
+    uint32_t cookie;
+    size_t name; // Offset into the batch's names
+} watchEvent;
+
+typedef struct watchBatch {
+    watchEvent* events;
+    size_t count;
+    size_t capacity;
+    char* names;
+    size_t namesUsed;
+    size_t namesCapacity;
+    char* buffer;
+    shellState* shell; // Moved out of folders that disappear
+    int moved;         // The shell's path may have changed
+    uint64_t applied;
+    uint64_t batches;
+    uint64_t rescans;
+} watchBatch;
+
+static watchBatch watching;
+
+static void watchReconcile(watchRoot* root, node* folder, const char* name);
+
+// Drops a node that is gone from disk, taking the shell out of it first
+static void watchRemove(node* item) {
+    shellState* shell = watching.shell;
+    if (item->type == Folder && isWithin(shell->currentFolder, item)) {
+        shell->currentFolder = parentOf(item);
+        watching.moved = 1;
+    }
+    removeNode(item);
+    discardNode(item);
+}
+
+static void watchFolder(watchRoot* root, node* folder) {
+    folderRecord* record = folderOf(folder);
+    if (record->watcher) return;
+    char* path = realDirectoryOf(folder);
+    int wd = inotify_add_watch(root->fd, path, WATCH_EVENTS);
+    if (wd < 0) {
+        reportError("Error: Could not watch '%s': %s\n", path, strerror(errno));
+        free(path);
+        return;
+    }
+    free(path);
+    if ((size_t)wd >= root->capacity) {
+        size_t capacity = root->capacity ? 2 * root->capacity : 64;
+        while (capacity <= (size_t)wd) capacity *= 2;
+        root->folders = realloc(root->folders, capacity * sizeof(nodeId));
+        memset(root->folders + root->capacity, 0, (capacity - root->capacity) * sizeof(nodeId));
+        root->capacity = capacity;
+    }
+    root->folders[wd] = idOf(folder);
+    root->watches++;
+    record->watcher = root;
+    record->watch = wd;
+}
+
+// Watches 'folder' and every folder below it that has been read; stubs
+// are watched when they are read
+static void watchSubtree(watchRoot* root, node* folder) {
+    if (folder->flags & NODE_STUB) return;
+    watchFolder(root, folder);
+    for (node* child = firstChildOf(folder); child; child = nextOf(child)) {
+        if (child->type == Folder) watchSubtree(root, child);
+    }
+}
+
+void unwatchFolder(node* folder) {
+    folderRecord* record = folderOf(folder);
+    watchRoot* root = record->watcher;
+    if (!root) return;
+    inotify_rm_watch(root->fd, record->watch);
+    root->folders[record->watch] = NO_NODE;
+    root->watches--;
+    record->watcher = NULL;
+    record->watch = 0;
+}
+
+// A child read for the first time inside a watched folder is watched too
+void watchHydrated(node* folder) {
+    node* parent = parentOf(folder);
+    if (parent && folderOf(parent)->watcher) watchFolder(folderOf(parent)->watcher, folder);
+}
+
+static void freeWatchRoot(watchRoot* root) {
+    close(root->fd);
+    free(root->folders);
+    free(root);
+}
+
+void releaseWatches(treePool* pool) {
+    while (pool->watchers) {
+        watchRoot* next = pool->watchers->next;
+        freeWatchRoot(pool->watchers);
+        pool->watchers = next;
+    }
+}
+
+// Stops every watch on the active tree
+void unwatchAll() {
+    for (watchRoot* root = activePool->watchers; root; root = root->next) {
+        for (size_t wd = 0; wd < root->capacity; wd++) {
+            if (root->folders[wd]) {
+                folderRecord* record = folderOf(nodeAt(root->folders[wd]));
+                record->watcher = NULL;
+                record->watch = 0;
+            }
+        }
+    }
+    releaseWatches(activePool);
+}
+
+// Drops roots whose whole subtree was removed
+static void sweepWatchRoots() {
+    watchRoot** link = &activePool->watchers;
+    while (*link) {
+        watchRoot* root = *link;
+        if (root->watches == 0) {
+            *link = root->next;
+            freeWatchRoot(root);
+        } else {
+            link = &root->next;
+        }
+    }
+}
+
+void watchDirectory(node* folder) {
+    if (folderOf(folder)->watcher) {
+        reportError("Error: '%s' is already watched.\n", nameOf(folder));
+        return;
+    }
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) {
+        reportError("Error: Could not start watching: %s\n", strerror(errno));
+        return;
+    }
+    watchRoot* root = calloc(1, sizeof(watchRoot));
+    root->fd = fd;
+    root->top = idOf(folder);
+    root->next = activePool->watchers;
+    activePool->watchers = root;
+
+    if (folder->flags & NODE_STUB) hydrateFolder(folder);
+    mirrorWait(); // Folders made in the shell must exist before they can be watched
+    watchSubtree(root, folder);
+    note("Watching %zu folders under '%s'.\n", root->watches, nameOf(folder));
+    sweepWatchRoots();
+}
+
+static node* watchedFolder(watchRoot* root, int wd) {
+    return wd >= 0 && (size_t)wd < root->capacity ? nodeAt(root->folders[wd]) : NULL;
+}
+
+// Whether the real file holds exactly the content kept for 'file', so our
+// own writes do not throw away what the shell knows about it
+static int realFileMatches(const char* path, node* file) {
+    FILE* real = fopen(path, "rb");
+    if (!real) return 0;
+    size_t size = nodeSize(file);
+    char* expected = malloc(EXTENT_SIZE);
+    char* buffer = malloc(EXTENT_SIZE);
+    int matches = 1;
+    for (size_t offset = 0; matches && offset < size; offset += EXTENT_SIZE) {
+        size_t piece = size - offset < EXTENT_SIZE ? size - offset : EXTENT_SIZE;
+        contentLoad(file, offset, expected, piece);
+        matches = fread(buffer, 1, piece, real) == piece && memcmp(buffer, expected, piece) == 0;
+    }
+    if (matches) matches = fgetc(real) == EOF;
+    free(expected);
+    free(buffer);
+    fclose(real);
+    return matches;
+}
+
+// Reads a folder that appeared on disk, with everything in it
+static node* watchScanFolder(watchRoot* root, node* parent, const char* name, const char* path, time_t date) {
+    node* item = createNode(name, Folder);
+    item->date = date;
+    importScan scan;
+    importScanInit(&scan, 1, path, 1);
+    importWorkerMain(&scan.workers[0]);
+    importBuild(&scan, item);
+    importScanFree(&scan);
+    appendChild(parent, item);
+    watchSubtree(root, item);
+    return item;
+}
+
+// Makes the child 'name' of a watched folder match the real filesystem
+static void watchReconcile(watchRoot* root, node* folder, const char* name) {
+    if (folder->flags & NODE_STUB) return; // Read when it is first opened
+    node* item = indexLookup(folder, name);
+    char* path = realPathOf(folder, name);
+    struct stat info;
+    enum nodeType type = Folder;
+    int exists = lstat(path, &info) == 0;
+    if (exists) {
+        if (S_ISDIR(info.st_mode)) type = Folder;
+        else if (S_ISREG(info.st_mode)) type = File;
+        else if (S_ISLNK(info.st_mode)) type = Symlink;
+        else exists = 0; // No counterpart for devices, sockets and pipes
+    }
+
+    if (item && (!exists || item->type != type)) {
+        watchRemove(item);
+        item = NULL;
+    }
+    if (!exists) {
+        free(path);
+        return;
+    }
+
+    if (type == Folder) {
+        if (!item) item = watchScanFolder(root, folder, name, path, info.st_mtime);
+        else if (!folderOf(item)->watcher) watchSubtree(root, item); // Made by the shell, or moved in
+        setNodeDate(item, info.st_mtime);
+    } else if (type == File) {
+        if (!item) {
+            item = createNode(name, File);
+            item->date = info.st_mtime;
+            if (info.st_size > 0) {
+                poolAttachPayload(activePool, item);
+                fileOf(item)->size = info.st_size;
+            }
+            appendChild(folder, item);
+        } else {
+            if (hasContent(item) && !realFileMatches(path, item)) contentFree(item);
+            if (nodeSize(item) != (size_t)info.st_size) setFileSize(item, info.st_size);
+        }
+        setNodeDate(item, info.st_mtime);
+    } else {
+        char target[MAX_PATH_LENGTH];
+        ssize_t length = readlink(path, target, sizeof(target) - 1);
+        target[length > 0 ? length : 0] = '\0';
+        if (!item) {
+            item = createNode(name, Symlink);
+            item->date = info.st_mtime;
+            appendChild(folder, item);
+        }
+        if (!symlinkTarget(item) || strcmp(symlinkTarget(item), target) != 0) {
+            if (journaling()) journalPush(JournalRetargeted, item)->saved = symlinkTarget(item);
+            else poolDiscardString(activePool, symlinkTarget(item));
+            symlinkOf(item)->target = poolString(activePool, target);
+            symlinkOf(item)->generation = 0;
+        }
+        setNodeDate(item, info.st_mtime);
+    }
+    free(path);
+}
+
+// Points a moved folder's handle at its new place. The writer is idle
+// (the queue was drained), and an open descriptor follows the directory.
+static void rebindMovedFolder(node* folder) {
+    dirHandle* handle = folderOf(folder)->handle;
+    if (!handle || handle->name[0] == '/') return;
+    dirHandle* parent = folderHandle(parentOf(folder));
+    __atomic_add_fetch(&parent->references, 1, __ATOMIC_RELAXED);
+    releaseHandle(handle->parent, 0);
+    handle->parent = parent;
+    free(handle->name);
+    handle->name = strdup(nameOf(folder));
+}
+
+// Compares a whole watched subtree with the disk, after lost events
+static void watchResync(watchRoot* root, node* folder) {
+    char* path = realDirectoryOf(folder);
+    DIR* directory = opendir(path);
+    free(path);
+    if (directory) {
+        struct dirent* entry;
+        while ((entry = readdir(directory))) {
+            const char* name = entry->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+            watchReconcile(root, folder, name);
+        }
+        closedir(directory);
+    }
+
+    // Anything the listing did not mention is gone; the rest may have
+    // lost events of its own
+    node* child = firstChildOf(folder);
+    while (child) {
+        node* next = nextOf(child);
+        char* name = strdup(nameOf(child));
+        watchReconcile(root, folder, name);
+        free(name);
+        child = next;
+    }
+    for (child = firstChildOf(folder); child; child = nextOf(child)) {
+        if (child->type == Folder && !(child->flags & NODE_STUB)) watchResync(root, child);
+    }
+}
+
+static int compareWatchEvents(const void* a, const void* b) {
+    const watchEvent* left = a;
+    const watchEvent* right = b;
+    if (left->root != right->root) return left->root < right->root ? -1 : 1;
+    if (left->wd != right->wd) return left->wd < right->wd ? -1 : 1;
+    return strcmp(watching.names + left->name, watching.names + right->name);
+}
+
+static int compareWatchCookies(const void* a, const void* b) {
+    const watchEvent* left = a;
+    const watchEvent* right = b;
+    if (left->cookie != right->cookie) return left->cookie < right->cookie ? -1 : 1;
+    return (left->mask & IN_MOVED_TO) - (right->mask & IN_MOVED_TO);
+}
+
+static void watchRecord(watchRoot* root, const struct inotify_event* event) {
+    if (event->mask & IN_Q_OVERFLOW) {
+        root->overflowed = 1;
+        return;
+    }
+    const char* name = event->len ? event->name : "";
+    if (!name[0] && !(event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))) return;
+
+    size_t length = strlen(name) + 1;
+    if (watching.namesUsed + length > watching.namesCapacity) {
+        watching.namesCapacity = watching.namesCapacity ? 2 * watching.namesCapacity : WATCH_BUFFER_SIZE;
+        while (watching.namesUsed + length > watching.namesCapacity) watching.namesCapacity *= 2;
+        watching.names = realloc(watching.names, watching.namesCapacity);
+    }
+    if (watching.count == watching.capacity) {
+        watching.capacity = watching.capacity ? 2 * watching.capacity : 256;
+        watching.events = realloc(watching.events, watching.capacity * sizeof(watchEvent));
+    }
+    memcpy(watching.names + watching.namesUsed, name, length);
+    watching.events[watching.count++] = (watchEvent){root, event->wd, event->mask, event->cookie, watching.namesUsed};
+    watching.namesUsed += length;
+}
+
+// Moves the node of each rename seen whole in this batch
+static void watchApplyMoves() {
+    size_t moves = 0;
+    for (size_t i = 0; i < watching.count; i++) {
+        if (watching.events[i].mask & (IN_MOVED_FROM | IN_MOVED_TO)) moves++;
+    }
+    if (moves < 2) return;
+
+    watchEvent* pairs = malloc(moves * sizeof(watchEvent));
+    moves = 0;
+    for (size_t i = 0; i < watching.count; i++) {
+        if (watching.events[i].mask & (IN_MOVED_FROM | IN_MOVED_TO)) pairs[moves++] = watching.events[i];
+    }
+    qsort(pairs, moves, sizeof(watchEvent), compareWatchCookies);
+    for (size_t i = 0; i + 1 < moves; i++) {
+        watchEvent* from = &pairs[i];
+        watchEvent* to = &pairs[i + 1];
+        if (from->cookie != to->cookie || !(from->mask & IN_MOVED_FROM) || !(to->mask & IN_MOVED_TO)) continue;
+        i++;
+
+        node* source = watchedFolder(from->root, from->wd);
+        node* destination = watchedFolder(to->root, to->wd);
+        if (!source || !destination || (source->flags & NODE_STUB) || (destination->flags & NODE_STUB)) continue;
+        node* item = indexLookup(source, watching.names + from->name);
+        const char* name = watching.names + to->name;
+        if (!item || indexLookup(destination, name) || isWithin(destination, item)) continue;
+
+        if (item->type == Folder && isWithin(watching.shell->currentFolder, item)) watching.moved = 1;
+        removeNode(item);
+        relabelNode(item, name);
+        appendChild(destination, item);
+        if (item->type == Folder) rebindMovedFolder(item);
+    }
+    free(pairs);
+}
+
+void applyWatchEvents(shellState* state) {
+    if (!activePool->watchers) return;
+    if (!watching.buffer) watching.buffer = malloc(WATCH_BUFFER_SIZE);
+
+    watching.count = 0;
+    watching.namesUsed = 0;
+    int overflowed = 0;
+    for (watchRoot* root = activePool->watchers; root; root = root->next) {
+        ssize_t length;
+        while ((length = read(root->fd, watching.buffer, WATCH_BUFFER_SIZE)) > 0) {
+            for (ssize_t offset = 0; offset < length;) {
+                const struct inotify_event* event = (const struct inotify_event*)(watching.buffer + offset);
+                offset += sizeof(struct inotify_event) + event->len;
+                watchRecord(root, event);
+            }
+        }
+        overflowed |= root->overflowed;
+    }
+    if (watching.count == 0 && !overflowed) {
+        sweepWatchRoots();
+        return;
+    }
+
+    // Our own queued changes land first, so the disk agrees with the tree
+    // about them
+    mirrorWait();
+    watching.shell = state;
+    watching.moved = 0;
+    watching.batches++;
+    watching.applied += watching.count;
+    watchApplyMoves();
+
+    qsort(watching.events, watching.count, sizeof(watchEvent), compareWatchEvents);
+    for (size_t i = 0; i < watching.count; i++) {
+        watchEvent* event = &watching.events[i];
+        if (i > 0 && compareWatchEvents(event, event - 1) == 0) continue;
+        node* folder = watchedFolder(event->root, event->wd);
+        if (!folder) continue;
+        const char* name = watching.names + event->name;
+        if (name[0]) {
+            watchReconcile(event->root, folder, name);
+        } else if (idOf(folder) == event->root->top && parentOf(folder)) {
+            // The watched folder itself was removed, moved away or unmounted
+            char* path = realDirectoryOf(folder);
+            struct stat info;
+            if (stat(path, &info) != 0) watchRemove(folder);
+            free(path);
+        }
+    }
+
+    // Watches the kernel dropped along with their directory
+    for (size_t i = 0; i < watching.count; i++) {
+        watchEvent* event = &watching.events[i];
+        node* folder = event->mask & IN_IGNORED ? watchedFolder(event->root, event->wd) : NULL;
+        if (folder) {
+            folderRecord* record = folderOf(folder);
+            record->watcher = NULL;
+            record->watch = 0;
+            event->root->folders[event->wd] = NO_NODE;
+            event->root->watches--;
+        }
+    }
+
+    for (watchRoot* root = activePool->watchers; root; root = root->next) {
+        if (!root->overflowed) continue;
+        root->overflowed = 0;
+        watching.rescans++;
+        node* top = nodeAt(root->top);
+        if (root->watches > 0 && top) {
+            note("Watch queue overflowed, reading '%s' again.\n", nameOf(top));
+            watchResync(root, top);
+        }
+    }
+    sweepWatchRoots();
+    if (watching.moved) rebuildShellPath(watching.shell);
+}
+
+void printWatchStats() {
+    size_t folders = 0;
+    size_t roots = 0;
+    for (watchRoot* root = activePool->watchers; root; root = root->next) {
+        folders += root->watches;
+        roots++;
+    }
+    if (roots == 0 && watching.batches == 0) return;
+    printf("Watch: %zu folders in %zu subtrees, %" PRIu64 " events in %" PRIu64 " batches, %" PRIu64 " rescans\n",
+           folders, roots, watching.applied, watching.batches, watching.rescans);
+}
+
+void displayPrompt(const char* path) {
+    printf("┌──[%s%s%s]\n└─%s>%s ", BLUE, path, RESET, GREEN, RESET);
+}
+
+// [Not Working] 
+// // Function to enable raw mode for real-time input
+// void enableRawMode() {
+//     struct termios raw;
+//     tcgetattr(STDIN_FILENO, &raw);
+//     raw.c_lflag &= ~(ICANON | ECHO); // Disable canonical mode and echo
+//     tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+// }
+
+// // Function to restore the terminal to default mode
+// void disableRawMode() {
+//     struct termios raw;
+//     tcgetattr(STDIN_FILENO, &raw);
+//     raw.c_lflag |= (ICANON | ECHO); // Enable canonical mode and echo
+//     tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+// }
+
+// // [Not Working] Function to read input in real-time with yellow color
+// char* getRealTimeInput() {
 //     enableRawMode();
 
 //     char* input = malloc(1024);
@@ -1311,227 +6838,679 @@ void displayPrompt(const char* path) {
 
 void displayNode(node* item) {
     if (item->type == File) {
-        printf("%s%s%s\n", YELLOW, item->name, RESET);
+        printf("%s%s%s\n", YELLOW, nameOf(item), RESET);
     } else if (item->type == Folder) {
-        printf("%s%s/%s\n", CYAN, item->name, RESET);
+        printf("%s%s/%s\n", CYAN, nameOf(item), RESET);
     } else if (item->type == Symlink) {
-        printf("%s%s@%s\n", BLUE, item->name, RESET);
-    }
-}
-
-
-int main() {
-
-    node *root = (node*) malloc(sizeof(node));
-
-    char *rootName = (char *) malloc(sizeof(char)*2);
-    strcpy(rootName, "/");
-    root->type = Folder;
-    root->name = rootName;
-    root->numberOfItems = 0;
-    root->size = 0;
-    root->date = time(NULL);
-    root->content =NULL;
-    root->previous = NULL;
-    root->parent = NULL;
-    root->next = NULL;
-    root->child = NULL;
-
-    node *currentFolder = root;
-
-    char *path = (char *) malloc(sizeof(char)*2);
-    strcpy(path, "/");
-
-     // Path to the real file system
-    char currentPath[2048] = ".";
-    getRealPath(currentFolder, currentPath); // Initialize to real root
-
-
-    while (1) {
-
-        displayPrompt(path);
-        char *command = getString();
-
-        // [Not Working] 
-        // char *command = getRealTimeInput();
-
-        if (strncmp(command, "mkdir", 5) == 0) {
-            make_dir(currentFolder, command); // Pass the full path
-        } else if (strncmp(command, "touch", 5) == 0) {
-            touch(currentFolder, command, currentPath); // Pass the full path
-        } else if (strcmp(command, "ls") == 0) {
-            ls(currentFolder);
-        } else if (strcmp(command, "lsrecursive") == 0) {
-            lsrecursive(currentFolder, 0);
-        } else if (strncmp(command, "edit", 4) == 0 ) {
-            edit(currentFolder, command);
-        } else if (strncmp(command, "clear", 5) == 0) {
-            clear(); // Call the clear function
-        } else if (strcmp(command, "pwd") == 0) {
-            pwd(path);
-        } else if (strcmp(command, "cdup") == 0) {
-            currentFolder = cdup(currentFolder, &path);
-        } else if (strncmp(command, "cd", 2) == 0) {
-            currentFolder = cd(currentFolder, command, &path, root);
-        } else if (strncmp(command, "rm", 2) == 0) {
-            rm(currentFolder, command);
-        } else if (strncmp(command, "mov", 3) == 0) {
-            mov(currentFolder, command);
-        } else if (strncmp(command, "echo", 4) == 0) {
-            char* fileName = strtok(command + 5, " ");
-            if (fileName) {
-                echo(currentFolder, fileName, root);
-            } else {
-                printf("Error: No file name provided. Usage: echo <fileName>\n");
-            }
-        } else if (strcmp(command, "count") == 0) {
-            int fileCount = countFiles(currentFolder);
-            int folderCount = countFolders(currentFolder);
-            printf("Files: %d\nFolders: %d\n", fileCount, folderCount);
-        } else if (strcmp(command, "countFiles") == 0) {
-            printf("Total files: %d\n", countFiles(root));
-        } else if (strcmp(command, "countFolders") == 0) {
-            printf("Total folders: %d\n", countFolders(root));
-        } else if (strncmp(command, "save", 4) == 0) {
-            char* filename = strtok(command + 5, " ");
-            if (filename) {
-                saveDirectory(root, filename);  // Save the entire directory tree to the specified file
-            } else {
-                printf("Error: No filename provided for saving.\n");
-            }
+        printf("%s%s@%s\n", BLUE, nameOf(item), RESET);
+    }
+}
 
-            // char* filename = strtok(command + 5, " ");
-            // if (filename) {
-            //     // Use gz compression for saving the directory structure
-            //     FILE* file = fopen(filename, "wb");
-            //     if (file) {
-            //         gzFile gzfile = gzdopen(fileno(file), "wb");
-            //         if (gzfile) {
-            //             saveDirectory(root, gzfile);
-            //             gzclose(gzfile);
-            //             printf("Directory structure compressed and saved to '%s'.\n", filename);
-            //         } else {
-            //             fclose(file);
-            //             printf("Error: Unable to open compressed stream for '%s'.\n", filename);
-            //         }
-            //     } else {
-            //         printf("Error: Could not create file '%s' for saving.\n", filename);
-            //     }
-            // } else {
-            //     printf("Error: No filename provided for saving.\n");
-            // }
-        } else if (strncmp(command, "load", 4) == 0) {
-            char* filename = strtok(command + 5, " ");
-            if (filename) {
-                node* loadedRoot = loadDirectory(filename);  // Load the directory tree from the specified file
-                if (loadedRoot) {
-                    freeNode(root);      // Free the current directory tree in memory
-                    root = loadedRoot;   // Replace with the loaded directory tree
-                    currentFolder = root; // Reset current folder to the root of the loaded tree
-                    free(path);
-                    path = strdup("/");  // Reset the path to the root
-                }
-            } else {
-                printf("Error: No filename provided for loading.\n");
-            }
-            // char* filename = strtok(command + 5, " ");
-            // if (filename) {
-            //     // Use gz decompression for loading the directory structure
-            //     FILE* file = fopen(filename, "rb");
-            //     if (file) {
-            //         gzFile gzfile = gzdopen(fileno(file), "rb");
-            //         if (gzfile) {
-            //             freeNode(root); // Free the current directory tree in memory
-            //             root = (node*)malloc(sizeof(node));
-            //             root->type = Folder;
-            //             root->name = strdup("/");
-            //             root->child = loadDirectory(gzfile, root);
-            //             gzclose(gzfile);
-            //             currentFolder = root; // Reset current folder to root
-            //             printf("Directory structure decompressed and loaded from '%s'.\n", filename);
-            //         } else {
-            //             fclose(file);
-            //             printf("Error: Unable to open compressed stream for '%s'.\n", filename);
-            //         }
-            //     } else {
-            //         printf("Error: Could not open file '%s' for loading.\n", filename);
-            //     }
-            // } else {
-            //     printf("Error: No filename provided for loading.\n");
-            // }
-        } else if (strncmp(command, "merge", 5) == 0) {
-            char* srcName = strtok(command + 6, " ");
-            char* destName = strtok(NULL, " ");
-            if (srcName && destName) {
-                node* srcFolder = getNode(currentFolder, srcName, Folder);
-                node* destFolder = getNode(currentFolder, destName, Folder);
-                if (srcFolder && destFolder) {
-                    mergeDirectories(destFolder, srcFolder);
-                } else {
-                    printf("Error: One or both directories not found.\n");
-                }
-            }
-        } else if (strncmp(command, "symlink", 7) == 0) {
-            char* sourcePath = strtok(command + 8, " ");
-            char* linkName = strtok(NULL, " ");
-            if (sourcePath && linkName) {
-                createSymlink(currentFolder, sourcePath, linkName, root);
-            } else {
-                printf("Error: Invalid arguments. Usage: symlink <source> <linkName>\n");
-            }
-        } else if (strncmp(command, "sortBy", 6) == 0) {
-            char* criterion = strtok(command + 7, " ");
-            if (criterion && (strcmp(criterion, "name") == 0 || strcmp(criterion, "date") == 0)) {
-                sortDirectory(currentFolder, criterion);
-            } else {
-                printf("Error: Sort criterion must be 'name' or 'date'.\n");
-            }
-        } else if (strncmp(command, "compress", 8) == 0) {
-            // char* filename = strtok(command + 9, " ");
-            // if (filename) {
-            //     compressDirectory(root, filename);
-            // }
-        } else if (strncmp(command, "decompress", 10) == 0) {
-            // char* filename = strtok(command + 11, " ");
-            // if (filename) {
-            //     node* decompressedRoot = decompressDirectory(filename);
-            //     if (decompressedRoot) {
-            //         freeNode(root);
-            //         root = decompressedRoot;
-            //         currentFolder = root;
-            //     }
-            // }
-        } else if (strncmp(command, "rename", 6) == 0) {
-            char* oldName = strtok(command + 7, " ");
+
+// Command handlers. Each gets the whole command line, whose argument count
+// has already been checked against the table, and returns 1 to exit.
+static int handleMkdir(shellState* state, char* command) {
+    make_dir(state->currentFolder, command);
+    return 0;
+}
+
+static int handleTouch(shellState* state, char* command) {
+    touch(state->currentFolder, command);
+    return 0;
+}
+
+static int handleLs(shellState* state, char* command) {
+    enum listFormat format;
+    if (parseListFormat(strtok(command + 2, " "), &format) != 0) {
+        reportError("Error: Usage: ls [--format=plain|json]\n");
+        return 0;
+    }
+    ls(state->currentFolder, format);
+    return 0;
+}
+
+static int handleLsrecursive(shellState* state, char* command) {
+    enum listFormat format;
+    if (parseListFormat(strtok(command + 11, " "), &format) != 0) {
+        reportError("Error: Usage: lsrecursive [--format=plain|json]\n");
+        return 0;
+    }
+    lsrecursive(state->currentFolder, format);
+    return 0;
+}
+
+static int handleEdit(shellState* state, char* command) {
+    edit(state->currentFolder, command);
+    return 0;
+}
+
+static int handleWrite(shellState* state, char* command) {
+    char* fileName = strtok(command + 6, " ");
+    writeFile(state->currentFolder, fileName, strtok(NULL, " "));
+    return 0;
+}
+
+static int handleAppend(shellState* state, char* command) {
+    appendFile(state->currentFolder, strtok(command + 7, " "));
+    return 0;
+}
+
+static int handleRead(shellState* state, char* command) {
+    char* fileName = strtok(command + 5, " ");
+    char* offset = strtok(NULL, " ");
+    readFile(state->currentFolder, fileName, offset, strtok(NULL, " "));
+    return 0;
+}
+
+static int handleClear(shellState* state, char* command) {
+    (void)state;
+    (void)command;
+    clear();
+    return 0;
+}
+
+static int handlePwd(shellState* state, char* command) {
+    (void)command;
+    pwd(state->path);
+    return 0;
+}
+
+static int handleCdup(shellState* state, char* command) {
+    (void)command;
+    state->currentFolder = cdup(state->currentFolder, &state->path);
+    return 0;
+}
+
+static int handleCd(shellState* state, char* command) {
+    state->currentFolder = cd(state->currentFolder, command, &state->path, state->root);
+    return 0;
+}
+
+static int handleRm(shellState* state, char* command) {
+    rm(state->currentFolder, command);
+    return 0;
+}
+
+static int handleMov(shellState* state, char* command) {
+    mov(state->currentFolder, command);
+    return 0;
+}
+
+static int handleEcho(shellState* state, char* command) {
+    char* fileName = strtok(command + 5, " ");
+    echo(state->currentFolder, fileName, state->root);
+    return 0;
+}
+
+static int handleCp(shellState* state, char* command) {
+    char* sourceName = strtok(command + 3, " ");
+    cp(state->currentFolder, sourceName, strtok(NULL, " "));
+    return 0;
+}
+
+static int handleCount(shellState* state, char* command) {
+    (void)command;
+    int fileCount = countFiles(state->currentFolder);
+    int folderCount = countFolders(state->currentFolder);
+    printf("Files: %d\nFolders: %d\n", fileCount, folderCount);
+    return 0;
+}
+
+static int handleCountFiles(shellState* state, char* command) {
+    (void)command;
+    printf("Total files: %d\n", countFiles(state->root));
+    return 0;
+}
+
+static int handleCountFolders(shellState* state, char* command) {
+    (void)command;
+    printf("Total folders: %d\n", countFolders(state->root));
+    return 0;
+}
+
+static int handleDu(shellState* state, char* command) {
+    char* target = strtok(command + 2, " ");
+    node* item = target ? parsePath(state->currentFolder, target, state->root) : state->currentFolder;
+    if (item) du(item);
+    return 0;
+}
+
+static int handleSave(shellState* state, char* command) {
+    char* filename = strtok(command + 5, " ");
+    int binary = strcmp(filename, "--binary") == 0;
+    if (binary) filename = strtok(NULL, " ");
+    if (filename && binary) {
+        saveSnapshot(state->root, filename);  // Save a binary snapshot that loads with one mmap
+    } else if (filename) {
+        saveDirectory(state->root, filename);  // Save the entire directory tree to the specified file
+    } else {
+        reportError("Error: No filename provided for saving.\n");
+    }
+    return 0;
+}
+
+// Builds a tree with 'loader' in a fresh pool and swaps it in only on
+// success, so a bad file leaves the current tree untouched
+static void replaceTree(shellState* state, node* (*loader)(const char*), const char* filename) {
+    int indexed = trigrams.built;
+    trigramReset(); // Its ids are the current pool's
+    treePool* previousPool = activePool;
+    activePool = poolCreate();
+    node* loadedRoot = loader(filename);
+    if (loadedRoot) {
+        journalReset(); // Snapshots are of the tree going away
+        poolDestroy(previousPool); // Free the current directory tree in memory
+        if (indexed) trigramBuildIndex();
+        state->root = loadedRoot;
+        state->currentFolder = loadedRoot;
+        free(state->path);
+        state->path = strdup("/");
+    } else {
+        poolDestroy(activePool);
+        activePool = previousPool;
+    }
+}
+
+static int handleLoad(shellState* state, char* command) {
+    replaceTree(state, loadDirectory, strtok(command + 5, " "));
+    return 0;
+}
+
+static int handleDecompress(shellState* state, char* command) {
+    replaceTree(state, decompressDirectory, strtok(command + 11, " "));
+    return 0;
+}
+
+static int handleImport(shellState* state, char* command) {
+    importDirectory(state->currentFolder, strtok(command + 6, " "));
+    return 0;
+}
+
+static int handleMount(shellState* state, char* command) {
+    mountDirectory(state->currentFolder, strtok(command + 5, " "));
+    return 0;
+}
+
+static int handleWatch(shellState* state, char* command) {
+    char* path = strtok(command + 5, " ");
+    node* folder = path ? parsePath(state->currentFolder, path, state->root) : state->currentFolder;
+    if (!folder || folder->type != Folder) {
+        reportError("Error: Folder '%s' not found.\n", path);
+        return 0;
+    }
+    watchDirectory(folder);
+    return 0;
+}
+
+static int handleUnwatch(shellState* state, char* command) {
+    (void)state;
+    (void)command;
+    unwatchAll();
+    note("Stopped watching.\n");
+    return 0;
+}
+
+static int handleCompress(shellState* state, char* command) {
+    compressDirectory(state->root, strtok(command + 9, " "));
+    return 0;
+}
+
+static int handleMerge(shellState* state, char* command) {
+    enum mergePolicy policy = MergeAsk;
+    char* srcName = strtok(command + 6, " ");
+    if (strncmp(srcName, "--", 2) == 0) {
+        if (parseMergePolicy(srcName, &policy) != 0) {
+            reportError("Error: Usage: merge [--policy=skip|rename|overwrite|newer|larger] <source> <destination>\n");
+            return 0;
+        }
+        srcName = strtok(NULL, " ");
+    }
+    char* destName = strtok(NULL, " ");
+    if (!destName) {
+        reportError("Error: Usage: merge [--policy=skip|rename|overwrite|newer|larger] <source> <destination>\n");
+        return 0;
+    }
+    node* srcFolder = getNode(state->currentFolder, srcName, Folder);
+    node* destFolder = getNode(state->currentFolder, destName, Folder);
+    if (srcFolder && destFolder) {
+        mergeDirectories(destFolder, srcFolder, policy, state);
+    } else {
+        reportError("Error: One or both directories not found.\n");
+    }
+    return 0;
+}
+
+static int handleReadlink(shellState* state, char* command) {
+    char* name = strtok(command + 9, " ");
+    int canonical = strcmp(name, "-f") == 0;
+    if (canonical) name = strtok(NULL, " ");
+    if (!name || strtok(NULL, " ")) {
+        reportError("Error: Usage: readlink [-f] <link>\n");
+        return 0;
+    }
+    node* item = parsePath(state->currentFolder, name, state->root);
+    if (!item) return 0;
+
+    // Without -f, the stored target as written
+    if (!canonical) {
+        if (item->type != Symlink) reportError("Error: '%s' is not a symlink.\n", name);
+        else printf("%s\n", symlinkTarget(item));
+        return 0;
+    }
+
+    int error;
+    node* target = resolveSymlinks(item, state->root, &error);
+    if (!target) {
+        if (error == ELOOP) reportError("Error: Too many levels of symbolic links at '%s'.\n", name);
+        else reportError("Error: Target of symlink '%s' not found.\n", name);
+        return 0;
+    }
+    char* path = nodePath(target);
+    printf("%s\n", path);
+    free(path);
+    return 0;
+}
+
+static int handleSnapshot(shellState* state, char* command) {
+    (void)state;
+    char* tag = strtok(command + 9, " ");
+    if (strcmp(tag, "--drop") != 0) {
+        snapshotTake(tag);
+    } else if ((tag = strtok(NULL, " "))) {
+        snapshotDrop(tag);
+    } else {
+        reportError("Error: No snapshot name provided.\n");
+    }
+    return 0;
+}
+
+static int handleRollback(shellState* state, char* command) {
+    snapshotRollback(state, strtok(command + 9, " "));
+    return 0;
+}
+
+static int handleSnapshots(shellState* state, char* command) {
+    (void)state;
+    (void)command;
+    printSnapshots();
+    return 0;
+}
+
+static int handleFind(shellState* state, char* command) {
+    // The path may be left out, as long as no test comes first
+    char* tokens[12];
+    size_t count = 0;
+    for (char* token = strtok(command + 4, " "); token && count < 12; token = strtok(NULL, " ")) tokens[count++] = token;
+    int hasPath = count > 0 && tokens[0][0] != '-';
+    findNodes(state->currentFolder, state->root, hasPath ? tokens[0] : ".", tokens + hasPath, count - hasPath);
+    return 0;
+}
+
+static int handleLocate(shellState* state, char* command) {
+    locate(state->root, strtok(command + 6, " "));
+    return 0;
+}
+
+static int handleSymlink(shellState* state, char* command) {
+    char* sourcePath = strtok(command + 8, " ");
+    char* linkName = strtok(NULL, " ");
+    createSymlink(state->currentFolder, sourcePath, linkName, state->root);
+    return 0;
+}
+
+static int handleSortBy(shellState* state, char* command) {
+    char* criterion = strtok(command + 7, " ");
+    if (strcmp(criterion, "name") == 0 || strcmp(criterion, "date") == 0 || strcmp(criterion, "none") == 0) {
+        sortDirectory(state->currentFolder, criterion);
+    } else {
+        reportError("Error: Sort criterion must be 'name', 'date' or 'none'.\n");
+    }
+    return 0;
+}
+
+static int handleRename(shellState* state, char* command) {
+    char* oldName = strtok(command + 7, " ");
     char* newName = strtok(NULL, " ");
-    if (oldName && newName) {
-            // Locate the node with the old name
-            node* targetNode = getNodeTypeless(currentFolder, oldName);
-                if (targetNode) {
-                    renameNode(targetNode, newName); // Call the updated rename function
-                } else {
-                    printf("Error: Node '%s' not found in the current directory.\n", oldName);
-                }
-            } else {
-                printf("Error: Insufficient arguments. Usage: rename <oldName> <newName>\n");
-            }
-        } else if (strncmp(command, "fullpath", 8) == 0) {
-            displayFullPath(currentFolder);
-            printf("\n");
-        } else if (strcmp(command, "exit") == 0){
-            free(command);
-            freeNode(root);
-            free(path);
-            break;
-        } else {
-            printf("Unknown command: %s\n", command);
+    node* targetNode = getNodeTypeless(state->currentFolder, oldName);
+    if (targetNode) {
+        renameNode(targetNode, newName);
+    } else {
+        reportError("Error: Node '%s' not found in the current directory.\n", oldName);
+    }
+    return 0;
+}
+
+static int handleMem(shellState* state, char* command) {
+    (void)state;
+    (void)command;
+    printPoolStats(activePool);
+    return 0;
+}
+
+static int handleFullpath(shellState* state, char* command) {
+    (void)command;
+    displayFullPath(state->currentFolder);
+    printf("\n");
+    return 0;
+}
+
+static int handleSource(shellState* state, char* command) {
+    return sourceScript(state, strtok(command + 7, " "));
+}
+
+static int handleStats(shellState* state, char* command) {
+    (void)state;
+    (void)command;
+    printCommandStats();
+    printMirrorStats();
+    printWatchStats();
+    return 0;
+}
+
+static int handleSync(shellState* state, char* command) {
+    (void)state;
+    (void)command;
+    mirrorWait();
+    reportMirrorErrors();
+    note("Real filesystem is up to date.\n");
+    return 0;
+}
+
+static int handleExit(shellState* state, char* command) {
+    (void)state;
+    (void)command;
+    return 1;
+}
+
+// Every command the shell understands, with the number of arguments it takes
+static const commandDescriptor commandTable[] = {
+    {"mkdir", handleMkdir, 1, 1, "mkdir <name>"},
+    {"touch", handleTouch, 1, 1, "touch <name>"},
+    {"ls", handleLs, 0, 1, "ls [--format=plain|json]"},
+    {"lsrecursive", handleLsrecursive, 0, 1, "lsrecursive [--format=plain|json]"},
+    {"edit", handleEdit, 1, 1, "edit <file>"},
+    {"write", handleWrite, 2, 2, "write <file> <offset>"},
+    {"append", handleAppend, 1, 1, "append <file>"},
+    {"read", handleRead, 3, 3, "read <file> <offset> <length>"},
+    {"clear", handleClear, 0, 0, "clear"},
+    {"pwd", handlePwd, 0, 0, "pwd"},
+    {"cdup", handleCdup, 0, 0, "cdup"},
+    {"cd", handleCd, 1, 1, "cd <path>"},
+    {"rm", handleRm, 1, 1, "rm <name>"},
+    {"mov", handleMov, 2, 2, "mov <name> <folder>"},
+    {"echo", handleEcho, 1, 1, "echo <file>"},
+    {"cp", handleCp, 2, 2, "cp <file> <name|folder>"},
+    {"count", handleCount, 0, 0, "count"},
+    {"countFiles", handleCountFiles, 0, 0, "countFiles"},
+    {"countFolders", handleCountFolders, 0, 0, "countFolders"},
+    {"du", handleDu, 0, 1, "du [path]"},
+    {"save", handleSave, 1, 2, "save [--binary] <file>"},
+    {"load", handleLoad, 1, 1, "load <file>"},
+    {"merge", handleMerge, 2, 3, "merge [--policy=skip|rename|overwrite|newer|larger] <source> <destination>"},
+    {"find", handleFind, 0, 11, "find [path] [-name glob] [-regex re] [-type f|d|l] [-size [+|-]N] [-newer date|path]"},
+    {"locate", handleLocate, 1, 1, "locate <text>"},
+    {"symlink", handleSymlink, 2, 2, "symlink <source> <linkName>"},
+    {"readlink", handleReadlink, 1, 2, "readlink [-f] <link>"},
+    {"snapshot", handleSnapshot, 1, 2, "snapshot [--drop] <name>"},
+    {"rollback", handleRollback, 1, 1, "rollback <name>"},
+    {"snapshots", handleSnapshots, 0, 0, "snapshots"},
+    {"sortBy", handleSortBy, 1, 1, "sortBy name|date|none"},
+    {"compress", handleCompress, 1, 1, "compress <file>"},
+    {"decompress", handleDecompress, 1, 1, "decompress <file>"},
+    {"import", handleImport, 1, 1, "import <realdir>"},
+    {"mount", handleMount, 1, 1, "mount <realdir>"},
+    {"watch", handleWatch, 0, 1, "watch [folder]"},
+    {"unwatch", handleUnwatch, 0, 0, "unwatch"},
+    {"rename", handleRename, 2, 2, "rename <oldName> <newName>"},
+    {"mem", handleMem, 0, 0, "mem"},
+    {"fullpath", handleFullpath, 0, 0, "fullpath"},
+    {"source", handleSource, 1, 1, "source <file>"},
+    {"stats", handleStats, 0, 0, "stats"},
+    {"sync", handleSync, 0, 0, "sync"},
+    {"exit", handleExit, 0, 0, "exit"},
+};
+
+#define COMMAND_COUNT (sizeof(commandTable) / sizeof(commandTable[0]))
+
+// Perfect hash over the command names: a seed is chosen once at startup so
+// that no two names share a slot, and a lookup is one hash and one strcmp
+static uint8_t commandSlots[COMMAND_SLOTS];
+static unsigned int commandSeed = 0;
+static commandStats commandTimings[COMMAND_COUNT];
+
+static unsigned int commandHash(const char* name, size_t length, unsigned int seed) {
+    unsigned int hash = 2166136261u ^ seed;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+    return (hash ^ (hash >> 15)) & (COMMAND_SLOTS - 1);
+}
+
+void buildCommandTable() {
+    for (unsigned int seed = 1;; seed++) {
+        memset(commandSlots, 0, sizeof(commandSlots));
+        size_t i = 0;
+        for (; i < COMMAND_COUNT; i++) {
+            const char* name = commandTable[i].name;
+            unsigned int slot = commandHash(name, strlen(name), seed);
+            if (commandSlots[slot]) break;
+            commandSlots[slot] = i + 1; // 0 marks an empty slot
+        }
+        if (i == COMMAND_COUNT) {
+            commandSeed = seed;
+            return;
+        }
+    }
+}
+
+const commandDescriptor* findCommand(const char* name, size_t length) {
+    uint8_t entry = commandSlots[commandHash(name, length, commandSeed)];
+    if (!entry) return NULL;
+
+    const commandDescriptor* descriptor = &commandTable[entry - 1];
+    if (strncmp(descriptor->name, name, length) != 0 || descriptor->name[length] != '\0') return NULL;
+    return descriptor;
+}
+
+// Log-linear bucket for a latency: exact below 32ns, then 16 buckets per
+// power of two, so every bucket is within about 6% of its values
+static int latencyBucket(uint64_t nanoseconds) {
+    if (nanoseconds < 2 * LATENCY_SUB_BUCKETS) return (int)nanoseconds;
+    int msb = 63 - __builtin_clzll(nanoseconds);
+    int shift = msb - LATENCY_SUB_BITS;
+    return shift * LATENCY_SUB_BUCKETS + (int)(nanoseconds >> shift);
+}
+
+// Largest latency that falls into 'bucket'
+static uint64_t latencyBucketValue(int bucket) {
+    if (bucket < 2 * LATENCY_SUB_BUCKETS) return bucket;
+    int shift = bucket / LATENCY_SUB_BUCKETS - 1;
+    uint64_t mantissa = bucket - shift * LATENCY_SUB_BUCKETS;
+    return ((mantissa + 1) << shift) - 1;
+}
+
+static uint64_t latencyPercentile(const commandStats* stats, double percentile) {
+    uint64_t rank = (uint64_t)(percentile / 100.0 * stats->calls + 0.5);
+    if (rank < 1) rank = 1;
+    uint64_t seen = 0;
+    for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+        seen += stats->buckets[bucket];
+        if (seen >= rank) {
+            uint64_t value = latencyBucketValue(bucket);
+            return value < stats->max ? value : stats->max;
         }
+    }
+    return stats->max;
+}
 
+static void formatLatency(char* buffer, size_t size, uint64_t nanoseconds) {
+    if (nanoseconds < 1000) snprintf(buffer, size, "%" PRIu64 "ns", nanoseconds);
+    else if (nanoseconds < 1000000) snprintf(buffer, size, "%.1fus", nanoseconds / 1e3);
+    else if (nanoseconds < 1000000000) snprintf(buffer, size, "%.1fms", nanoseconds / 1e6);
+    else snprintf(buffer, size, "%.2fs", nanoseconds / 1e9);
+}
+
+static int compareStatsByTotal(const void* a, const void* b) {
+    const commandStats* left = &commandTimings[*(const size_t*)a];
+    const commandStats* right = &commandTimings[*(const size_t*)b];
+    return (left->total < right->total) - (left->total > right->total);
+}
+
+// Prints call counts and latency percentiles, most expensive command first
+void printCommandStats() {
+    size_t order[COMMAND_COUNT];
+    size_t used = 0;
+    for (size_t i = 0; i < COMMAND_COUNT; i++) {
+        if (commandTimings[i].calls > 0) order[used++] = i;
+    }
+    qsort(order, used, sizeof(size_t), compareStatsByTotal);
+
+    printf("%-14s %10s %10s %10s %10s %10s\n", "command", "calls", "p50", "p99", "max", "total");
+    for (size_t i = 0; i < used; i++) {
+        const commandStats* stats = &commandTimings[order[i]];
+        char p50[16], p99[16], max[16], total[16];
+        formatLatency(p50, sizeof(p50), latencyPercentile(stats, 50));
+        formatLatency(p99, sizeof(p99), latencyPercentile(stats, 99));
+        formatLatency(max, sizeof(max), stats->max);
+        formatLatency(total, sizeof(total), stats->total);
+        printf("%-14s %10" PRIu64 " %10s %10s %10s %10s\n", commandTable[order[i]].name, stats->calls, p50, p99, max, total);
+    }
+    printf("Path cache: %" PRIu64 " hits, %" PRIu64 " misses\n", pathCacheHits, pathCacheMisses);
+}
+
+// Runs one command line against the shell state. Returns 1 when the
+// shell should exit.
+int executeCommand(shellState* state, char* command) {
+    size_t nameLength = strcspn(command, " ");
+    const commandDescriptor* descriptor = findCommand(command, nameLength);
+    if (!descriptor) {
+        reportError("Unknown command: %s\n", command);
+        return 0;
+    }
+
+    int arguments = 0;
+    for (const char* cursor = command + nameLength; *cursor;) {
+        cursor += strspn(cursor, " ");
+        if (!*cursor) break;
+        arguments++;
+        cursor += strcspn(cursor, " ");
+    }
+    if (arguments < descriptor->minArguments || arguments > descriptor->maxArguments) {
+        reportError("Error: Usage: %s\n", descriptor->usage);
+        return 0;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int exitRequested = descriptor->handler(state, command);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    uint64_t elapsed = (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000u + (end.tv_nsec - start.tv_nsec);
+    commandStats* stats = &commandTimings[descriptor - commandTable];
+    stats->calls++;
+    stats->total += elapsed;
+    if (elapsed > stats->max) stats->max = elapsed;
+    stats->buckets[latencyBucket(elapsed)]++;
+    return exitRequested;
+}
+
+// Reads and runs commands from 'input' until it ends or a command asks to
+// exit. Returns 1 on exit.
+int runCommands(shellState* state, FILE* input, int interactive) {
+    FILE* previousInput = commandInput;
+    commandInput = input;
+
+    int exitRequested = 0;
+    while (!exitRequested) {
+        reportMirrorErrors();
+        if (interactive) displayPrompt(state->path);
+        char* command = getString();
+        if (!command) break; // End of input
+
+        if (command[0] != '\0') {
+            applyWatchEvents(state); // Whatever changed while the shell waited for input
+            exitRequested = executeCommand(state, command);
+            commandCount++;
+        }
         free(command);
     }
 
-    return 0;
+    commandInput = previousInput;
+    return exitRequested;
+}
+
+// Runs a script quietly and prints a one-line summary
+int sourceScript(shellState* state, const char* filename) {
+    FILE* script = fopen(filename, "r");
+    if (!script) {
+        reportError("Error: Could not open script '%s'.\n", filename);
+        return 0;
+    }
+    setvbuf(script, NULL, _IOFBF, BATCH_BUFFER_SIZE);
+
+    int previousQuiet = quietMode;
+    unsigned long startCommands = commandCount;
+    unsigned long startErrors = errorCount;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    quietMode = 1;
+    int exitRequested = runCommands(state, script, 0);
+    quietMode = previousQuiet;
+    fclose(script);
+
+    printBatchSummary(&start, commandCount - startCommands, errorCount - startErrors);
+    return exitRequested;
+}
+
+void printBatchSummary(const struct timespec* start, unsigned long commands, unsigned long errors) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+    fflush(stdout);
+    fprintf(stderr, "%lu commands in %.3fs (%.0f ops/sec), %lu errors\n",
+            commands, seconds, seconds > 0 ? commands / seconds : 0.0, errors);
+}
+
+// bench.c includes this file for the tree code and brings its own main
+#ifndef FILESYSTEM_NO_MAIN
+int main(int argc, char** argv) {
+    // --batch [script]: no prompts or confirmations, block-buffered I/O
+    int batch = argc > 1 && strcmp(argv[1], "--batch") == 0;
+    FILE* input = stdin;
+    if (batch) {
+        if (argc > 2 && !(input = fopen(argv[2], "r"))) {
+            reportError("Error: Could not open script '%s'.\n", argv[2]);
+            return 1;
+        }
+        setvbuf(input, NULL, _IOFBF, BATCH_BUFFER_SIZE);
+        setvbuf(stdout, NULL, _IOFBF, BATCH_BUFFER_SIZE);
+        quietMode = 1;
+    }
+
+    buildCommandTable();
+    activePool = poolCreate();
+    shellState state;
+    state.root = createNode("/", Folder);
+    state.currentFolder = state.root;
+    state.path = strdup("/");
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    runCommands(&state, input, !batch);
+    mirrorShutdown();
+    if (batch) {
+        printBatchSummary(&start, commandCount, errorCount);
+        if (input != stdin) fclose(input);
+    }
+
+    poolDestroy(activePool);
+    clearPathCache();
+    free(state.path);
+    return errorCount > 0 && batch ? 1 : 0;
 }
+#endif
 
 //==11180== HEAP SUMMARY:
 //==11180==     in use at exit: 0 bytes in 0 blocks
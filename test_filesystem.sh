@@ -80,6 +80,51 @@ else
     cat valgrind.log
 fi
 
+# Test 6: A dangling symlink resolves again once its target is recreated
+echo -e "${BLUE}Test 6:${RESET} Following a symlink whose target was removed and recreated..."
+OUTPUT=$(echo -e "touch t\nsymlink t l\nrm t\ny\necho l\ntouch t\necho l\nreadlink -f l\nexit" | $EXECUTABLE --batch 2>&1)
+if [[ $(echo "$OUTPUT" | grep -c "Target of symlink 'l' not found") -eq 1 && $(echo "$OUTPUT" | grep -cx "/t") -eq 1 ]]; then
+    echo -e "${GREEN}PASS:${RESET} Symlink followed its recreated target."
+else
+    echo -e "${RED}FAIL:${RESET} Symlink stayed dangling after its target was recreated."
+    echo "$OUTPUT"
+fi
+
+# Test 7: Rolling back an edit leaves a tree that saves and loads
+echo -e "${BLUE}Test 7:${RESET} Saving and loading a tree after rolling back an edit..."
+OUTPUT=$(echo -e "touch f\nsnapshot s\nedit f\nsecret\nrollback s\nsave --binary x.bin\nload x.bin\nread f 0 6\nexit" | $EXECUTABLE --batch 2>&1)
+if [[ "$OUTPUT" != *"Failed to load"* && "$OUTPUT" != *"secret"* && "$OUTPUT" == *", 0 errors"* ]]; then
+    echo -e "${GREEN}PASS:${RESET} Rolled back tree saved and loaded."
+else
+    echo -e "${RED}FAIL:${RESET} Rolled back tree did not survive a save and load."
+    echo "$OUTPUT"
+fi
+
+# Test 8: Rolling back brings the real filesystem back in step
+echo -e "${BLUE}Test 8:${RESET} Rolling back changes to real files..."
+OUTPUT=$(echo -e "touch gone\nedit gone\nkept\nsnapshot s\nrm gone\ny\ntouch extra\nrollback s\nexit" | $EXECUTABLE --batch 2>&1)
+if [[ "$(cat gone 2>/dev/null)" == "kept" && ! -e extra && "$OUTPUT" == *", 0 errors"* ]]; then
+    echo -e "${GREEN}PASS:${RESET} Rollback restored the removed file and removed the new one."
+else
+    echo -e "${RED}FAIL:${RESET} Rollback left the real filesystem out of step."
+    echo "$OUTPUT"
+fi
+
+# Test 9: A snapshot whose header claims more than the file holds is rejected
+echo -e "${BLUE}Test 9:${RESET} Loading a corrupt binary snapshot..."
+echo -e "touch t\nsymlink t l\nsave --binary good.bin\nexit" | $EXECUTABLE --batch > /dev/null 2>&1
+cp good.bin bad.bin
+printf '\x00\x00\x00\x00\x00\x00\x00\x40' | dd of=bad.bin bs=1 seek=32 conv=notrunc status=none  # content section size
+printf '\x00\x00\x00\x00\x00\x00\x00\x40' | dd of=bad.bin bs=1 seek=176 conv=notrunc status=none # symlink target length
+head -c 100 good.bin > short.bin
+OUTPUT=$(echo -e "load bad.bin\nload short.bin\nload good.bin\nreadlink l\nexit" | $EXECUTABLE --batch 2>&1)
+if [[ $(echo "$OUTPUT" | grep -c "Failed to load") -eq 2 && $(echo "$OUTPUT" | grep -cx "t") -eq 1 ]]; then
+    echo -e "${GREEN}PASS:${RESET} Corrupt and truncated snapshots were rejected."
+else
+    echo -e "${RED}FAIL:${RESET} Corrupt or truncated snapshot was not rejected cleanly."
+    echo "$OUTPUT"
+fi
+
 # Cleanup
 cd ..
 rm -rf $TEST_DIR $COMPRESSED_FILE $DECOMPRESSED_DIR